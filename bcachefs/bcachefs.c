@@ -1,8 +1,18 @@
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "bcachefs.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BENZ_BCH_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define BENZ_BCH_X86_SIMD 0
+#endif
+
 
 // Our data structure structs are really just header of contiguous lists.  Most
 // of the time, the header always start with the size of full list in bytes
@@ -177,8 +187,14 @@ const struct bset *benz_bch_next_bset(const struct btree_node *p, const void *p_
 
             _cb += (uint64_t)p;
 
+            // Do not look past the written sectors, the node could be mapped
+            // in place in which case the bytes there are not zeroed
+            if ((const void*)_cb >= p_end)
+            {
+                c = NULL;
+            }
             // Checksum is not supported yet so we expect it to be 0
-            if (!memcmp(_cb, &(struct bch_csum){0}, sizeof(struct bch_csum)))
+            else if (!memcmp(_cb, &(struct bch_csum){0}, sizeof(struct bch_csum)))
             {
                 // skip btree_node_entry csum
                 c = (const void*)(_cb + sizeof(struct bch_csum));
@@ -339,6 +355,327 @@ uint64_t benz_bch_parse_bkey_field(const struct bkey *bkey, const struct bkey_fo
     }
 }
 
+// Format specialised key decoders. Most btree nodes use a format where the
+// inode, offset and size fields are 0, 8, 16, 32 or 64 bits and the snapshot
+// and version fields are unused. A decoder is generated for each of those
+// formats so the fields are read at fixed locations without interpreting
+// bits_per_field.
+
+static inline uint64_t _benz_bch_read_u0(const uint8_t *bytes)
+{
+    (void)bytes;
+    return 0;
+}
+
+static inline uint64_t _benz_bch_read_u8(const uint8_t *bytes)
+{
+    return *bytes;
+}
+
+static inline uint64_t _benz_bch_read_u16(const uint8_t *bytes)
+{
+    uint16_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint64_t _benz_bch_read_u32(const uint8_t *bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint64_t _benz_bch_read_u64(const uint8_t *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+#define _BENZ_BCH_DECODER_SIZE_BITS(X, I, O) X(I, O, 0) X(I, O, 8) X(I, O, 16) X(I, O, 32) X(I, O, 64)
+#define _BENZ_BCH_DECODER_OFFSET_BITS(X, I) \
+    _BENZ_BCH_DECODER_SIZE_BITS(X, I, 0) _BENZ_BCH_DECODER_SIZE_BITS(X, I, 8) \
+    _BENZ_BCH_DECODER_SIZE_BITS(X, I, 16) _BENZ_BCH_DECODER_SIZE_BITS(X, I, 32) \
+    _BENZ_BCH_DECODER_SIZE_BITS(X, I, 64)
+#define _BENZ_BCH_DECODER_FORMATS(X) \
+    _BENZ_BCH_DECODER_OFFSET_BITS(X, 0) _BENZ_BCH_DECODER_OFFSET_BITS(X, 8) \
+    _BENZ_BCH_DECODER_OFFSET_BITS(X, 16) _BENZ_BCH_DECODER_OFFSET_BITS(X, 32) \
+    _BENZ_BCH_DECODER_OFFSET_BITS(X, 64)
+
+#define _BENZ_BCH_DEFINE_DECODER(I, O, S) \
+void _benz_bch_decode_bkey_##I##_##O##_##S(const struct bkey *bkey, const struct bkey_format *format, struct bkey_local_buffer *buffer) \
+{ \
+    if (bkey->format != KEY_FORMAT_LOCAL_BTREE) \
+    { \
+        *buffer = benz_bch_parse_bkey_buffer(bkey, format, BKEY_NR_FIELDS); \
+        return; \
+    } \
+    const uint8_t *end = (const uint8_t*)bkey + format->key_u64s * BCH_U64S_SIZE; \
+    buffer->buffer[BKEY_FIELD_INODE] = format->field_offset[BKEY_FIELD_INODE] + \
+        _benz_bch_read_u##I(end - I / 8); \
+    buffer->buffer[BKEY_FIELD_OFFSET] = format->field_offset[BKEY_FIELD_OFFSET] + \
+        _benz_bch_read_u##O(end - I / 8 - O / 8); \
+    buffer->buffer[BKEY_FIELD_SNAPSHOT] = format->field_offset[BKEY_FIELD_SNAPSHOT]; \
+    buffer->buffer[BKEY_FIELD_SIZE] = format->field_offset[BKEY_FIELD_SIZE] + \
+        _benz_bch_read_u##S(end - I / 8 - O / 8 - S / 8); \
+    buffer->buffer[BKEY_FIELD_VERSION_HI] = format->field_offset[BKEY_FIELD_VERSION_HI]; \
+    buffer->buffer[BKEY_FIELD_VERSION_LO] = format->field_offset[BKEY_FIELD_VERSION_LO]; \
+    buffer->key_u64s = format->key_u64s; \
+}
+_BENZ_BCH_DECODER_FORMATS(_BENZ_BCH_DEFINE_DECODER)
+#undef _BENZ_BCH_DEFINE_DECODER
+
+// Decoders indexed by the bits of the inode, offset and size fields
+#define _BENZ_BCH_DECODER_ENTRY(I, O, S) _benz_bch_decode_bkey_##I##_##O##_##S,
+static const benz_bch_bkey_decoder _benz_bch_bkey_decoders[] = {
+    _BENZ_BCH_DECODER_FORMATS(_BENZ_BCH_DECODER_ENTRY)
+};
+#undef _BENZ_BCH_DECODER_ENTRY
+
+// Index of a field size in the specialised decoders table, -1 if there is no
+// decoder for this size
+int _benz_bch_decoder_bits_index(uint8_t bits)
+{
+    switch (bits)
+    {
+    case 0:
+        return 0;
+    case 8:
+        return 1;
+    case 16:
+        return 2;
+    case 32:
+        return 3;
+    case 64:
+        return 4;
+    }
+    return -1;
+}
+
+void _benz_bch_decode_bkey_generic(const struct bkey *bkey, const struct bkey_format *format, struct bkey_local_buffer *buffer)
+{
+    *buffer = benz_bch_parse_bkey_buffer(bkey, format, BKEY_NR_FIELDS);
+}
+
+// Get a decoder of all the fields of the keys of a btree node, specialised for
+// the node's format if possible. The decoder gives the same result as
+// benz_bch_parse_bkey_buffer with BKEY_NR_FIELDS
+benz_bch_bkey_decoder benz_bch_get_bkey_decoder(const struct bkey_format *format)
+{
+    const int inode = _benz_bch_decoder_bits_index(format->bits_per_field[BKEY_FIELD_INODE]);
+    const int offset = _benz_bch_decoder_bits_index(format->bits_per_field[BKEY_FIELD_OFFSET]);
+    const int size = _benz_bch_decoder_bits_index(format->bits_per_field[BKEY_FIELD_SIZE]);
+    if (inode < 0 || offset < 0 || size < 0 ||
+        format->bits_per_field[BKEY_FIELD_SNAPSHOT] ||
+        format->bits_per_field[BKEY_FIELD_VERSION_HI] ||
+        format->bits_per_field[BKEY_FIELD_VERSION_LO])
+    {
+        return _benz_bch_decode_bkey_generic;
+    }
+    return _benz_bch_bkey_decoders[inode * 25 + offset * 5 + size];
+}
+
+// Location of the packed fields in the keys of a btree node. Fields are stored
+// backward from the end of the key
+struct _benz_bch_unpack_plan {
+    uint16_t end[BKEY_NR_FIELDS];           // offset of the byte following the field
+    uint8_t bits[BKEY_NR_FIELDS];
+    uint64_t field_offset[BKEY_NR_FIELDS];
+    int simd;                               // all the fields have a size the vector unpackers support
+};
+
+struct _benz_bch_unpack_plan _benz_bch_unpack_plan(const struct bkey_format *format, enum bch_bkey_fields fields_cnt)
+{
+    struct _benz_bch_unpack_plan plan = {.simd = 1};
+    uint16_t end = format->key_u64s * BCH_U64S_SIZE;
+    for (enum bch_bkey_fields i = 0; i < fields_cnt; ++i)
+    {
+        plan.bits[i] = format->bits_per_field[i];
+        plan.field_offset[i] = format->field_offset[i];
+        end -= plan.bits[i] / 8;
+        plan.end[i] = end + plan.bits[i] / 8;
+        switch (plan.bits[i])
+        {
+        case 0:
+        case 8:
+        case 16:
+        case 32:
+        case 64:
+            break;
+        default:
+            plan.simd = 0;
+        }
+    }
+    return plan;
+}
+
+void _benz_bch_unpack_bkey(const struct bkey *bkey,
+                           const struct bkey_format *format,
+                           const struct _benz_bch_unpack_plan *plan,
+                           enum bch_bkey_fields fields_cnt,
+                           uint64_t **columns,
+                           uint64_t i)
+{
+    if (bkey->format != KEY_FORMAT_LOCAL_BTREE)
+    {
+        const struct bkey_local_buffer buffer = benz_bch_parse_bkey_buffer(bkey, format, fields_cnt);
+        for (enum bch_bkey_fields field = 0; field < fields_cnt; ++field)
+        {
+            if (columns[field])
+            {
+                columns[field][i] = buffer.buffer[field];
+            }
+        }
+        return;
+    }
+    const uint8_t *bytes = (const void*)bkey;
+    for (enum bch_bkey_fields field = 0; field < fields_cnt; ++field)
+    {
+        if (columns[field] == NULL)
+        {
+            continue;
+        }
+        columns[field][i] = plan->field_offset[field];
+        if (plan->bits[field])
+        {
+            columns[field][i] += benz_uintXX_as_uint64(bytes + plan->end[field] - plan->bits[field] / 8,
+                                                       plan->bits[field]);
+        }
+    }
+}
+
+#if BENZ_BCH_X86_SIMD
+// The vector unpackers gather the 8 bytes ending at the end of each field and
+// shift the field down. The gathered bytes never start before the node as keys
+// always follow the node and bset headers.
+
+__attribute__((target("avx2")))
+uint64_t _benz_bch_unpack_bkeys_avx2(const struct bkey **bkeys,
+                                     uint64_t num,
+                                     const struct bkey_format *format,
+                                     const struct _benz_bch_unpack_plan *plan,
+                                     enum bch_bkey_fields fields_cnt,
+                                     uint64_t **columns)
+{
+    uint64_t i = 0;
+    for (; i + 4 <= num; i += 4)
+    {
+        if (bkeys[i]->format != KEY_FORMAT_LOCAL_BTREE ||
+            bkeys[i + 1]->format != KEY_FORMAT_LOCAL_BTREE ||
+            bkeys[i + 2]->format != KEY_FORMAT_LOCAL_BTREE ||
+            bkeys[i + 3]->format != KEY_FORMAT_LOCAL_BTREE)
+        {
+            for (uint64_t j = i; j < i + 4; ++j)
+            {
+                _benz_bch_unpack_bkey(bkeys[j], format, plan, fields_cnt, columns, j);
+            }
+            continue;
+        }
+        const uint8_t *base = (const void*)bkeys[i];
+        const __m256i index = _mm256_set_epi64x((const uint8_t*)(const void*)bkeys[i + 3] - base,
+                                                (const uint8_t*)(const void*)bkeys[i + 2] - base,
+                                                (const uint8_t*)(const void*)bkeys[i + 1] - base,
+                                                0);
+        for (enum bch_bkey_fields field = 0; field < fields_cnt; ++field)
+        {
+            if (columns[field] == NULL)
+            {
+                continue;
+            }
+            __m256i value = _mm256_setzero_si256();
+            if (plan->bits[field])
+            {
+                value = _mm256_i64gather_epi64((const long long*)(const void*)(base + plan->end[field] - 8), index, 1);
+                value = _mm256_srl_epi64(value, _mm_cvtsi32_si128(64 - plan->bits[field]));
+            }
+            value = _mm256_add_epi64(value, _mm256_set1_epi64x((long long)plan->field_offset[field]));
+            _mm256_storeu_si256((void*)(columns[field] + i), value);
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx512f")))
+uint64_t _benz_bch_unpack_bkeys_avx512(const struct bkey **bkeys,
+                                       uint64_t num,
+                                       const struct bkey_format *format,
+                                       const struct _benz_bch_unpack_plan *plan,
+                                       enum bch_bkey_fields fields_cnt,
+                                       uint64_t **columns)
+{
+    uint64_t i = 0;
+    for (; i + 8 <= num; i += 8)
+    {
+        int packed = 1;
+        for (uint64_t j = i; j < i + 8; ++j)
+        {
+            packed &= bkeys[j]->format == KEY_FORMAT_LOCAL_BTREE;
+        }
+        if (!packed)
+        {
+            for (uint64_t j = i; j < i + 8; ++j)
+            {
+                _benz_bch_unpack_bkey(bkeys[j], format, plan, fields_cnt, columns, j);
+            }
+            continue;
+        }
+        const uint8_t *base = (const void*)bkeys[i];
+        const __m512i index = _mm512_set_epi64((const uint8_t*)(const void*)bkeys[i + 7] - base,
+                                               (const uint8_t*)(const void*)bkeys[i + 6] - base,
+                                               (const uint8_t*)(const void*)bkeys[i + 5] - base,
+                                               (const uint8_t*)(const void*)bkeys[i + 4] - base,
+                                               (const uint8_t*)(const void*)bkeys[i + 3] - base,
+                                               (const uint8_t*)(const void*)bkeys[i + 2] - base,
+                                               (const uint8_t*)(const void*)bkeys[i + 1] - base,
+                                               0);
+        for (enum bch_bkey_fields field = 0; field < fields_cnt; ++field)
+        {
+            if (columns[field] == NULL)
+            {
+                continue;
+            }
+            __m512i value = _mm512_setzero_si512();
+            if (plan->bits[field])
+            {
+                value = _mm512_i64gather_epi64(index, (const void*)(base + plan->end[field] - 8), 1);
+                value = _mm512_srl_epi64(value, _mm_cvtsi32_si128(64 - plan->bits[field]));
+            }
+            value = _mm512_add_epi64(value, _mm512_set1_epi64((long long)plan->field_offset[field]));
+            _mm512_storeu_si512((void*)(columns[field] + i), value);
+        }
+    }
+    return i;
+}
+#endif
+
+// Unpack the first fields_cnt fields of the keys of a btree node into columns,
+// columns[field][i] receiving the field of bkeys[i]. NULL columns are skipped.
+// Packed keys are unpacked with AVX-512 or AVX2 if the CPU supports it
+void benz_bch_unpack_bkeys(const struct bkey **bkeys,
+                           uint64_t num,
+                           const struct bkey_format *format,
+                           enum bch_bkey_fields fields_cnt,
+                           uint64_t **columns)
+{
+    const struct _benz_bch_unpack_plan plan = _benz_bch_unpack_plan(format, fields_cnt);
+    uint64_t i = 0;
+#if BENZ_BCH_X86_SIMD
+    if (plan.simd && __builtin_cpu_supports("avx512f"))
+    {
+        i = _benz_bch_unpack_bkeys_avx512(bkeys, num, format, &plan, fields_cnt, columns);
+    }
+    else if (plan.simd && __builtin_cpu_supports("avx2"))
+    {
+        i = _benz_bch_unpack_bkeys_avx2(bkeys, num, format, &plan, fields_cnt, columns);
+    }
+#endif
+    for (; i < num; ++i)
+    {
+        _benz_bch_unpack_bkey(bkeys[i], format, &plan, fields_cnt, columns, i);
+    }
+}
+
 inline uint64_t benz_bch_get_block_size(const struct bch_sb *sb)
 {
     return (uint64_t)sb->block_size * BCH_SECTOR_SIZE;
@@ -439,6 +776,77 @@ uint64_t benz_bch_fread_btree_node(struct btree_node *btree_node, const struct b
     return fread(btree_node, btree_ptr->sectors_written * BCH_SECTOR_SIZE, 1, fp);
 }
 
+// Same as `benz_bch_fread_btree_node` but doesn't move the file position so
+// multiple threads can read nodes from the same file descriptor
+uint64_t benz_bch_pread_btree_node(struct btree_node *btree_node, const struct bch_sb *sb, const struct bch_btree_ptr_v2 *btree_ptr, int fd)
+{
+    uint64_t offset = benz_bch_get_extent_offset(btree_ptr->start);
+    size_t size = btree_ptr->sectors_written * BCH_SECTOR_SIZE;
+    memset(btree_node, 0, benz_bch_get_btree_node_size(sb));
+    return pread(fd, btree_node, size, (off_t)offset) == (ssize_t)size;
+}
+
+// Get the superblock from a read-only mapping of the disk image. Returns NULL
+// if the mapping is too small to hold the superblock or if the magic doesn't
+// match
+const struct bch_sb *benz_bch_map_sb(const uint8_t *map, uint64_t map_size)
+{
+    const uint64_t offset = BCH_SB_SECTOR * BCH_SECTOR_SIZE;
+    const struct bch_sb *sb = (const void*)(map + offset);
+    if (map_size < offset + benz_bch_get_sb_size(NULL))
+    {
+        return NULL;
+    }
+    uint64_t size = benz_bch_get_sb_size(sb);
+    if (size == 0 || map_size < offset + size)
+    {
+        return NULL;
+    }
+    return sb;
+}
+
+// Get a btree node from a read-only mapping of the disk image without copying
+// it. Only the `sectors_written` sectors of the node are meaningful, the rest
+// of the node is left as it is on disk. Returns NULL if the node is not
+// entirely contained in the mapping
+const struct btree_node *benz_bch_map_btree_node(const uint8_t *map,
+                                                 uint64_t map_size,
+                                                 const struct bch_sb *sb,
+                                                 const struct bch_btree_ptr_v2 *btree_ptr)
+{
+    uint64_t offset = benz_bch_get_extent_offset(btree_ptr->start);
+    uint64_t size = btree_ptr->sectors_written * BCH_SECTOR_SIZE;
+    if (size > benz_bch_get_btree_node_size(sb) || offset > map_size || map_size - offset < size)
+    {
+        return NULL;
+    }
+    return (const void*)(map + offset);
+}
+
+// Hint the kernel that a btree node is about to be read so the read happens in
+// the background. `map` is the read-only mapping of the disk image or NULL
+// to advise on `fd` instead. Returns 0 if the hint couldn't be given
+int benz_bch_prefetch_btree_node(const uint8_t *map,
+                                 uint64_t map_size,
+                                 const struct bch_btree_ptr_v2 *btree_ptr,
+                                 int fd)
+{
+    uint64_t offset = benz_bch_get_extent_offset(btree_ptr->start);
+    uint64_t size = btree_ptr->sectors_written * BCH_SECTOR_SIZE;
+    if (map)
+    {
+        if (offset > map_size || map_size - offset < size)
+        {
+            return 0;
+        }
+        // madvise needs a page aligned address
+        uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+        uint64_t start = offset / page_size * page_size;
+        return !madvise((void*)(map + start), offset + size - start, MADV_WILLNEED);
+    }
+    return !posix_fadvise(fd, (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+}
+
 void benz_print_uuid(const struct uuid *uuid)
 {
     unsigned int i = 0;
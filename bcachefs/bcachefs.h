@@ -721,6 +721,13 @@ const struct bkey *benz_bch_next_bkey(const struct bset *p, const struct bkey *c
 struct bkey_local benz_bch_parse_bkey(const struct bkey *bkey, const struct bkey_local_buffer *buffer);
 struct bkey_local_buffer benz_bch_parse_bkey_buffer(const struct bkey *bkey, const struct bkey_format *format, enum bch_bkey_fields fields_cnt);
 uint64_t benz_bch_parse_bkey_field(const struct bkey *bkey, const struct bkey_format *format, enum bch_bkey_fields field);
+typedef void (*benz_bch_bkey_decoder)(const struct bkey *bkey, const struct bkey_format *format, struct bkey_local_buffer *buffer);
+benz_bch_bkey_decoder benz_bch_get_bkey_decoder(const struct bkey_format *format);
+void benz_bch_unpack_bkeys(const struct bkey **bkeys,
+                           uint64_t num,
+                           const struct bkey_format *format,
+                           enum bch_bkey_fields fields_cnt,
+                           uint64_t **columns);
 
 uint64_t benz_bch_get_sb_size(const struct bch_sb *sb);
 uint64_t benz_bch_get_block_size(const struct bch_sb *sb);
@@ -739,6 +746,17 @@ struct btree_node *benz_bch_malloc_btree_node(const struct bch_sb *sb);
 
 uint64_t benz_bch_fread_sb(struct bch_sb *sb, uint64_t size, FILE *fp);
 uint64_t benz_bch_fread_btree_node(struct btree_node *btree_node, const struct bch_sb *sb, const struct bch_btree_ptr_v2 *btree_ptr, FILE *fp);
+uint64_t benz_bch_pread_btree_node(struct btree_node *btree_node, const struct bch_sb *sb, const struct bch_btree_ptr_v2 *btree_ptr, int fd);
+
+const struct bch_sb *benz_bch_map_sb(const uint8_t *map, uint64_t map_size);
+const struct btree_node *benz_bch_map_btree_node(const uint8_t *map,
+                                                 uint64_t map_size,
+                                                 const struct bch_sb *sb,
+                                                 const struct bch_btree_ptr_v2 *btree_ptr);
+int benz_bch_prefetch_btree_node(const uint8_t *map,
+                                 uint64_t map_size,
+                                 const struct bch_btree_ptr_v2 *btree_ptr,
+                                 int fd);
 
 void benz_print_uuid(const struct uuid *uuid);
 
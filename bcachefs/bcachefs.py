@@ -1,5 +1,6 @@
 # This Python file uses the following encoding: utf-8
 
+import bisect
 import io
 import os
 from dataclasses import dataclass
@@ -8,7 +9,10 @@ from typing import Generator, List, Tuple, Union
 import numpy as np
 
 from bcachefs.c_bcachefs import (
+    INDEX_SUFFIX,
+    DirEnt as _DirEnt,
     PyBcachefs as _Bcachefs,
+    PyBcachefs_catalog as _Bcachefs_catalog,
     PyBcachefs_iterator as _Bcachefs_iterator,
 )
 
@@ -20,6 +24,28 @@ DIRENT_TYPE = 2
 DIR_TYPE = 4
 FILE_TYPE = 8
 
+# Layouts of the records filled by the iterators' next_batch
+EXTENT_DTYPE = np.dtype(
+    [
+        ("inode", "<u8"),
+        ("file_offset", "<u8"),
+        ("offset", "<u8"),
+        ("size", "<u8"),
+    ]
+)
+INODE_DTYPE = np.dtype(
+    [("inode", "<u8"), ("size", "<u8"), ("hash_seed", "<u8")]
+)
+DIRENT_DTYPE = np.dtype(
+    [
+        ("parent_inode", "<u8"),
+        ("inode", "<u8"),
+        ("name_offset", "<u8"),
+        ("name_len", "<u4"),
+        ("type", "<u4"),
+    ]
+)
+
 
 @dataclass(eq=True, frozen=True)
 class Extent:
@@ -123,20 +149,25 @@ class _BcachefsFileBinary(io.BufferedIOBase):
 
     size: int
         size of the file being opened
+
+    read_file: callable, optional
+        native reader of whole files returning a buffer or None
     """
 
-    def __init__(self, name, extents, file, inode, size):
+    def __init__(self, name, extents, file, inode, size, read_file=None):
         self.name = name
         self._inode = inode
         self._size = size
+        self._read_file = read_file
 
         # underlying bcachefs archive
         # DO NOT close this!!
         self._file = file
 
         # sort by offset so the extents are always in the right order
-        sorted(extents, key=lambda extent: extent.file_offset)
-        self._extents = extents
+        self._extents = sorted(extents, key=lambda extent: extent.file_offset)
+        # start of each extent to bisect when seeking
+        self._extent_offsets = [extent.file_offset for extent in self._extents]
 
         self._extent_pos = 0  # current extent being read
         self._extent_read = (
@@ -194,19 +225,34 @@ class _BcachefsFileBinary(io.BufferedIOBase):
         size = self.readinto1(view)
         return bytes(buffer[:size])
 
-    def readall(self) -> bytes:
-        """Most efficient way to read a file, single allocation"""
-        buffer = np.empty(self._size, dtype="<u1")
-        memory = memoryview(buffer)
+    def getbuffer(self) -> memoryview:
+        """Return a read-only view over the content of the file, without
+        copying it when it lies in a single extent of a mapped disk image
 
-        for extent in self._extents:
-            s = extent.file_offset
-            e = s + extent.size
+        Notes
+        -----
+        The view can be handed to `np.frombuffer` or `io.BytesIO` without
+        further copies, a view into the disk image keeps it open until the
+        view is released
+        """
+        data = self._read_file(self._inode) if self._read_file else None
+        if data is None:
+            data = bytearray(self._size)
+            memory = memoryview(data)
 
-            self._file.seek(extent.offset)
-            self._file.readinto(memory[s:e])
+            for extent in self._extents:
+                s = extent.file_offset
+                e = s + extent.size
+
+                self._file.seek(extent.offset)
+                self._file.readinto(memory[s:e])
 
-        return bytes(buffer)
+        return memoryview(data).toreadonly()
+
+    def readall(self) -> bytes:
+        """Most efficient way to read a file, single copy"""
+        buffer = self.getbuffer()
+        return buffer.obj if isinstance(buffer.obj, bytes) else bytes(buffer)
 
     def readinto1(self, b: memoryview) -> int:
         """Read at most one extend
@@ -284,16 +330,15 @@ class _BcachefsFileBinary(io.BufferedIOBase):
         if whence == io.SEEK_SET:
             self.reset()
 
-            e = 0
-            for i, extent in enumerate(self._extents):
-                s = extent.file_offset
-                e = s + extent.size
+            i = bisect.bisect_right(self._extent_offsets, offset) - 1
+            if i >= 0:
+                s = self._extents[i].file_offset
+                e = s + self._extents[i].size
 
                 if s <= offset < e:
                     self._extent_pos = i
                     self._extent_read = offset - s
                     self._pos = offset
-                    break
 
             return offset
 
@@ -376,7 +421,7 @@ class FilesystemMixin:
         """
         del mode, encoding
         inode = name
-        if isinstance(name, DirEnt):
+        if isinstance(name, (DirEnt, _DirEnt)):
             inode = name.inode
         elif isinstance(name, str):
             dirent = self._find_dirent(name)
@@ -391,17 +436,22 @@ class FilesystemMixin:
 
         file_size = inode.size
         base = _BcachefsFileBinary(
-            name, extents, self._file, inode.inode, file_size
+            name, extents, self._file, inode.inode, file_size, self._read_file
         )
         return base
 
-    def read(self, inode: Union[str, int]) -> memoryview:
+    def read(self, inode: Union[str, int]) -> bytes:
         """Read and return all the bytes from the file
 
         Parameters
         ----------
         inode: str, int
             Path or inode integer of a file
+
+        Notes
+        -----
+        `open(inode).getbuffer()` returns a read-only view over the file
+        instead, without copying it when possible
         """
         with self.open(inode) as f:
             return f.readall()
@@ -431,7 +481,7 @@ class FilesystemMixin:
         path: str, DirEnt
             Path or DirEnt of a directory
         """
-        if isinstance(path, DirEnt):
+        if isinstance(path, (DirEnt, _DirEnt)):
             parent = path
         else:
             parent = self._find_dirent(path)
@@ -458,7 +508,7 @@ class FilesystemMixin:
         top: str, int
             Path or DirEnt of a file
         """
-        if isinstance(top, DirEnt):
+        if isinstance(top, (DirEnt, _DirEnt)):
             parent = top
             top = top.name
         elif not top:
@@ -496,6 +546,18 @@ class FilesystemMixin:
         del inode
         raise NotImplemented
 
+    def _read_file(self, inode: int):
+        """Return a buffer with the content of a file, or None if it can't be
+        read natively
+
+        Parameters
+        ----------
+        inode: int
+            inode integer of a file
+        """
+        del inode
+        return None
+
     def _find_inode(self, inode: int) -> Inode:
         """Return the inode informations of a file
 
@@ -610,7 +672,7 @@ class ZipFileLikeMixin(FilesystemMixin):
     ):
         return FilesystemMixin.open(self, name, mode, encoding)
 
-    def read(self, inode: Union[str, int]) -> memoryview:
+    def read(self, inode: Union[str, int]) -> bytes:
         return FilesystemMixin.read(self, inode)
 
     def close(self):
@@ -633,6 +695,7 @@ class Bcachefs(ZipFileLikeMixin):
         assert mode in ("r", "rb"), "Only reading is supported"
         self._filesystem = _Bcachefs()
         self._filesystem.open(path)
+        self._filesystem.open_index(path + INDEX_SUFFIX)
         self._file: io.RawIOBase = open(path, "rb")
         self._unmounted = False
 
@@ -661,6 +724,7 @@ class Bcachefs(ZipFileLikeMixin):
         else:
             self._filesystem = _Bcachefs()
             self._filesystem.open(self._file.name)
+            self._filesystem.open_index(self._file.name + INDEX_SUFFIX)
 
     @property
     def filename(self) -> str:
@@ -674,16 +738,50 @@ class Bcachefs(ZipFileLikeMixin):
         return Cursor(self, path)
 
     def extents(self):
-        for extent in BcachefsIterExtent(self._filesystem):
-            yield extent
+        """Iterate natively over the extents, as c_bcachefs.Extent"""
+        return self._iter(EXTENT_TYPE)
 
     def inodes(self):
-        for inode in BcachefsIterInode(self._filesystem):
-            yield inode
+        """Iterate natively over the live inodes, as c_bcachefs.Inode"""
+        return self._iter(INODE_TYPE)
 
     def dirents(self):
-        for dirent in BcachefsIterDirEnt(self._filesystem):
-            yield dirent
+        """Iterate natively over the live directory entries, as
+        c_bcachefs.DirEnt"""
+        return self._iter(DIRENT_TYPE)
+
+    def _iter(self, t: int):
+        return (
+            self._filesystem.iter(t)
+            if self._filesystem is not None
+            else iter(())
+        )
+
+    def catalog(self) -> _Bcachefs_catalog:
+        """Return the read-only catalog of the paths, inodes and extent runs
+        of the image
+
+        The catalog is mapped from the sidecar index if it is valid for the
+        image, otherwise it is built natively with a single scan of the
+        btrees.
+        """
+        return self._filesystem.catalog(self.filename + INDEX_SUFFIX)
+
+    def write_index(self, path: str = None):
+        """Write the sidecar index of the image and use it for lookups
+
+        Processes mounting the image afterward find the index next to it, or
+        ignore it if the image changed since.
+
+        Parameters
+        ----------
+        path: str
+            Path of the index, the image path followed by INDEX_SUFFIX by
+            default
+        """
+        path = path or self.filename + INDEX_SUFFIX
+        self._filesystem.write_index(path)
+        self._filesystem.open_index(path)
 
     def umount(self):
         if not self._unmounted:
@@ -699,10 +797,13 @@ class Bcachefs(ZipFileLikeMixin):
         return Extent(*extent) if extent else None
 
     def _find_extents(self, inode: int) -> Generator[Extent, None, None]:
-        extent = self._find_extent(inode, 0)
-        while extent:
-            yield extent
-            extent = self._find_extent(inode, extent.file_offset + extent.size)
+        if not inode:
+            return
+        for extent in self._filesystem.find_extents(inode):
+            yield Extent(*extent)
+
+    def _read_file(self, inode: int):
+        return self._filesystem.read_file(inode)
 
     def _find_inode(self, inode: int) -> Inode:
         inode = self._filesystem.find_inode(inode)
@@ -727,12 +828,10 @@ class Bcachefs(ZipFileLikeMixin):
     def _find_dirents(
         self, dirent: DirEnt = None
     ) -> Generator[DirEnt, None, None]:
-        iter = BcachefsIterDirEnt(self._filesystem)
-        for ent in iter:
-            if ent.parent_inode == dirent.inode:
-                yield ent
-            elif ent.parent_inode > dirent.inode:
-                break
+        if self._filesystem is None:
+            return
+        for ent in self._filesystem.scandir(dirent.inode):
+            yield DirEnt(*ent)
 
     def _walk(self, top: str, dirent: DirEnt):
         ls = set(self.scandir(dirent))
@@ -745,26 +844,20 @@ class Bcachefs(ZipFileLikeMixin):
 
 class Cursor(ZipFileLikeMixin):
     """Cursor of a filesystem opened at a specific directory. Calls will be made
-    relative to that directory and its recursive content will be cached"""
+    relative to that directory and are answered by the native catalog of the
+    image"""
 
     def __init__(
         self,
         filesystem: Union[str, FilesystemMixin],
         path: str,
-        extents_map=None,
-        inodes_ls=None,
-        inodes_tree=None,
-        inode_map=None,
+        catalog: _Bcachefs_catalog = None,
     ):
         fs = Bcachefs(filesystem) if isinstance(filesystem, str) else filesystem
         self._file = open(fs.filename, "rb")
         self._pwd = path.strip("/")
+        self._catalog = fs.catalog() if catalog is None else catalog
         self._dirent = fs._find_dirent(path)
-        self._extents_map = extents_map
-        self._inodes_ls = inodes_ls
-        self._inodes_tree = inodes_tree
-        self._inode_map = inode_map
-        self._parse(fs)
 
     def __enter__(self):
         if self._file.closed:
@@ -785,11 +878,15 @@ class Cursor(ZipFileLikeMixin):
     def __getstate__(self):
         state = self.__dict__.copy()
         state["_file"] = self._file.name
+        # The catalog is mapped from the sidecar index or rebuilt natively
+        del state["_catalog"]
         return state
 
     def __setstate__(self, state):
         self.__dict__ = {**self.__dict__, **state}
         self._file = open(self._file, "rb")
+        with Bcachefs(self._file.name) as fs:
+            self._catalog = fs.catalog()
 
     @property
     def filename(self) -> str:
@@ -806,20 +903,11 @@ class Cursor(ZipFileLikeMixin):
     def cd(self, path: Union[str, int] = ""):
         if not path:
             path = "/"
-        if self._find_dirent(path):
-            fs = self
-            extents_map = self._extents_map
-            inodes_ls = self._inodes_ls
-            inodes_tree = self._inodes_tree
-            inode_map = self._inode_map
-        else:
-            fs = self.filename
-            extents_map = None
-            inodes_ls = None
-            inodes_tree = None
-            inode_map = None
+        fs = self if self._find_dirent(path) else self.filename
+        return Cursor(fs, path, self._catalog)
 
-        return Cursor(fs, path, extents_map, inodes_ls, inodes_tree, inode_map)
+    def catalog(self) -> _Bcachefs_catalog:
+        return self._catalog
 
     def close(self):
         if not self._file.closed:
@@ -833,152 +921,101 @@ class Cursor(ZipFileLikeMixin):
                 break
 
     def _find_extents(self, inode: int) -> Generator[Extent, None, None]:
-        extents = self._extents_map.get(inode, None)
-        if extents is None:
-            raise StopIteration
-        else:
-            for extent in extents:
-                yield extent
+        if not inode:
+            return
+        for extent in self._catalog.find_extents(inode):
+            yield Extent(*extent)
 
     def _find_inode(self, inode: int) -> Inode:
-        return self._inode_map.get(inode, None)
+        inode = self._catalog.find_inode(inode) if inode else None
+        return Inode(*inode) if inode else None
 
     def _find_dirent(self, path: str = None) -> DirEnt:
         dirent = ROOT_DIRENT if path and path.startswith("/") else self._dirent
         if (
             dirent is not self._dirent
-            and self._inodes_ls.get(dirent.inode, None) is None
+            and self._dirent.inode != ROOT_DIRENT.inode
         ):
+            # Only the content of the cursor's directory is reachable
             dirent = None
         elif path:
             parts = [p for p in path.split("/") if p]
             while parts:
-                dirent = self._inodes_tree.get(
-                    (dirent.inode, parts.pop(0)), None
+                dirent = self._catalog.find_dirent(
+                    dirent.inode, parts.pop(0).encode()
                 )
                 if dirent is None:
                     break
+                else:
+                    dirent = DirEnt(*dirent)
         return dirent
 
     def _find_dirents(self, dirent: DirEnt = None) -> DirEnt:
-        for ent in self._inodes_ls[dirent.inode]:
-            yield ent
-
-    def _parse(self, filesystem: Bcachefs):
-        """Generate a cache of bcachefs btrees"""
-        if self._extents_map:
-            return
-
-        self._inodes_ls = {ROOT_DIRENT.inode: []}
-        self._inodes_tree = {}
-
-        # Keep a clean version of the structs
-        extents_map = {}
-        inodes_ls = {self._dirent.inode: []}
-        inodes_tree = {}
-        inode_map = {}
-
-        # Load all dirents
-        dirents = list(filesystem.dirents())
-        for dirent in dirents:
-            if dirent.is_dir:
-                self._inodes_ls.setdefault(dirent.inode, [])
-
-        for dirent in dirents:
-            self._inodes_ls[dirent.parent_inode].append(dirent)
-            self._inodes_tree[(dirent.parent_inode, dirent.name)] = dirent
-
-        # Filter only files and directorys under self.pwd
-        for _, dirs, files in self.walk(self._dirent):
-            for d in dirs:
-                inodes_ls.setdefault(d.inode, [])
-                inodes_ls[d.parent_inode].append(d)
-                inodes_tree[(d.parent_inode, d.name)] = d
-            for f in files:
-                extents_map[f.inode] = []
-                inode_map[f.inode] = None
-                inodes_ls[f.parent_inode].append(f)
-                inodes_tree[(f.parent_inode, f.name)] = f
-
-        self._extents_map = extents_map
-        self._inode_map = inode_map
-        self._inodes_ls = inodes_ls
-        self._inodes_tree = inodes_tree
-
-        for extent in filesystem.extents():
-            if extent.inode not in self._extents_map:
-                continue
-            self._extents_map[extent.inode].append(extent)
-
-        for inode in filesystem.inodes():
-            if (
-                inode.inode not in self._inode_map
-                or self._inode_map.get(inode.inode, None) is not None
-            ):
-                continue
-            self._inode_map[inode.inode] = inode
-
-        for inode, extents in self._extents_map.items():
-            self._extents_map[inode] = self._unique_extent_list(extents)
-
-        for parent_inode, ls in self._inodes_ls.items():
-            self._inodes_ls[parent_inode] = self._unique_dirent_list(ls)
+        for ent in self._catalog.scandir(dirent.inode):
+            ent = DirEnt(*ent)
+            if ent.is_dir or ent.is_file:
+                yield ent
 
     def _walk(self, top: str, dirent: DirEnt):
-        dirs = [ent for ent in self._inodes_ls[dirent.inode] if ent.is_dir]
-        files = [ent for ent in self._inodes_ls[dirent.inode] if ent.is_file]
+        ls = list(self._find_dirents(dirent))
+        dirs = [ent for ent in ls if ent.is_dir]
+        files = [ent for ent in ls if ent.is_file]
         yield top, dirs, files
         for d in dirs:
             yield from self._walk(os.path.join(top, d.name), d)
 
-    @staticmethod
-    def _unique_extent_list(inode_extents):
-        # It's possible to have multiple duplicated extents for a single inode
-        # and this implementation assumes that the last ones should be the
-        # correct ones.
-        unique_extent_list = []
-        for ent in reversed(sorted(inode_extents, key=lambda _: _.file_offset)):
-            if not unique_extent_list:
-                unique_extent_list.append(ent)
-            elif (
-                ent.file_offset + ent.size == unique_extent_list[0].file_offset
-            ):
-                if ent.offset + ent.size == unique_extent_list[0].offset:
-                    ent = Extent(
-                        ent.inode,
-                        ent.file_offset,
-                        ent.offset,
-                        ent.size + unique_extent_list[0].size,
-                    )
-                    unique_extent_list.pop(0)
-                unique_extent_list.insert(0, ent)
-        return unique_extent_list
-
-    @staticmethod
-    def _unique_dirent_list(dirent_ls):
-        # It's possible to have multiple inodes for a single file and this
-        # implementation assumes that the last inode should be the correct one.
-        return list({ent.name: ent for ent in dirent_ls}.values())
-
 
 class BcachefsIter:
     class _EmptyIter:
+        def __iter__(self):
+            return self
+
+        def __next__(self):
+            raise StopIteration
+
         def next(self):
             return None
 
+        def next_batch(self, *buffers):
+            return 0
+
+    _DTYPES = {
+        EXTENT_TYPE: EXTENT_DTYPE,
+        INODE_TYPE: INODE_DTYPE,
+        DIRENT_TYPE: DIRENT_DTYPE,
+    }
+
     def __init__(self, fs: _Bcachefs, t: int = DIRENT_TYPE):
         self._iter: _Bcachefs_iterator = (
             fs.iter(t) if fs is not None else self._EmptyIter()
         )
+        self._type = t
 
     def __iter__(self):
         return self
 
     def __next__(self):
-        item = self._iter.next()
-        if item is None:
-            raise StopIteration
-        return item
+        # Deleted inodes and dirents are skipped natively
+        return next(self._iter)
+
+    def next_batch(self, n: int):
+        """Return the next items, up to `n`, as a NumPy structured array
+
+        Dirents are returned along with a bytes buffer holding their names at
+        `name_offset`. The batch is empty once the iteration is over.
+        """
+        records = np.empty(n, dtype=self._DTYPES[self._type])
+        if self._type != DIRENT_TYPE:
+            return records[: self._iter.next_batch(records)]
+        # Batches end early rather than overflowing the names
+        names = np.empty(n * 32 + 255, dtype="<u1")
+        records = records[: self._iter.next_batch(records, names)]
+        names_size = (
+            int(records["name_offset"][-1] + records["name_len"][-1])
+            if len(records)
+            else 0
+        )
+        return records, names[:names_size]
 
 
 class BcachefsIterExtent(BcachefsIter):
@@ -996,14 +1033,9 @@ class BcachefsIterInode(BcachefsIter):
 
     def __init__(self, fs: _Bcachefs):
         super(BcachefsIterInode, self).__init__(fs, INODE_TYPE)
-        self._deleted = set()
 
     def __next__(self):
-        inode = Inode(*super(BcachefsIterInode, self).__next__())
-        while not inode.hash_seed or inode.inode in self._deleted:
-            self._deleted.add(inode.inode)
-            inode = Inode(*super(BcachefsIterInode, self).__next__())
-        return inode
+        return Inode(*super(BcachefsIterInode, self).__next__())
 
 
 class BcachefsIterDirEnt(BcachefsIter):
@@ -1011,14 +1043,6 @@ class BcachefsIterDirEnt(BcachefsIter):
 
     def __init__(self, fs: _Bcachefs):
         super(BcachefsIterDirEnt, self).__init__(fs, DIRENT_TYPE)
-        self._deleted = set()
 
     def __next__(self):
-        dirent = DirEnt(*super(BcachefsIterDirEnt, self).__next__())
-        while (
-            not dirent.inode
-            or (dirent.parent_inode, dirent.name) in self._deleted
-        ):
-            self._deleted.add((dirent.parent_inode, dirent.name))
-            dirent = DirEnt(*super(BcachefsIterDirEnt, self).__next__())
-        return dirent
+        return DirEnt(*super(BcachefsIterDirEnt, self).__next__())
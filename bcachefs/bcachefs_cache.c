@@ -0,0 +1,608 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcachefs_cache.h"
+
+// Number of buckets for a number of nodes, as a power of 2 with a load
+// factor of at most 1/2
+uint32_t _Bcachefs_node_cache_num_buckets(uint32_t max_nodes)
+{
+    uint32_t num_buckets = 16;
+    while (num_buckets < max_nodes * 2 && num_buckets < (1u << 30))
+    {
+        num_buckets *= 2;
+    }
+    return num_buckets;
+}
+
+Bcachefs_node **_Bcachefs_node_cache_bucket(Bcachefs_node **buckets, uint32_t num_buckets, uint64_t offset)
+{
+    // Fibonacci hashing of the sector offset
+    return &buckets[(offset * 0x9E3779B97F4A7C15ull >> 32) & (num_buckets - 1)];
+}
+
+void _Bcachefs_node_cache_unlink(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    if (node->prev)
+    {
+        node->prev->next = node->next;
+    }
+    else
+    {
+        cache->head = node->next;
+    }
+    if (node->next)
+    {
+        node->next->prev = node->prev;
+    }
+    else
+    {
+        cache->tail = node->prev;
+    }
+    node->prev = node->next = NULL;
+}
+
+void _Bcachefs_node_cache_push_front(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    node->prev = NULL;
+    node->next = cache->head;
+    if (cache->head)
+    {
+        cache->head->prev = node;
+    }
+    else
+    {
+        cache->tail = node;
+    }
+    cache->head = node;
+}
+
+void _Bcachefs_node_cache_remove(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    Bcachefs_node **link = _Bcachefs_node_cache_bucket(cache->buckets, cache->num_buckets, node->offset);
+    for (; *link != node; link = &(*link)->hash_next) {}
+    *link = node->hash_next;
+    node->hash_next = NULL;
+    _Bcachefs_node_cache_unlink(cache, node);
+    --cache->num_nodes;
+}
+
+// Keep the buffers of a node which is not in the cache for a later load
+void _Bcachefs_node_cache_recycle(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    if (cache->num_free_nodes >= BCACHEFS_NODE_POOL_SIZE)
+    {
+        Bcachefs_node_free(node);
+        return;
+    }
+    *node = (Bcachefs_node){
+        .buffer = node->buffer,
+        .keys = node->keys,
+        .inodes = node->inodes,
+        .capacity = node->capacity,
+        .next = cache->free_nodes
+    };
+    cache->free_nodes = node;
+    ++cache->num_free_nodes;
+}
+
+// Evict unused nodes, least recently used first, until the cache fits in its
+// maximum number of nodes
+void _Bcachefs_node_cache_evict(Bcachefs_node_cache *cache)
+{
+    Bcachefs_node *node = cache->tail;
+    while (node && cache->num_nodes > cache->max_nodes)
+    {
+        Bcachefs_node *prev = node->prev;
+        if (node->refs == 0)
+        {
+            _Bcachefs_node_cache_remove(cache, node);
+            _Bcachefs_node_cache_recycle(cache, node);
+        }
+        node = prev;
+    }
+}
+
+Bcachefs_node *_Bcachefs_node_cache_find(Bcachefs_node_cache *cache, uint64_t offset, uint16_t sectors_written)
+{
+    Bcachefs_node *node = *_Bcachefs_node_cache_bucket(cache->buckets, cache->num_buckets, offset);
+    for (; node; node = node->hash_next)
+    {
+        if (node->offset == offset && node->sectors_written == sectors_written)
+        {
+            break;
+        }
+    }
+    return node;
+}
+
+void _Bcachefs_node_cache_acquire(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    ++node->refs;
+    if (cache->head != node)
+    {
+        _Bcachefs_node_cache_unlink(cache, node);
+        _Bcachefs_node_cache_push_front(cache, node);
+    }
+}
+
+int Bcachefs_node_cache_init(Bcachefs_node_cache *cache, uint32_t max_nodes)
+{
+    *cache = (Bcachefs_node_cache){0};
+    cache->num_buckets = _Bcachefs_node_cache_num_buckets(max_nodes);
+    cache->buckets = calloc(cache->num_buckets, sizeof(Bcachefs_node*));
+    cache->max_nodes = max_nodes;
+    if (cache->buckets && pthread_mutex_init(&cache->lock, NULL))
+    {
+        free(cache->buckets);
+        cache->buckets = NULL;
+    }
+    return cache->buckets != NULL;
+}
+
+void Bcachefs_node_cache_fini(Bcachefs_node_cache *cache)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        Bcachefs_node *node = i == 0 ? cache->head : cache->free_nodes;
+        while (node)
+        {
+            Bcachefs_node *next = node->next;
+            Bcachefs_node_free(node);
+            node = next;
+        }
+    }
+    if (cache->buckets)
+    {
+        pthread_mutex_destroy(&cache->lock);
+    }
+    free(cache->buckets);
+    *cache = (Bcachefs_node_cache){0};
+}
+
+int Bcachefs_node_cache_resize(Bcachefs_node_cache *cache, uint32_t max_nodes)
+{
+    uint32_t num_buckets = _Bcachefs_node_cache_num_buckets(max_nodes);
+    pthread_mutex_lock(&cache->lock);
+    if (num_buckets != cache->num_buckets)
+    {
+        Bcachefs_node **buckets = calloc(num_buckets, sizeof(Bcachefs_node*));
+        if (buckets == NULL)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return 0;
+        }
+        for (Bcachefs_node *node = cache->head; node; node = node->next)
+        {
+            Bcachefs_node **bucket = _Bcachefs_node_cache_bucket(buckets, num_buckets, node->offset);
+            node->hash_next = *bucket;
+            *bucket = node;
+        }
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->num_buckets = num_buckets;
+    }
+    cache->max_nodes = max_nodes;
+    _Bcachefs_node_cache_evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+Bcachefs_node *Bcachefs_node_cache_alloc(Bcachefs_node_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    Bcachefs_node *node = cache->free_nodes;
+    if (node)
+    {
+        cache->free_nodes = node->next;
+        node->next = NULL;
+        --cache->num_free_nodes;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return node ? node : calloc(1, sizeof(Bcachefs_node));
+}
+
+void Bcachefs_node_cache_recycle(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    pthread_mutex_lock(&cache->lock);
+    _Bcachefs_node_cache_recycle(cache, node);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+Bcachefs_node *Bcachefs_node_cache_get(Bcachefs_node_cache *cache, const struct bch_btree_ptr_v2 *btree_ptr)
+{
+    pthread_mutex_lock(&cache->lock);
+    Bcachefs_node *node = _Bcachefs_node_cache_find(cache, btree_ptr->start->offset,
+                                                    btree_ptr->sectors_written);
+    if (node)
+    {
+        _Bcachefs_node_cache_acquire(cache, node);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return node;
+}
+
+Bcachefs_node *Bcachefs_node_cache_put(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    pthread_mutex_lock(&cache->lock);
+    Bcachefs_node *cached = _Bcachefs_node_cache_find(cache, node->offset, node->sectors_written);
+    if (cached)
+    {
+        // Another thread loaded the same node first
+        _Bcachefs_node_cache_acquire(cache, cached);
+        _Bcachefs_node_cache_recycle(cache, node);
+        pthread_mutex_unlock(&cache->lock);
+        return cached;
+    }
+    Bcachefs_node **bucket = _Bcachefs_node_cache_bucket(cache->buckets, cache->num_buckets, node->offset);
+    node->refs = 1;
+    node->hash_next = *bucket;
+    *bucket = node;
+    _Bcachefs_node_cache_push_front(cache, node);
+    ++cache->num_nodes;
+    _Bcachefs_node_cache_evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+    return node;
+}
+
+Bcachefs_node *Bcachefs_node_cache_acquire(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    pthread_mutex_lock(&cache->lock);
+    _Bcachefs_node_cache_acquire(cache, node);
+    pthread_mutex_unlock(&cache->lock);
+    return node;
+}
+
+void Bcachefs_node_cache_release(Bcachefs_node_cache *cache, Bcachefs_node *node)
+{
+    pthread_mutex_lock(&cache->lock);
+    --node->refs;
+    if (node->refs == 0 && cache->num_nodes > cache->max_nodes)
+    {
+        _Bcachefs_node_cache_evict(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void Bcachefs_node_free(Bcachefs_node *node)
+{
+    free(node->keys);
+    // offsets and sizes share the allocation of inodes
+    free(node->inodes);
+    free(node->buffer);
+    free(node);
+}
+
+// Hash of the key of a directory entry, FNV-1a of the name mixed with the
+// parent inode
+uint64_t _Bcachefs_dentry_cache_hash(uint64_t parent_inode, const uint8_t *name, uint8_t len, uint8_t is_hash_seed)
+{
+    uint64_t hash = 0xCBF29CE484222325ull ^ is_hash_seed;
+    for (uint8_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ name[i]) * 0x100000001B3ull;
+    }
+    return hash ^ parent_inode * 0x9E3779B97F4A7C15ull;
+}
+
+Bcachefs_dentry **_Bcachefs_dentry_cache_bucket(Bcachefs_dentry **buckets, uint32_t num_buckets, uint64_t hash)
+{
+    return &buckets[(hash * 0x9E3779B97F4A7C15ull >> 32) & (num_buckets - 1)];
+}
+
+void _Bcachefs_dentry_cache_unlink(Bcachefs_dentry_cache *cache, Bcachefs_dentry *entry)
+{
+    if (entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        cache->head = entry->next;
+    }
+    if (entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        cache->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+}
+
+void _Bcachefs_dentry_cache_push_front(Bcachefs_dentry_cache *cache, Bcachefs_dentry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head)
+    {
+        cache->head->prev = entry;
+    }
+    else
+    {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+// Evict entries, least recently used first, until the cache fits in its
+// maximum number of entries
+void _Bcachefs_dentry_cache_evict(Bcachefs_dentry_cache *cache)
+{
+    while (cache->tail && cache->num_entries > cache->max_entries)
+    {
+        Bcachefs_dentry *entry = cache->tail;
+        Bcachefs_dentry **link = _Bcachefs_dentry_cache_bucket(cache->buckets, cache->num_buckets, entry->hash);
+        for (; *link != entry; link = &(*link)->hash_next) {}
+        *link = entry->hash_next;
+        _Bcachefs_dentry_cache_unlink(cache, entry);
+        --cache->num_entries;
+        free(entry);
+    }
+}
+
+// Find an entry and mark it as the most recently used
+Bcachefs_dentry *_Bcachefs_dentry_cache_find(Bcachefs_dentry_cache *cache, uint64_t parent_inode, const uint8_t *name, uint8_t len, uint8_t is_hash_seed)
+{
+    uint64_t hash = _Bcachefs_dentry_cache_hash(parent_inode, name, len, is_hash_seed);
+    Bcachefs_dentry *entry = *_Bcachefs_dentry_cache_bucket(cache->buckets, cache->num_buckets, hash);
+    for (; entry; entry = entry->hash_next)
+    {
+        if (entry->hash == hash && entry->parent_inode == parent_inode &&
+            entry->is_hash_seed == is_hash_seed && entry->name_len == len &&
+            !memcmp(entry->name, name, len))
+        {
+            break;
+        }
+    }
+    if (entry && cache->head != entry)
+    {
+        _Bcachefs_dentry_cache_unlink(cache, entry);
+        _Bcachefs_dentry_cache_push_front(cache, entry);
+    }
+    return entry;
+}
+
+void _Bcachefs_dentry_cache_put(Bcachefs_dentry_cache *cache, uint64_t parent_inode, const uint8_t *name, uint8_t len, uint8_t is_hash_seed, uint64_t value, uint8_t type)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (cache->max_entries == 0 ||
+        _Bcachefs_dentry_cache_find(cache, parent_inode, name, len, is_hash_seed))
+    {
+        // Another thread inserted the same entry first
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    Bcachefs_dentry *entry = malloc(sizeof(Bcachefs_dentry) + len);
+    if (entry == NULL)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    *entry = (Bcachefs_dentry){
+        .parent_inode = parent_inode,
+        .value = value,
+        .hash = _Bcachefs_dentry_cache_hash(parent_inode, name, len, is_hash_seed),
+        .is_hash_seed = is_hash_seed,
+        .type = type,
+        .name_len = len
+    };
+    memcpy(entry->name, name, len);
+    Bcachefs_dentry **bucket = _Bcachefs_dentry_cache_bucket(cache->buckets, cache->num_buckets, entry->hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    _Bcachefs_dentry_cache_push_front(cache, entry);
+    ++cache->num_entries;
+    _Bcachefs_dentry_cache_evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int Bcachefs_dentry_cache_init(Bcachefs_dentry_cache *cache, uint32_t max_entries)
+{
+    *cache = (Bcachefs_dentry_cache){0};
+    cache->num_buckets = _Bcachefs_node_cache_num_buckets(max_entries);
+    cache->buckets = calloc(cache->num_buckets, sizeof(Bcachefs_dentry*));
+    cache->max_entries = max_entries;
+    if (cache->buckets && pthread_mutex_init(&cache->lock, NULL))
+    {
+        free(cache->buckets);
+        cache->buckets = NULL;
+    }
+    return cache->buckets != NULL;
+}
+
+void Bcachefs_dentry_cache_fini(Bcachefs_dentry_cache *cache)
+{
+    Bcachefs_dentry *entry = cache->head;
+    while (entry)
+    {
+        Bcachefs_dentry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    if (cache->buckets)
+    {
+        pthread_mutex_destroy(&cache->lock);
+    }
+    free(cache->buckets);
+    *cache = (Bcachefs_dentry_cache){0};
+}
+
+int Bcachefs_dentry_cache_resize(Bcachefs_dentry_cache *cache, uint32_t max_entries)
+{
+    uint32_t num_buckets = _Bcachefs_node_cache_num_buckets(max_entries);
+    pthread_mutex_lock(&cache->lock);
+    cache->max_entries = max_entries;
+    _Bcachefs_dentry_cache_evict(cache);
+    if (num_buckets != cache->num_buckets)
+    {
+        Bcachefs_dentry **buckets = calloc(num_buckets, sizeof(Bcachefs_dentry*));
+        if (buckets == NULL)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return 0;
+        }
+        for (Bcachefs_dentry *entry = cache->head; entry; entry = entry->next)
+        {
+            Bcachefs_dentry **bucket = _Bcachefs_dentry_cache_bucket(buckets, num_buckets, entry->hash);
+            entry->hash_next = *bucket;
+            *bucket = entry;
+        }
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->num_buckets = num_buckets;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+int Bcachefs_dentry_cache_get(Bcachefs_dentry_cache *cache, uint64_t parent_inode, const uint8_t *name, uint8_t len, uint64_t *inode, uint8_t *type)
+{
+    pthread_mutex_lock(&cache->lock);
+    Bcachefs_dentry *entry = _Bcachefs_dentry_cache_find(cache, parent_inode, name, len, 0);
+    if (entry)
+    {
+        *inode = entry->value;
+        *type = entry->type;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry != NULL;
+}
+
+void Bcachefs_dentry_cache_put(Bcachefs_dentry_cache *cache, uint64_t parent_inode, const uint8_t *name, uint8_t len, uint64_t inode, uint8_t type)
+{
+    _Bcachefs_dentry_cache_put(cache, parent_inode, name, len, 0, inode, type);
+}
+
+int Bcachefs_dentry_cache_get_hash_seed(Bcachefs_dentry_cache *cache, uint64_t inode, uint64_t *hash_seed)
+{
+    pthread_mutex_lock(&cache->lock);
+    Bcachefs_dentry *entry = _Bcachefs_dentry_cache_find(cache, inode, (const uint8_t*)"", 0, 1);
+    if (entry)
+    {
+        *hash_seed = entry->value;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry != NULL;
+}
+
+void Bcachefs_dentry_cache_put_hash_seed(Bcachefs_dentry_cache *cache, uint64_t inode, uint64_t hash_seed)
+{
+    _Bcachefs_dentry_cache_put(cache, inode, (const uint8_t*)"", 0, 1, hash_seed, 0);
+}
+
+// Insert an inode in a table of slots without growing it past max_inodes
+void _Bcachefs_inode_cache_insert(Bcachefs_inode_slot *slots, uint32_t num_slots, uint32_t *num_inodes, uint32_t max_inodes, const Bcachefs_inode_slot *slot)
+{
+    uint32_t home = (slot->inode * 0x9E3779B97F4A7C15ull >> 32) & (num_slots - 1);
+    for (uint32_t i = home;; i = (i + 1) & (num_slots - 1))
+    {
+        if (slots[i].inode == slot->inode)
+        {
+            slots[i] = *slot;
+            return;
+        }
+        if (slots[i].inode == 0)
+        {
+            if (*num_inodes < max_inodes)
+            {
+                slots[i] = *slot;
+                ++*num_inodes;
+                return;
+            }
+            break;
+        }
+    }
+    // Replacing the home slot keeps the probe sequences of the other inodes
+    // intact as no slot is emptied, an empty home slot has to stay empty
+    if (slots[home].inode)
+    {
+        slots[home] = *slot;
+    }
+}
+
+int Bcachefs_inode_cache_init(Bcachefs_inode_cache *cache, uint32_t max_inodes)
+{
+    *cache = (Bcachefs_inode_cache){0};
+    cache->num_slots = _Bcachefs_node_cache_num_buckets(max_inodes);
+    // Keep empty slots to end the probe sequences
+    max_inodes = max_inodes < cache->num_slots / 2 ? max_inodes : cache->num_slots / 2;
+    cache->slots = calloc(cache->num_slots, sizeof(Bcachefs_inode_slot));
+    cache->max_inodes = max_inodes;
+    if (cache->slots && pthread_rwlock_init(&cache->lock, NULL))
+    {
+        free(cache->slots);
+        cache->slots = NULL;
+    }
+    return cache->slots != NULL;
+}
+
+void Bcachefs_inode_cache_fini(Bcachefs_inode_cache *cache)
+{
+    if (cache->slots)
+    {
+        pthread_rwlock_destroy(&cache->lock);
+    }
+    free(cache->slots);
+    *cache = (Bcachefs_inode_cache){0};
+}
+
+int Bcachefs_inode_cache_resize(Bcachefs_inode_cache *cache, uint32_t max_inodes)
+{
+    uint32_t num_slots = _Bcachefs_node_cache_num_buckets(max_inodes);
+    max_inodes = max_inodes < num_slots / 2 ? max_inodes : num_slots / 2;
+    Bcachefs_inode_slot *slots = calloc(num_slots, sizeof(Bcachefs_inode_slot));
+    if (slots == NULL)
+    {
+        return 0;
+    }
+    uint32_t num_inodes = 0;
+    pthread_rwlock_wrlock(&cache->lock);
+    for (uint32_t i = 0; i < cache->num_slots && num_inodes < max_inodes; ++i)
+    {
+        if (cache->slots[i].inode)
+        {
+            _Bcachefs_inode_cache_insert(slots, num_slots, &num_inodes, max_inodes, &cache->slots[i]);
+        }
+    }
+    free(cache->slots);
+    cache->slots = slots;
+    cache->num_slots = num_slots;
+    cache->num_inodes = num_inodes;
+    cache->max_inodes = max_inodes;
+    pthread_rwlock_unlock(&cache->lock);
+    return 1;
+}
+
+int Bcachefs_inode_cache_get(Bcachefs_inode_cache *cache, uint64_t inode, Bcachefs_inode_slot *slot)
+{
+    int found = 0;
+    pthread_rwlock_rdlock(&cache->lock);
+    uint32_t mask = cache->num_slots - 1;
+    for (uint32_t i = (inode * 0x9E3779B97F4A7C15ull >> 32) & mask;
+         cache->slots[i].inode; i = (i + 1) & mask)
+    {
+        if (cache->slots[i].inode == inode)
+        {
+            *slot = cache->slots[i];
+            found = 1;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache->lock);
+    return found;
+}
+
+uint32_t Bcachefs_inode_cache_put(Bcachefs_inode_cache *cache, const Bcachefs_inode_slot *slots, uint32_t num_slots)
+{
+    pthread_rwlock_wrlock(&cache->lock);
+    for (uint32_t i = 0; cache->max_inodes && i < num_slots; ++i)
+    {
+        _Bcachefs_inode_cache_insert(cache->slots, cache->num_slots, &cache->num_inodes,
+                                     cache->max_inodes, &slots[i]);
+    }
+    uint32_t num_free = cache->max_inodes - cache->num_inodes;
+    pthread_rwlock_unlock(&cache->lock);
+    return num_free;
+}
@@ -0,0 +1,312 @@
+/* Include Guard */
+#ifndef INCLUDE_BCACHEFS_CACHE_H
+#define INCLUDE_BCACHEFS_CACHE_H
+
+/**
+ * Includes
+ */
+
+#include <pthread.h>
+
+#include "bcachefs.h"
+
+/* Extern "C" Guard */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Defines */
+
+#define BCACHEFS_NODE_CACHE_SIZE    128
+#define BCACHEFS_NODE_POOL_SIZE     8
+#define BCACHEFS_DENTRY_CACHE_SIZE  4096
+#define BCACHEFS_INODE_CACHE_SIZE   16384
+
+//! Btree node loaded from the disk image along with its merged keys
+typedef struct Bcachefs_node {
+    uint64_t offset;                            //! location of the node in the disk image, in sectors
+    uint16_t sectors_written;                   //! number of sectors of the node holding bsets
+    const struct btree_node *btree_node;        //! node data, mapped in place or pointing to `buffer`
+    struct btree_node *buffer;                  //! private copy of the node when the image is not mapped
+    benz_bch_bkey_decoder decode;               //! decoder of the keys specialised for the node's format
+    const struct bkey **keys;                   //! keys of all the bsets merged in order
+    uint64_t *inodes;                           //! unpacked inode field of each key
+    uint64_t *offsets;                          //! unpacked offset field of each key
+    uint64_t *sizes;                            //! unpacked size field of each key
+    uint32_t num_keys;
+    uint32_t capacity;                          //! number of keys `keys` and the columns can hold
+    uint32_t refs;                              //! number of iterators using the node
+    struct Bcachefs_node *prev;                 //! more recently used node
+    struct Bcachefs_node *next;                 //! less recently used node, or next recycled node
+    struct Bcachefs_node *hash_next;            //! next node in the same hash bucket
+} Bcachefs_node;
+
+//! Bounded LRU cache of btree nodes keyed by their location in the disk image,
+//! safe to use from multiple threads
+typedef struct {
+    pthread_mutex_t lock;
+    Bcachefs_node **buckets;
+    uint32_t num_buckets;
+    uint32_t num_nodes;
+    uint32_t max_nodes;                         //! unused nodes are evicted past this number of nodes
+    Bcachefs_node *head;                        //! most recently used node
+    Bcachefs_node *tail;                        //! least recently used node
+    Bcachefs_node *free_nodes;                  //! evicted nodes kept to be loaded again
+    uint32_t num_free_nodes;
+} Bcachefs_node_cache;
+
+//! Cached result of a directory entry lookup or hash seed of a directory
+typedef struct Bcachefs_dentry {
+    uint64_t parent_inode;                      //! directory holding the entry, or directory of the hash seed
+    uint64_t value;                             //! inode of the entry, 0 if it doesn't exist, or hash seed
+    uint64_t hash;                              //! hash of the key of the entry
+    struct Bcachefs_dentry *prev;               //! more recently used entry
+    struct Bcachefs_dentry *next;               //! less recently used entry
+    struct Bcachefs_dentry *hash_next;          //! next entry in the same hash bucket
+    uint8_t is_hash_seed;
+    uint8_t type;
+    uint8_t name_len;
+    uint8_t name[];
+} Bcachefs_dentry;
+
+//! Bounded LRU cache of directory entries keyed by their parent and name,
+//! including entries which don't exist, and of directory hash seeds, safe to
+//! use from multiple threads
+typedef struct {
+    pthread_mutex_t lock;
+    Bcachefs_dentry **buckets;
+    uint32_t num_buckets;
+    uint32_t num_entries;
+    uint32_t max_entries;                       //! entries are evicted past this number of entries
+    Bcachefs_dentry *head;                      //! most recently used entry
+    Bcachefs_dentry *tail;                      //! least recently used entry
+} Bcachefs_dentry_cache;
+
+//! Decoded inode kept in an inode cache, a slot with a 0 `inode` is empty
+typedef struct {
+    uint64_t inode;
+    uint64_t size;
+    uint64_t hash_seed;
+} Bcachefs_inode_slot;
+
+//! Bounded open addressing hash table of decoded inodes, safe to use from
+//! multiple threads
+typedef struct {
+    pthread_rwlock_t lock;
+    Bcachefs_inode_slot *slots;                 //! linearly probed slots, a power of 2 of them
+    uint32_t num_slots;
+    uint32_t num_inodes;
+    uint32_t max_inodes;                        //! inodes replace the inode in their home slot past this number of inodes
+} Bcachefs_inode_cache;
+
+/*! @brief Initialize an empty node cache
+ *
+ *  @param [out] cache cache to initialize
+ *  @param [in] max_nodes number of nodes to keep once they are not used anymore
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_node_cache_init(Bcachefs_node_cache *cache, uint32_t max_nodes);
+
+/*! @brief Free all the nodes of a cache, used or not
+ *
+ *  @param [in] cache cache to finalize
+ */
+void Bcachefs_node_cache_fini(Bcachefs_node_cache *cache);
+
+/*! @brief Change the number of unused nodes kept by a cache
+ *
+ *  @param [in] cache cache to resize
+ *  @param [in] max_nodes number of nodes to keep once they are not used anymore
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_node_cache_resize(Bcachefs_node_cache *cache, uint32_t max_nodes);
+
+/*! @brief Get an empty node to load
+ *
+ *         Evicted nodes are recycled along with their node buffer and keys
+ *         arrays so loading nodes doesn't allocate in the steady state
+ *
+ *  @param [in] cache node cache
+ *
+ *  @return empty node or `NULL` on failure
+ */
+Bcachefs_node *Bcachefs_node_cache_alloc(Bcachefs_node_cache *cache);
+
+/*! @brief Give back a node from `Bcachefs_node_cache_alloc` which couldn't be loaded
+ *
+ *  @param [in] cache node cache
+ *  @param [in] node node to recycle
+ */
+void Bcachefs_node_cache_recycle(Bcachefs_node_cache *cache, Bcachefs_node *node);
+
+/*! @brief Find the node a btree pointer is pointing to and acquire it
+ *
+ *  @param [in] cache node cache
+ *  @param [in] btree_ptr location of the node
+ *
+ *  @return acquired node or `NULL` if the node is not in the cache
+ */
+Bcachefs_node *Bcachefs_node_cache_get(Bcachefs_node_cache *cache, const struct bch_btree_ptr_v2 *btree_ptr);
+
+/*! @brief Insert a newly loaded node in the cache and acquire it
+ *
+ *         Unused nodes are evicted, least recently used first, if the cache
+ *         grows over its maximum number of nodes. If another thread inserted
+ *         the same node in the meantime, `node` is recycled and the node
+ *         already in the cache is acquired instead.
+ *
+ *  @param [in] cache node cache
+ *  @param [in] node node to insert, owned by the cache afterward
+ *
+ *  @return the acquired node
+ */
+Bcachefs_node *Bcachefs_node_cache_put(Bcachefs_node_cache *cache, Bcachefs_node *node);
+
+/*! @brief Acquire a node already acquired by someone else
+ *
+ *  @param [in] cache node cache
+ *  @param [in] node node to acquire
+ *
+ *  @return the acquired node
+ */
+Bcachefs_node *Bcachefs_node_cache_acquire(Bcachefs_node_cache *cache, Bcachefs_node *node);
+
+/*! @brief Release a node acquired with `Bcachefs_node_cache_get`,
+ *         `Bcachefs_node_cache_put` or `Bcachefs_node_cache_acquire`
+ *
+ *  @param [in] cache node cache
+ *  @param [in] node node to release
+ */
+void Bcachefs_node_cache_release(Bcachefs_node_cache *cache, Bcachefs_node *node);
+
+/*! @brief Free a node which is not in a cache
+ *
+ *  @param [in] node node to free
+ */
+void Bcachefs_node_free(Bcachefs_node *node);
+
+/*! @brief Initialize an empty directory entry cache
+ *
+ *  @param [out] cache cache to initialize
+ *  @param [in] max_entries number of entries to keep, 0 to disable the cache
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_dentry_cache_init(Bcachefs_dentry_cache *cache, uint32_t max_entries);
+
+/*! @brief Free all the entries of a directory entry cache
+ *
+ *  @param [in] cache cache to finalize
+ */
+void Bcachefs_dentry_cache_fini(Bcachefs_dentry_cache *cache);
+
+/*! @brief Change the number of entries kept by a directory entry cache
+ *
+ *  @param [in] cache cache to resize
+ *  @param [in] max_entries number of entries to keep, 0 to disable the cache
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_dentry_cache_resize(Bcachefs_dentry_cache *cache, uint32_t max_entries);
+
+/*! @brief Find the cached result of a directory entry lookup
+ *
+ *  @param [in] cache directory entry cache
+ *  @param [in] parent_inode directory holding the entry
+ *  @param [in] name name of the entry
+ *  @param [in] len length of `name`
+ *  @param [out] inode inode of the entry, 0 if the entry doesn't exist
+ *  @param [out] type type of the entry
+ *
+ *  @return 1 if the lookup is cached, 0 otherwise
+ */
+int Bcachefs_dentry_cache_get(Bcachefs_dentry_cache *cache, uint64_t parent_inode, const uint8_t *name, uint8_t len, uint64_t *inode, uint8_t *type);
+
+/*! @brief Insert the result of a directory entry lookup in the cache
+ *
+ *         The least recently used entries are evicted if the cache grows over
+ *         its maximum number of entries.
+ *
+ *  @param [in] cache directory entry cache
+ *  @param [in] parent_inode directory holding the entry
+ *  @param [in] name name of the entry, copied in the cache
+ *  @param [in] len length of `name`
+ *  @param [in] inode inode of the entry, 0 if the entry doesn't exist
+ *  @param [in] type type of the entry
+ */
+void Bcachefs_dentry_cache_put(Bcachefs_dentry_cache *cache, uint64_t parent_inode, const uint8_t *name, uint8_t len, uint64_t inode, uint8_t type);
+
+/*! @brief Find the cached hash seed of a directory
+ *
+ *  @param [in] cache directory entry cache
+ *  @param [in] inode directory
+ *  @param [out] hash_seed hash seed of the directory
+ *
+ *  @return 1 if the hash seed is cached, 0 otherwise
+ */
+int Bcachefs_dentry_cache_get_hash_seed(Bcachefs_dentry_cache *cache, uint64_t inode, uint64_t *hash_seed);
+
+/*! @brief Insert the hash seed of a directory in the cache
+ *
+ *  @param [in] cache directory entry cache
+ *  @param [in] inode directory
+ *  @param [in] hash_seed hash seed of the directory
+ */
+void Bcachefs_dentry_cache_put_hash_seed(Bcachefs_dentry_cache *cache, uint64_t inode, uint64_t hash_seed);
+
+/*! @brief Initialize an empty inode cache
+ *
+ *  @param [out] cache cache to initialize
+ *  @param [in] max_inodes number of inodes to keep, 0 to disable the cache
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_inode_cache_init(Bcachefs_inode_cache *cache, uint32_t max_inodes);
+
+/*! @brief Free the slots of an inode cache
+ *
+ *  @param [in] cache cache to finalize
+ */
+void Bcachefs_inode_cache_fini(Bcachefs_inode_cache *cache);
+
+/*! @brief Change the number of inodes kept by an inode cache
+ *
+ *         The inodes already cached are kept as long as they fit.
+ *
+ *  @param [in] cache cache to resize
+ *  @param [in] max_inodes number of inodes to keep, 0 to disable the cache
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_inode_cache_resize(Bcachefs_inode_cache *cache, uint32_t max_inodes);
+
+/*! @brief Find a decoded inode
+ *
+ *  @param [in] cache inode cache
+ *  @param [in] inode inode number
+ *  @param [out] slot decoded inode
+ *
+ *  @return 1 if the inode is cached, 0 otherwise
+ */
+int Bcachefs_inode_cache_get(Bcachefs_inode_cache *cache, uint64_t inode, Bcachefs_inode_slot *slot);
+
+/*! @brief Insert decoded inodes in the cache
+ *
+ *         Once the cache holds its maximum number of inodes, new inodes
+ *         replace the inode held in their home slot, if any.
+ *
+ *  @param [in] cache inode cache
+ *  @param [in] slots decoded inodes, with a non 0 `inode`
+ *  @param [in] num_slots number of inodes
+ *
+ *  @return number of inodes which can still be inserted without replacing others
+ */
+uint32_t Bcachefs_inode_cache_put(Bcachefs_inode_cache *cache, const Bcachefs_inode_slot *slots, uint32_t num_slots);
+
+/* End Extern "C" and Include Guard */
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,906 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bcachefs_index.h"
+
+
+// Dirent of an index being built, with its name in the names buffer
+struct _Bcachefs_index_build_dirent {
+    uint64_t parent_inode;
+    uint64_t inode;
+    uint64_t name_offset;                       // offset of the name in the names buffer
+    const uint8_t *name;
+    uint8_t type;
+    uint8_t name_len;
+};
+
+// Sections of an index being built
+struct _Bcachefs_index_build {
+    struct _Bcachefs_index_build_dirent *dirents;
+    uint64_t num_dirents;
+    uint64_t dirents_capacity;
+    Bcachefs_index_inode *inodes;
+    uint64_t num_inodes;
+    uint64_t inodes_capacity;
+    Bcachefs_extent *extents;
+    uint64_t num_extents;
+    uint64_t extents_capacity;
+    uint8_t *names;
+    uint64_t names_size;
+    uint64_t names_capacity;
+};
+
+// Grow an array to hold at least `needed` elements
+int _Bcachefs_index_reserve(void **array, uint64_t *capacity, uint64_t size, uint64_t needed)
+{
+    if (needed <= *capacity)
+    {
+        return 1;
+    }
+    uint64_t new_capacity = *capacity ? *capacity * 2 : 1024;
+    while (new_capacity < needed)
+    {
+        new_capacity *= 2;
+    }
+    void *new_array = realloc(*array, new_capacity * size);
+    if (new_array == NULL)
+    {
+        return 0;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return 1;
+}
+
+int _Bcachefs_index_compare_name(const uint8_t *name, uint8_t len, const uint8_t *other_name, uint8_t other_len)
+{
+    int cmp = memcmp(name, other_name, len < other_len ? len : other_len);
+    return cmp ? cmp : (int)len - (int)other_len;
+}
+
+// Order dirents by parent inode and name, then by order of appearance in the
+// btree as names are appended to the names buffer
+int _Bcachefs_index_compare_dirents(const void *a, const void *b)
+{
+    const struct _Bcachefs_index_build_dirent *da = a;
+    const struct _Bcachefs_index_build_dirent *db = b;
+    if (da->parent_inode != db->parent_inode)
+    {
+        return da->parent_inode < db->parent_inode ? -1 : 1;
+    }
+    int cmp = _Bcachefs_index_compare_name(da->name, da->name_len, db->name, db->name_len);
+    if (cmp)
+    {
+        return cmp;
+    }
+    return da->name_offset < db->name_offset ? -1 : da->name_offset > db->name_offset;
+}
+
+int _Bcachefs_index_compare_u64(const void *a, const void *b)
+{
+    const uint64_t *pa = a;
+    const uint64_t *pb = b;
+    return *pa < *pb ? -1 : *pa > *pb;
+}
+
+// Sort and remove the duplicates of an array of inodes, return its new length
+uint64_t _Bcachefs_index_unique(uint64_t *array, uint64_t count)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    qsort(array, count, sizeof(*array), _Bcachefs_index_compare_u64);
+    uint64_t num_unique = 1;
+    for (uint64_t i = 1; i < count; ++i)
+    {
+        if (array[i] != array[num_unique - 1])
+        {
+            array[num_unique++] = array[i];
+        }
+    }
+    return num_unique;
+}
+
+int _Bcachefs_index_scan_dirents(const Bcachefs *this, struct _Bcachefs_index_build *build)
+{
+    Bcachefs_iterator *iter = Bcachefs_iter(this, BTREE_ID_dirents);
+    if (iter == NULL)
+    {
+        return 0;
+    }
+    int ret = 1;
+    while (ret && Bcachefs_iter_next(this, iter))
+    {
+        Bcachefs_dirent dirent = Bcachefs_iter_make_dirent(this, iter);
+        if (dirent.inode == 0)
+        {
+            continue;
+        }
+        ret = _Bcachefs_index_reserve((void**)&build->dirents, &build->dirents_capacity,
+                                      sizeof(*build->dirents), build->num_dirents + 1) &&
+            _Bcachefs_index_reserve((void**)&build->names, &build->names_capacity,
+                                    1, build->names_size + dirent.name_len);
+        if (ret)
+        {
+            build->dirents[build->num_dirents++] = (struct _Bcachefs_index_build_dirent){
+                .parent_inode = dirent.parent_inode,
+                .inode = dirent.inode,
+                .name_offset = build->names_size,
+                .type = dirent.type,
+                .name_len = dirent.name_len
+            };
+            memcpy(build->names + build->names_size, dirent.name, dirent.name_len);
+            build->names_size += dirent.name_len;
+        }
+    }
+    Bcachefs_iter_fini(this, iter);
+    free(iter);
+    if (!ret)
+    {
+        return 0;
+    }
+
+    // The names buffer doesn't move anymore
+    for (uint64_t i = 0; i < build->num_dirents; ++i)
+    {
+        build->dirents[i].name = build->names + build->dirents[i].name_offset;
+    }
+    if (build->num_dirents)
+    {
+        qsort(build->dirents, build->num_dirents, sizeof(*build->dirents),
+              _Bcachefs_index_compare_dirents);
+    }
+    // Keep the last appearance of a name in a directory
+    uint64_t num_dirents = 0;
+    for (uint64_t i = 0; i < build->num_dirents; ++i)
+    {
+        const struct _Bcachefs_index_build_dirent *next = &build->dirents[i + 1];
+        if (i + 1 < build->num_dirents &&
+            next->parent_inode == build->dirents[i].parent_inode &&
+            !_Bcachefs_index_compare_name(next->name, next->name_len,
+                                          build->dirents[i].name,
+                                          build->dirents[i].name_len))
+        {
+            continue;
+        }
+        build->dirents[num_dirents++] = build->dirents[i];
+    }
+    build->num_dirents = num_dirents;
+    return 1;
+}
+
+int _Bcachefs_index_scan_inodes(const Bcachefs *this, struct _Bcachefs_index_build *build)
+{
+    Bcachefs_iterator *iter = Bcachefs_iter(this, BTREE_ID_inodes);
+    if (iter == NULL)
+    {
+        return 0;
+    }
+    int ret = 1;
+    while (ret && Bcachefs_iter_next(this, iter))
+    {
+        Bcachefs_inode inode = Bcachefs_iter_make_inode(this, iter);
+        if (inode.inode == 0)
+        {
+            continue;
+        }
+        if (build->num_inodes && build->inodes[build->num_inodes - 1].inode == inode.inode)
+        {
+            // Keep the last version of the inode
+            --build->num_inodes;
+        }
+        ret = _Bcachefs_index_reserve((void**)&build->inodes, &build->inodes_capacity,
+                                      sizeof(*build->inodes), build->num_inodes + 1);
+        if (ret)
+        {
+            build->inodes[build->num_inodes++] = (Bcachefs_index_inode){
+                .inode = inode.inode,
+                .size = inode.size,
+                .hash_seed = inode.hash_seed
+            };
+        }
+    }
+    Bcachefs_iter_fini(this, iter);
+    free(iter);
+    return ret;
+}
+
+int _Bcachefs_index_scan_extents(const Bcachefs *this, struct _Bcachefs_index_build *build)
+{
+    Bcachefs_iterator *iter = Bcachefs_iter(this, BTREE_ID_extents);
+    if (iter == NULL)
+    {
+        return 0;
+    }
+    int ret = 1;
+    // Position of the first run of the current file
+    uint64_t first = 0;
+    while (ret && Bcachefs_iter_next(this, iter))
+    {
+        Bcachefs_extent extent = Bcachefs_iter_make_extent(this, iter);
+        if (extent.inode == 0)
+        {
+            continue;
+        }
+        if (first == build->num_extents || build->extents[first].inode != extent.inode)
+        {
+            first = build->num_extents;
+        }
+        // Stale extents of older bsets are replaced by the later ones
+        ret = _Bcachefs_index_reserve((void**)&build->extents, &build->extents_capacity,
+                                      sizeof(*build->extents), build->num_extents + 2);
+        if (ret)
+        {
+            build->num_extents = first + Bcachefs_add_extent_run(&build->extents[first],
+                                                                 (uint32_t)(build->num_extents - first),
+                                                                 extent);
+        }
+    }
+    Bcachefs_iter_fini(this, iter);
+    free(iter);
+    return ret;
+}
+
+// Add a record for the inodes referenced by dirents or extents but missing
+// from the inodes btree
+int _Bcachefs_index_add_missing_inodes(struct _Bcachefs_index_build *build)
+{
+    uint64_t count = build->num_dirents + build->num_extents;
+    uint64_t *referenced = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (referenced == NULL)
+    {
+        return 0;
+    }
+    for (uint64_t i = 0; i < build->num_dirents; ++i)
+    {
+        referenced[i] = build->dirents[i].inode;
+    }
+    for (uint64_t i = 0; i < build->num_extents; ++i)
+    {
+        referenced[build->num_dirents + i] = build->extents[i].inode;
+    }
+    count = _Bcachefs_index_unique(referenced, count);
+
+    // Both arrays are sorted, merge the missing inodes in from the end
+    uint64_t num_missing = 0;
+    for (uint64_t i = 0, j = 0; i < count; ++i)
+    {
+        for (; j < build->num_inodes && build->inodes[j].inode < referenced[i]; ++j) {}
+        num_missing += j == build->num_inodes || build->inodes[j].inode != referenced[i];
+    }
+    int ret = _Bcachefs_index_reserve((void**)&build->inodes, &build->inodes_capacity,
+                                      sizeof(*build->inodes), build->num_inodes + num_missing);
+    if (ret)
+    {
+        uint64_t i = count;
+        uint64_t j = build->num_inodes;
+        uint64_t k = build->num_inodes + num_missing;
+        while (k > 0)
+        {
+            if (i > 0 && (j == 0 || referenced[i - 1] > build->inodes[j - 1].inode))
+            {
+                build->inodes[--k] = (Bcachefs_index_inode){
+                    .inode = referenced[--i],
+                    .size = BCACHEFS_INDEX_NO_INODE
+                };
+            }
+            else
+            {
+                if (i > 0 && referenced[i - 1] == build->inodes[j - 1].inode)
+                {
+                    --i;
+                }
+                build->inodes[--k] = build->inodes[--j];
+            }
+        }
+        build->num_inodes += num_missing;
+    }
+    free(referenced);
+    return ret;
+}
+
+// Position of an inode in a sorted array of inode records, `count` if missing
+uint64_t _Bcachefs_index_search_inode(const Bcachefs_index_inode *inodes, uint64_t count, uint64_t inode)
+{
+    uint64_t pos = 0;
+    uint64_t end = count;
+    while (pos < end)
+    {
+        uint64_t mid = pos + (end - pos) / 2;
+        if (inodes[mid].inode < inode)
+        {
+            pos = mid + 1;
+        }
+        else
+        {
+            end = mid;
+        }
+    }
+    return pos < count && inodes[pos].inode == inode ? pos : count;
+}
+
+uint64_t _Bcachefs_index_align(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+// Check that a section of `count` elements of `size` bytes fits in the index
+int _Bcachefs_index_check_section(const Bcachefs_index *index, uint64_t offset, uint64_t count, uint64_t size)
+{
+    return offset % 8 == 0 && offset <= index->size &&
+        count <= (index->size - offset) / size;
+}
+
+// Validate the header of an index and locate its sections
+int _Bcachefs_index_init(Bcachefs_index *index)
+{
+    const Bcachefs_index_header *header = (const void*)index->map;
+    int ret = index->size >= sizeof(Bcachefs_index_header) &&
+        !memcmp(header->magic, BCACHEFS_INDEX_MAGIC, sizeof(header->magic)) &&
+        header->version == BCACHEFS_INDEX_VERSION &&
+        header->header_size == sizeof(Bcachefs_index_header) &&
+        _Bcachefs_index_check_section(index, header->dirs_offset, header->num_dirs,
+                                      sizeof(Bcachefs_index_dir)) &&
+        _Bcachefs_index_check_section(index, header->dirents_offset, header->num_dirents,
+                                      sizeof(Bcachefs_index_dirent)) &&
+        _Bcachefs_index_check_section(index, header->inodes_offset, header->num_inodes,
+                                      sizeof(Bcachefs_index_inode)) &&
+        _Bcachefs_index_check_section(index, header->extents_offset, header->num_extents,
+                                      sizeof(Bcachefs_index_extent)) &&
+        _Bcachefs_index_check_section(index, header->names_offset, header->names_size, 1) &&
+        header->num_dirents <= UINT32_MAX && header->num_inodes <= UINT32_MAX &&
+        header->num_extents <= UINT32_MAX && header->names_size <= UINT32_MAX;
+    if (ret)
+    {
+        index->header = header;
+        index->dirs = (const void*)(index->map + header->dirs_offset);
+        index->dirents = (const void*)(index->map + header->dirents_offset);
+        index->inodes = (const void*)(index->map + header->inodes_offset);
+        index->extents = (const void*)(index->map + header->extents_offset);
+        index->names = index->map + header->names_offset;
+    }
+    return ret;
+}
+
+// Lay the sections of an index out in a single buffer
+int _Bcachefs_index_pack(const struct bch_sb *sb, struct _Bcachefs_index_build *build, Bcachefs_index *index)
+{
+    if (!_Bcachefs_index_add_missing_inodes(build))
+    {
+        return 0;
+    }
+    // Directories are the parents of dirents, the inodes of directory dirents
+    // and the root, empty directories included
+    uint64_t num_dirs = build->num_dirents * 2 + 1;
+    uint64_t *dirs = malloc(num_dirs * sizeof(uint64_t));
+    if (dirs == NULL)
+    {
+        return 0;
+    }
+    for (uint64_t i = 0; i < build->num_dirents; ++i)
+    {
+        const struct _Bcachefs_index_build_dirent *dirent = &build->dirents[i];
+        dirs[i * 2] = dirent->parent_inode;
+        dirs[i * 2 + 1] = dirent->type == DT_DIR ? dirent->inode : BCACHEFS_ROOT_INO;
+    }
+    dirs[num_dirs - 1] = BCACHEFS_ROOT_INO;
+    num_dirs = _Bcachefs_index_unique(dirs, num_dirs);
+
+    // Runs of a file follow each other, with holes in between, so the file
+    // offsets don't need to be stored
+    uint64_t num_extents = 0;
+    uint64_t names_size = 0;
+    int ret = build->num_dirents <= UINT32_MAX && build->num_inodes <= UINT32_MAX;
+    for (uint64_t i = 0; ret && i < build->num_extents; ++i)
+    {
+        // The runs of a file don't overlap once scanned
+        const Bcachefs_extent *extent = &build->extents[i];
+        const Bcachefs_extent *prev = i ? &build->extents[i - 1] : NULL;
+        uint64_t file_offset = prev && prev->inode == extent->inode ?
+            prev->file_offset + prev->size : 0;
+        num_extents += 1 + (extent->file_offset > file_offset);
+    }
+    for (uint64_t i = 0; ret && i < build->num_dirents; ++i)
+    {
+        names_size += build->dirents[i].name_len;
+    }
+    ret = ret && num_extents <= UINT32_MAX && names_size <= UINT32_MAX;
+    if (!ret)
+    {
+        free(dirs);
+        return 0;
+    }
+
+    Bcachefs_index_header header = {
+        .version = BCACHEFS_INDEX_VERSION,
+        .header_size = sizeof(Bcachefs_index_header),
+        .uuid = sb->uuid,
+        .seq = sb->seq,
+        .num_dirs = num_dirs,
+        .num_dirents = build->num_dirents,
+        .num_inodes = build->num_inodes,
+        .num_extents = num_extents
+    };
+    memcpy(header.magic, BCACHEFS_INDEX_MAGIC, sizeof(header.magic));
+    header.dirs_offset = _Bcachefs_index_align(sizeof(header));
+    header.dirents_offset = _Bcachefs_index_align(
+        header.dirs_offset + header.num_dirs * sizeof(Bcachefs_index_dir));
+    header.inodes_offset = _Bcachefs_index_align(
+        header.dirents_offset + header.num_dirents * sizeof(Bcachefs_index_dirent));
+    header.extents_offset = _Bcachefs_index_align(
+        header.inodes_offset + header.num_inodes * sizeof(Bcachefs_index_inode));
+    header.names_offset = _Bcachefs_index_align(
+        header.extents_offset + header.num_extents * sizeof(Bcachefs_index_extent));
+    // Upper bound, names shrink with front coding
+    uint64_t size = header.names_offset + names_size;
+
+    uint8_t *map = calloc(1, size);
+    if (map == NULL)
+    {
+        free(dirs);
+        return 0;
+    }
+    Bcachefs_index_dir *index_dirs = (void*)(map + header.dirs_offset);
+    Bcachefs_index_dirent *dirents = (void*)(map + header.dirents_offset);
+    Bcachefs_index_inode *inodes = (void*)(map + header.inodes_offset);
+    Bcachefs_index_extent *extents = (void*)(map + header.extents_offset);
+    uint8_t *names = map + header.names_offset;
+
+    // Dirents are sorted by parent inode like the directories
+    for (uint64_t i = 0, d = 0; i < num_dirs; ++i)
+    {
+        for (; d < build->num_dirents && build->dirents[d].parent_inode < dirs[i]; ++d) {}
+        index_dirs[i] = (Bcachefs_index_dir){.inode = dirs[i], .first_dirent = (uint32_t)d};
+        for (; d < build->num_dirents && build->dirents[d].parent_inode == dirs[i]; ++d) {}
+        index_dirs[i].num_dirents = (uint32_t)(d - index_dirs[i].first_dirent);
+    }
+    free(dirs);
+
+    // Inodes and extents are both sorted by inode
+    for (uint64_t i = 0, e = 0, r = 0; i < build->num_inodes; ++i)
+    {
+        inodes[i] = build->inodes[i];
+        inodes[i].first_extent = (uint32_t)r;
+        inodes[i].dirent = BCACHEFS_INDEX_NO_DIRENT;
+        uint64_t file_offset = 0;
+        for (; e < build->num_extents && build->extents[e].inode == inodes[i].inode; ++e)
+        {
+            const Bcachefs_extent *extent = &build->extents[e];
+            if (extent->file_offset > file_offset)
+            {
+                extents[r++] = (Bcachefs_index_extent){
+                    .offset = BCACHEFS_INDEX_HOLE,
+                    .size = extent->file_offset - file_offset
+                };
+            }
+            extents[r++] = (Bcachefs_index_extent){.offset = extent->offset, .size = extent->size};
+            file_offset = extent->file_offset + extent->size;
+        }
+    }
+
+    const struct _Bcachefs_index_build_dirent *prev = NULL;
+    for (uint64_t i = 0; i < build->num_dirents; ++i)
+    {
+        const struct _Bcachefs_index_build_dirent *dirent = &build->dirents[i];
+        uint64_t inode = _Bcachefs_index_search_inode(inodes, header.num_inodes, dirent->inode);
+        if (inodes[inode].dirent == BCACHEFS_INDEX_NO_DIRENT)
+        {
+            inodes[inode].dirent = (uint32_t)i;
+        }
+        // Restart the front coding at the start of directories
+        uint8_t prefix_len = 0;
+        if (i % BCACHEFS_INDEX_RESTART && prev->parent_inode == dirent->parent_inode)
+        {
+            uint8_t max_len = dirent->name_len < prev->name_len ? dirent->name_len : prev->name_len;
+            for (; prefix_len < max_len && prev->name[prefix_len] == dirent->name[prefix_len]; ++prefix_len) {}
+        }
+        dirents[i] = (Bcachefs_index_dirent){
+            .inode = (uint32_t)inode,
+            .name = (uint32_t)header.names_size,
+            .name_len = dirent->name_len,
+            .prefix_len = prefix_len,
+            .type = dirent->type
+        };
+        memcpy(names + header.names_size, dirent->name + prefix_len,
+               dirent->name_len - prefix_len);
+        header.names_size += dirent->name_len - prefix_len;
+        prev = dirent;
+    }
+    memcpy(map, &header, sizeof(header));
+
+    size = header.names_offset + header.names_size;
+    uint8_t *shrunk_map = realloc(map, size ? size : 1);
+    *index = (Bcachefs_index){.map = shrunk_map ? shrunk_map : map, .size = size};
+    return _Bcachefs_index_init(index);
+}
+
+int Bcachefs_index_build(const Bcachefs *this, Bcachefs_index *index)
+{
+    *index = (Bcachefs_index){0};
+    if (this->sb == NULL)
+    {
+        return 0;
+    }
+    struct _Bcachefs_index_build build = {0};
+    int ret = _Bcachefs_index_scan_dirents(this, &build) &&
+        _Bcachefs_index_scan_inodes(this, &build) &&
+        _Bcachefs_index_scan_extents(this, &build) &&
+        _Bcachefs_index_pack(this->sb, &build, index);
+    free(build.dirents);
+    free(build.inodes);
+    free(build.extents);
+    free(build.names);
+    return ret;
+}
+
+int Bcachefs_index_write(const Bcachefs *this, const char *path)
+{
+    Bcachefs_index index;
+    int ret = Bcachefs_index_build(this, &index);
+
+    size_t path_len = strlen(path);
+    char *tmp_path = ret ? malloc(path_len + sizeof(".tmpXXXXXX")) : NULL;
+    int fd = -1;
+    if (tmp_path)
+    {
+        memcpy(tmp_path, path, path_len);
+        memcpy(tmp_path + path_len, ".tmpXXXXXX", sizeof(".tmpXXXXXX"));
+        fd = mkstemp(tmp_path);
+    }
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fp == NULL && fd >= 0)
+    {
+        close(fd);
+    }
+    if (fp)
+    {
+        // The header goes last so an interrupted write leaves an invalid index
+        uint64_t header_size = sizeof(Bcachefs_index_header);
+        ret = !fseek(fp, (long)header_size, SEEK_SET) &&
+            fwrite(index.map + header_size, index.size - header_size, 1, fp) == 1 &&
+            !fseek(fp, 0, SEEK_SET) &&
+            fwrite(index.map, header_size, 1, fp) == 1;
+        // mkstemp creates the file readable by its owner only
+        ret = !fchmod(fileno(fp), 0644) && !fclose(fp) && ret;
+        ret = ret && !rename(tmp_path, path);
+        if (!ret)
+        {
+            unlink(tmp_path);
+        }
+    }
+    else
+    {
+        ret = 0;
+    }
+    free(tmp_path);
+    Bcachefs_index_close(&index);
+    return ret;
+}
+
+int Bcachefs_index_open(Bcachefs_index *index, const char *path, const struct bch_sb *sb)
+{
+    *index = (Bcachefs_index){0};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (uint64_t)st.st_size < sizeof(Bcachefs_index_header))
+    {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+    *index = (Bcachefs_index){.map = map, .size = (uint64_t)st.st_size, ._mapped = 1};
+    const Bcachefs_index_header *header = map;
+    if (!_Bcachefs_index_init(index) ||
+        memcmp(&header->uuid, &sb->uuid, sizeof(header->uuid)) || header->seq != sb->seq)
+    {
+        Bcachefs_index_close(index);
+        return 0;
+    }
+    return 1;
+}
+
+void Bcachefs_index_close(Bcachefs_index *index)
+{
+    if (index->map && index->_mapped)
+    {
+        munmap((void*)index->map, (size_t)index->size);
+    }
+    else
+    {
+        free((void*)index->map);
+    }
+    *index = (Bcachefs_index){0};
+}
+
+// Apply the dirent at `position` to the name of the previous dirent, return
+// the length of the decoded name or -1 if the dirent is invalid
+int _Bcachefs_index_next_name(const Bcachefs_index *index, uint64_t position, uint8_t *name, int len)
+{
+    const Bcachefs_index_dirent *dirent = &index->dirents[position];
+    uint64_t suffix_len = dirent->name_len - dirent->prefix_len;
+    if (dirent->prefix_len > len || dirent->prefix_len > dirent->name_len ||
+        dirent->name > index->header->names_size ||
+        suffix_len > index->header->names_size - dirent->name)
+    {
+        return -1;
+    }
+    memcpy(name + dirent->prefix_len, index->names + dirent->name, suffix_len);
+    return dirent->name_len;
+}
+
+// Decode the name of the dirent at `position` from the closest full name
+int _Bcachefs_index_decode_name(const Bcachefs_index *index, uint64_t position, uint8_t *name)
+{
+    uint64_t start = position;
+    for (; index->dirents[start].prefix_len; --start)
+    {
+        if (start == 0 || position - start >= BCACHEFS_INDEX_RESTART)
+        {
+            return -1;
+        }
+    }
+    int len = 0;
+    for (uint64_t i = start; len >= 0 && i <= position; ++i)
+    {
+        len = _Bcachefs_index_next_name(index, i, name, len);
+    }
+    return len;
+}
+
+// Directory of an inode, `NULL` if the inode is not a directory
+const Bcachefs_index_dir *_Bcachefs_index_find_dir(const Bcachefs_index *index, uint64_t inode)
+{
+    uint64_t pos = 0;
+    uint64_t end = index->header->num_dirs;
+    while (pos < end)
+    {
+        uint64_t mid = pos + (end - pos) / 2;
+        if (index->dirs[mid].inode < inode)
+        {
+            pos = mid + 1;
+        }
+        else
+        {
+            end = mid;
+        }
+    }
+    const Bcachefs_index_dir *dir = pos < index->header->num_dirs ? &index->dirs[pos] : NULL;
+    return dir && dir->inode == inode && dir->first_dirent <= index->header->num_dirents &&
+        dir->num_dirents <= index->header->num_dirents - dir->first_dirent ? dir : NULL;
+}
+
+// Directory holding the dirent at `position`, `NULL` if there is none
+const Bcachefs_index_dir *_Bcachefs_index_parent_dir(const Bcachefs_index *index, uint64_t position)
+{
+    // Directories are sorted by inode, thus by first dirent too
+    uint64_t pos = 0;
+    uint64_t end = index->header->num_dirs;
+    while (pos < end)
+    {
+        uint64_t mid = pos + (end - pos) / 2;
+        if (index->dirs[mid].first_dirent <= position)
+        {
+            pos = mid + 1;
+        }
+        else
+        {
+            end = mid;
+        }
+    }
+    const Bcachefs_index_dir *dir = pos ? &index->dirs[pos - 1] : NULL;
+    return dir && position - dir->first_dirent < dir->num_dirents ? dir : NULL;
+}
+
+Bcachefs_dirent Bcachefs_index_find_dirent(const Bcachefs_index *index, uint64_t parent_inode, const uint8_t *name, uint8_t len)
+{
+    const Bcachefs_index_dir *dir = _Bcachefs_index_find_dir(index, parent_inode);
+    if (dir == NULL || dir->num_dirents == 0)
+    {
+        return (Bcachefs_dirent){0};
+    }
+    uint64_t first = dir->first_dirent;
+    uint64_t end = first + dir->num_dirents;
+    // Full names are stored at the first dirent of the directory then at
+    // every restart, find the last one not greater than the name
+    uint64_t num_restarts = 1 + (end - 1) / BCACHEFS_INDEX_RESTART - first / BCACHEFS_INDEX_RESTART;
+    uint64_t pos = 0;
+    uint64_t count = num_restarts;
+    while (pos < count)
+    {
+        uint64_t mid = pos + (count - pos) / 2;
+        uint64_t position = mid ? (first / BCACHEFS_INDEX_RESTART + mid) * BCACHEFS_INDEX_RESTART : first;
+        const Bcachefs_index_dirent *dirent = &index->dirents[position];
+        int cmp = -1;
+        if (dirent->prefix_len == 0 && dirent->name <= index->header->names_size &&
+            dirent->name_len <= index->header->names_size - dirent->name)
+        {
+            cmp = _Bcachefs_index_compare_name(index->names + dirent->name, dirent->name_len, name, len);
+        }
+        if (cmp <= 0)
+        {
+            pos = mid + 1;
+        }
+        else
+        {
+            count = mid;
+        }
+    }
+    if (pos == 0)
+    {
+        return (Bcachefs_dirent){0};
+    }
+    uint64_t start = pos > 1 ? (first / BCACHEFS_INDEX_RESTART + pos - 1) * BCACHEFS_INDEX_RESTART : first;
+    uint64_t stop = (start / BCACHEFS_INDEX_RESTART + 1) * BCACHEFS_INDEX_RESTART;
+    stop = stop < end ? stop : end;
+    uint8_t dirent_name[BCACHEFS_INDEX_NAME_SIZE];
+    int dirent_len = 0;
+    for (uint64_t i = start; i < stop; ++i)
+    {
+        dirent_len = _Bcachefs_index_next_name(index, i, dirent_name, dirent_len);
+        int cmp = dirent_len < 0 ? 1 :
+            _Bcachefs_index_compare_name(dirent_name, (uint8_t)dirent_len, name, len);
+        if (cmp > 0)
+        {
+            break;
+        }
+        const Bcachefs_index_dirent *dirent = &index->dirents[i];
+        if (cmp == 0 && dirent->inode < index->header->num_inodes)
+        {
+            return (Bcachefs_dirent){.parent_inode = parent_inode,
+                                     .inode = index->inodes[dirent->inode].inode,
+                                     .type = dirent->type,
+                                     .name = name,
+                                     .name_len = len};
+        }
+    }
+    return (Bcachefs_dirent){0};
+}
+
+uint64_t Bcachefs_index_dirents(const Bcachefs_index *index, uint64_t parent_inode, uint64_t *num_dirents)
+{
+    const Bcachefs_index_dir *dir = _Bcachefs_index_find_dir(index, parent_inode);
+    *num_dirents = dir ? dir->num_dirents : 0;
+    return dir ? dir->first_dirent : 0;
+}
+
+Bcachefs_dirent Bcachefs_index_get_dirent(const Bcachefs_index *index, uint64_t position, uint8_t *name)
+{
+    const Bcachefs_index_dir *dir = position < index->header->num_dirents ?
+        _Bcachefs_index_parent_dir(index, position) : NULL;
+    int len = dir ? _Bcachefs_index_decode_name(index, position, name) : -1;
+    const Bcachefs_index_dirent *dirent = &index->dirents[position];
+    if (len < 0 || dirent->inode >= index->header->num_inodes)
+    {
+        return (Bcachefs_dirent){0};
+    }
+    return (Bcachefs_dirent){.parent_inode = dir->inode,
+                             .inode = index->inodes[dirent->inode].inode,
+                             .type = dirent->type,
+                             .name = name,
+                             .name_len = (uint8_t)len};
+}
+
+const Bcachefs_index_inode *_Bcachefs_index_find_inode(const Bcachefs_index *index, uint64_t inode)
+{
+    uint64_t pos = _Bcachefs_index_search_inode(index->inodes, index->header->num_inodes, inode);
+    return pos < index->header->num_inodes ? &index->inodes[pos] : NULL;
+}
+
+int64_t Bcachefs_index_path(const Bcachefs_index *index, uint64_t inode, char *path, uint64_t size)
+{
+    // Dirents from the inode up to the root, deeper paths are rejected
+    uint32_t chain[1024];
+    uint32_t depth = 0;
+    uint64_t len = 0;
+    uint8_t name[BCACHEFS_INDEX_NAME_SIZE];
+    while (inode != BCACHEFS_ROOT_INO)
+    {
+        const Bcachefs_index_inode *record = _Bcachefs_index_find_inode(index, inode);
+        const Bcachefs_index_dir *dir = record && record->dirent < index->header->num_dirents ?
+            _Bcachefs_index_parent_dir(index, record->dirent) : NULL;
+        int name_len = dir ? _Bcachefs_index_decode_name(index, record->dirent, name) : -1;
+        if (name_len < 0 || depth == sizeof(chain) / sizeof(*chain))
+        {
+            return -1;
+        }
+        chain[depth++] = record->dirent;
+        len += (uint64_t)name_len + (depth > 1);
+        inode = dir->inode;
+    }
+    uint64_t pos = 0;
+    for (uint32_t i = depth; i-- > 0;)
+    {
+        uint64_t name_len = (uint64_t)_Bcachefs_index_decode_name(index, chain[i], name);
+        if (i + 1 < depth && pos < size)
+        {
+            path[pos] = '/';
+        }
+        pos += i + 1 < depth;
+        if (pos < size)
+        {
+            memcpy(path + pos, name, size - pos < name_len ? size - pos : name_len);
+        }
+        pos += name_len;
+    }
+    if (size)
+    {
+        path[pos < size ? pos : size - 1] = '\0';
+    }
+    return (int64_t)len;
+}
+
+Bcachefs_inode Bcachefs_index_find_inode(const Bcachefs_index *index, uint64_t inode)
+{
+    const Bcachefs_index_inode *record = _Bcachefs_index_find_inode(index, inode);
+    return record && record->size != BCACHEFS_INDEX_NO_INODE ?
+        (Bcachefs_inode){.inode = record->inode, .size = record->size, .hash_seed = record->hash_seed} :
+        (Bcachefs_inode){0};
+}
+
+uint32_t Bcachefs_index_find_extents(const Bcachefs_index *index, uint64_t inode, Bcachefs_extent *out, uint32_t max_extents)
+{
+    const Bcachefs_index_inode *record = _Bcachefs_index_find_inode(index, inode);
+    if (record == NULL)
+    {
+        return 0;
+    }
+    uint64_t end = record + 1 < index->inodes + index->header->num_inodes ?
+        record[1].first_extent : index->header->num_extents;
+    end = end < index->header->num_extents ? end : index->header->num_extents;
+    uint32_t num_extents = 0;
+    uint64_t file_offset = 0;
+    for (uint64_t i = record->first_extent; i < end; ++i)
+    {
+        const Bcachefs_index_extent *extent = &index->extents[i];
+        if (extent->offset != BCACHEFS_INDEX_HOLE)
+        {
+            if (num_extents < max_extents)
+            {
+                out[num_extents] = (Bcachefs_extent){.inode = inode,
+                                                     .file_offset = file_offset,
+                                                     .offset = extent->offset,
+                                                     .size = extent->size};
+            }
+            ++num_extents;
+        }
+        file_offset += extent->size;
+    }
+    return num_extents;
+}
+
+int Bcachefs_open_index(Bcachefs *this, const char *path)
+{
+    if (this->sb == NULL)
+    {
+        return 0;
+    }
+    Bcachefs_index *index = malloc(sizeof(Bcachefs_index));
+    if (index == NULL || !Bcachefs_index_open(index, path, this->sb))
+    {
+        free(index);
+        return 0;
+    }
+    if (this->_index)
+    {
+        Bcachefs_index_close(this->_index);
+        free(this->_index);
+    }
+    this->_index = index;
+    return 1;
+}
@@ -0,0 +1,240 @@
+/* Include Guard */
+#ifndef INCLUDE_BCACHEFS_INDEX_H
+#define INCLUDE_BCACHEFS_INDEX_H
+
+/**
+ * Includes
+ */
+
+#include <stdint.h>
+
+#include "bcachefs_iterator.h"
+
+/* Extern "C" Guard */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Defines */
+
+#define BCACHEFS_INDEX_MAGIC        "BCHFSIDX"
+#define BCACHEFS_INDEX_VERSION      3
+#define BCACHEFS_INDEX_SUFFIX       ".idx"
+#define BCACHEFS_INDEX_RESTART      16
+#define BCACHEFS_INDEX_NAME_SIZE    256
+#define BCACHEFS_INDEX_NO_DIRENT    UINT32_MAX
+#define BCACHEFS_INDEX_NO_INODE     UINT64_MAX
+#define BCACHEFS_INDEX_HOLE         UINT64_MAX
+
+//! Header at the start of an index file, all the sections are 8 bytes aligned
+typedef struct {
+    uint8_t magic[8];                           //! `BCACHEFS_INDEX_MAGIC`
+    uint32_t version;                           //! `BCACHEFS_INDEX_VERSION`
+    uint32_t header_size;                       //! `sizeof(Bcachefs_index_header)`
+    struct uuid uuid;                           //! uuid of the superblock of the indexed image
+    uint64_t seq;                               //! sequence number of the superblock of the indexed image
+    uint64_t num_dirs;
+    uint64_t dirs_offset;                       //! `Bcachefs_index_dir` sorted by inode
+    uint64_t num_dirents;
+    uint64_t dirents_offset;                    //! `Bcachefs_index_dirent` sorted by parent inode and name
+    uint64_t num_inodes;
+    uint64_t inodes_offset;                     //! `Bcachefs_index_inode` sorted by inode
+    uint64_t num_extents;
+    uint64_t extents_offset;                    //! `Bcachefs_index_extent` sorted by inode and file offset
+    uint64_t names_size;
+    uint64_t names_offset;                      //! front coded names of the dirents
+} Bcachefs_index_header;
+
+//! Directory of an index, with its entries
+typedef struct {
+    uint64_t inode;
+    uint32_t first_dirent;                      //! position of the first entry of the directory
+    uint32_t num_dirents;
+} Bcachefs_index_dir;
+
+//! Entry of the path table of an index
+//!
+//! Names are front coded: only the suffix following the `prefix_len` bytes
+//! shared with the previous entry is stored. The first entry of a directory
+//! and every `BCACHEFS_INDEX_RESTART`th entry of the table have their full name
+//! stored so that any name can be decoded from a close entry.
+typedef struct {
+    uint32_t inode;                             //! position of the inode in the inodes section
+    uint32_t name;                              //! offset of the suffix of the name in the names section
+    uint8_t name_len;
+    uint8_t prefix_len;
+    uint8_t type;
+    uint8_t _pad;
+} Bcachefs_index_dirent;
+
+//! Inode record of an index, inodes only referenced by dirents or extents have
+//! a `BCACHEFS_INDEX_NO_INODE` size
+typedef struct {
+    uint64_t inode;
+    uint64_t size;
+    uint64_t hash_seed;
+    uint32_t first_extent;                      //! position of the first extent run of the inode
+    uint32_t dirent;                            //! position of the first dirent of the inode or `BCACHEFS_INDEX_NO_DIRENT`
+} Bcachefs_index_inode;
+
+//! Run of physically contiguous extents of a file, following the previous run
+//! of the file or a hole with a `BCACHEFS_INDEX_HOLE` offset
+typedef struct {
+    uint64_t offset;                            //! position inside the disk image, in bytes
+    uint64_t size;
+} Bcachefs_index_extent;
+
+//! Read-only index of a disk image, mapped from an index file or built in memory
+typedef struct Bcachefs_index {
+    const uint8_t *map;                         //! content of the index file
+    uint64_t size;
+    int _mapped;                                //! `map` is a mapping rather than an allocation
+    const Bcachefs_index_header *header;
+    const Bcachefs_index_dir *dirs;
+    const Bcachefs_index_dirent *dirents;
+    const Bcachefs_index_inode *inodes;
+    const Bcachefs_index_extent *extents;
+    const uint8_t *names;
+} Bcachefs_index;
+
+/*! @brief Build the index of a disk image in memory
+ *
+ *         The dirents, inodes and extents btrees are scanned once. Deleted
+ *         entries are dropped, only the last of the dirents sharing a name in
+ *         a directory is kept and contiguous extents are merged into runs.
+ *         A file with a single run takes 60 bytes plus the front coded suffix
+ *         of its name.
+ *
+ *  @param [in] this disk image
+ *  @param [out] index index to initialize, to finalize with
+ *                     `Bcachefs_index_close`
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_index_build(const Bcachefs *this, Bcachefs_index *index);
+
+/*! @brief Write the index of a disk image
+ *
+ *         The index is built with `Bcachefs_index_build` then written to a
+ *         temporary file renamed to `path` once complete, so concurrent
+ *         readers never see a partial index.
+ *
+ *  @param [in] this disk image
+ *  @param [in] path path of the index file
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_index_write(const Bcachefs *this, const char *path);
+
+/*! @brief Map an index file
+ *
+ *         The index is rejected if its version is not supported or if it was
+ *         not written for the superblock `sb`, i.e. for another image or for
+ *         an older version of the same image.
+ *
+ *  @param [out] index index to initialize
+ *  @param [in] path path of the index file
+ *  @param [in] sb superblock of the indexed image
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_index_open(Bcachefs_index *index, const char *path, const struct bch_sb *sb);
+
+/*! @brief Unmap or free an index
+ *
+ *  @param [in] index index to close
+ */
+void Bcachefs_index_close(Bcachefs_index *index);
+
+/*! @brief Find a dirent in an index
+ *
+ *  @param [in] index index of the disk image
+ *  @param [in] parent_inode inode of the parent directory
+ *  @param [in] name name of the entry
+ *  @param [in] len length of `name`
+ *
+ *  @return dirent, with its name pointing to `name`, or an empty dirent if not
+ *          found
+ */
+Bcachefs_dirent Bcachefs_index_find_dirent(const Bcachefs_index *index, uint64_t parent_inode, const uint8_t *name, uint8_t len);
+
+/*! @brief Locate the entries of a directory in an index
+ *
+ *  @param [in] index index of the disk image
+ *  @param [in] parent_inode inode of the directory
+ *  @param [out] num_dirents number of entries in the directory
+ *
+ *  @return position of the first entry of the directory, the entries are
+ *          sorted by name
+ */
+uint64_t Bcachefs_index_dirents(const Bcachefs_index *index, uint64_t parent_inode, uint64_t *num_dirents);
+
+/*! @brief Decode the dirent at a position of an index
+ *
+ *  @param [in] index index of the disk image
+ *  @param [in] position position of the dirent
+ *  @param [out] name buffer of `BCACHEFS_INDEX_NAME_SIZE` bytes receiving the
+ *                    name of the dirent
+ *
+ *  @return dirent, with its name pointing to `name`, or an empty dirent if the
+ *          position is out of the index
+ */
+Bcachefs_dirent Bcachefs_index_get_dirent(const Bcachefs_index *index, uint64_t position, uint8_t *name);
+
+/*! @brief Get the full path of a dirent in an index
+ *
+ *         The path is relative to the root directory, without a leading `/`.
+ *         With hard links, the path of the first dirent of the inode is used.
+ *
+ *  @param [in] index index of the disk image
+ *  @param [in] inode inode of the dirent
+ *  @param [out] path buffer receiving the NUL terminated path, can be `NULL`
+ *                    if `size` is 0
+ *  @param [in] size size of `path`
+ *
+ *  @return length of the full path, which is truncated if it is not lesser
+ *          than `size`, or -1 if the inode is not reachable from the root
+ */
+int64_t Bcachefs_index_path(const Bcachefs_index *index, uint64_t inode, char *path, uint64_t size);
+
+/*! @brief Find an inode in an index
+ *
+ *  @param [in] index index of the disk image
+ *  @param [in] inode inode number
+ *
+ *  @return inode or an empty inode if not found
+ */
+Bcachefs_inode Bcachefs_index_find_inode(const Bcachefs_index *index, uint64_t inode);
+
+/*! @brief Find the extent runs of a file in an index
+ *
+ *  @param [in] index index of the disk image
+ *  @param [in] inode inode of the file
+ *  @param [out] out extent runs of the file, sorted by file offset
+ *  @param [in] max_extents maximum number of extent runs to write to `out`
+ *
+ *  @return number of extent runs of the file, which can be greater than
+ *          `max_extents`
+ */
+uint32_t Bcachefs_index_find_extents(const Bcachefs_index *index, uint64_t inode, Bcachefs_extent *out, uint32_t max_extents);
+
+/*! @brief Attach an index to a disk image
+ *
+ *         `Bcachefs_find_dirent_r`, `Bcachefs_find_inode_r` and
+ *         `Bcachefs_find_extents` look into the index before the btrees. The
+ *         index is closed along with the image. Not to be called while the
+ *         image is used by other threads.
+ *
+ *  @param [in] this disk image
+ *  @param [in] path path of the index file, usually the image path followed
+ *                   by `BCACHEFS_INDEX_SUFFIX`
+ *
+ *  @return 1 on success, 0 if the index is missing, stale or invalid
+ */
+int Bcachefs_open_index(Bcachefs *this, const char *path);
+
+/* End Extern "C" and Include Guard */
+#ifdef __cplusplus
+}
+#endif
+#endif
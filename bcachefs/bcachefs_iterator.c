@@ -1,14 +1,45 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
+#include "bcachefs_index.h"
 #include "bcachefs_iterator.h"
 
 #include "libbenzina/bcachefs.h"
 #include "libbenzina/siphash.h"
 
 
+// Locate the root of a btree and pin its node
+int _Bcachefs_root_init(const Bcachefs *this, Bcachefs_root *root, enum btree_id type)
+{
+    Bcachefs_iterator iter = BCACHEFS_ITERATOR_CLEAN;
+    int ret = Bcachefs_iter_reinit(this, &iter, type);
+    // The reference to the node moves from the iterator to the root
+    *root = (Bcachefs_root){
+        .jset_entry = iter.jset_entry,
+        .btree_ptr = iter.btree_ptr,
+        .node = iter.node
+    };
+    return ret;
+}
+
+void _Bcachefs_root_fini(const Bcachefs *this, Bcachefs_root *root)
+{
+    if (root->node)
+    {
+        Bcachefs_node_cache_release(this->_node_cache, root->node);
+    }
+    *root = (Bcachefs_root){0};
+}
+
 int Bcachefs_open(Bcachefs *this, const char *path)
+{
+    return Bcachefs_open_backend(this, path, BCACHEFS_BACKEND_MMAP) ||
+        Bcachefs_open_backend(this, path, BCACHEFS_BACKEND_FILE);
+}
+
+int Bcachefs_open_backend(Bcachefs *this, const char *path, Bcachefs_backend backend)
 {
     *this = BCACHEFS_CLEAN;
 
@@ -19,17 +50,60 @@ int Bcachefs_open(Bcachefs *this, const char *path)
         fseek(this->fp, 0L, SEEK_END);
         this->size = ftell(this->fp);
         fseek(this->fp, 0L, SEEK_SET);
+    }
+    if (this->fp && this->size > 0 && backend == BCACHEFS_BACKEND_MMAP)
+    {
+        void *map = mmap(NULL, (size_t)this->size, PROT_READ, MAP_SHARED, fileno(this->fp), 0);
+        if (map != MAP_FAILED)
+        {
+            this->map = map;
+            this->sb = (struct bch_sb*)benz_bch_map_sb(this->map, (uint64_t)this->size);
+        }
+        ret = this->sb != NULL;
+    }
+    else if (this->fp && backend == BCACHEFS_BACKEND_FILE)
+    {
         this->sb = benz_bch_realloc_sb(NULL, 0);
+        if (this->sb && benz_bch_fread_sb(this->sb, 0, this->fp))
+        {
+            this->sb = benz_bch_realloc_sb(this->sb, 0);
+            ret = this->sb && benz_bch_fread_sb(this->sb, benz_bch_get_sb_size(this->sb),
+                                                this->fp);
+        }
     }
-    if (this->sb && benz_bch_fread_sb(this->sb, 0, this->fp))
+    if (ret)
     {
-        this->sb = benz_bch_realloc_sb(this->sb, 0);
-        ret = this->sb && benz_bch_fread_sb(this->sb, benz_bch_get_sb_size(this->sb),
-                                            this->fp) &&
-            Bcachefs_iter_reinit(this, &this->_extents_iter_begin, BTREE_ID_extents) &&
-            Bcachefs_iter_reinit(this, &this->_inodes_iter_begin, BTREE_ID_inodes) &&
-            Bcachefs_iter_reinit(this, &this->_dirents_iter_begin, BTREE_ID_dirents);
-        this->_iter = Bcachefs_iter(this, BTREE_ID_NR);
+        this->_node_cache = malloc(sizeof(Bcachefs_node_cache));
+        ret = this->_node_cache &&
+            Bcachefs_node_cache_init(this->_node_cache, BCACHEFS_NODE_CACHE_SIZE);
+    }
+    if (ret)
+    {
+        this->_inode_cache = malloc(sizeof(Bcachefs_inode_cache));
+        ret = this->_inode_cache &&
+            Bcachefs_inode_cache_init(this->_inode_cache, BCACHEFS_INODE_CACHE_SIZE);
+    }
+    if (ret)
+    {
+        this->_dentry_cache = malloc(sizeof(Bcachefs_dentry_cache));
+        ret = this->_dentry_cache &&
+            Bcachefs_dentry_cache_init(this->_dentry_cache, BCACHEFS_DENTRY_CACHE_SIZE);
+    }
+    if (ret)
+    {
+        this->_iter_pool = calloc(1, sizeof(Bcachefs_iter_pool));
+        ret = this->_iter_pool && !pthread_mutex_init(&this->_iter_pool->lock, NULL);
+        if (!ret)
+        {
+            free(this->_iter_pool);
+            this->_iter_pool = NULL;
+        }
+    }
+    if (ret)
+    {
+        ret = _Bcachefs_root_init(this, &this->_extents_root, BTREE_ID_extents) &&
+            _Bcachefs_root_init(this, &this->_inodes_root, BTREE_ID_inodes) &&
+            _Bcachefs_root_init(this, &this->_dirents_root, BTREE_ID_dirents);
     }
     if (ret)
     {
@@ -45,66 +119,185 @@ int Bcachefs_open(Bcachefs *this, const char *path)
     {
         Bcachefs_close(this);
     }
-    return ret && this->fp && this->sb && this->_iter;
+    return ret && this->fp && this->sb;
 }
 
 int Bcachefs_close(Bcachefs *this)
 {
     this->_root_stats = (Bcachefs_inode){0};
     this->_root_dirent = (Bcachefs_dirent){0};
-    int ret = Bcachefs_iter_fini(this, &this->_extents_iter_begin) &&
-        Bcachefs_iter_fini(this, &this->_inodes_iter_begin) &&
-        Bcachefs_iter_fini(this, &this->_dirents_iter_begin);
-    if (this->_iter && Bcachefs_iter_fini(this, this->_iter))
+    int ret = Bcachefs_lookup_fini(this, &this->_lookup);
+    Bcachefs_reader_fini(&this->_reader);
+    _Bcachefs_root_fini(this, &this->_extents_root);
+    _Bcachefs_root_fini(this, &this->_inodes_root);
+    _Bcachefs_root_fini(this, &this->_dirents_root);
+    if (this->_iter_pool)
+    {
+        while (this->_iter_pool->free)
+        {
+            Bcachefs_iterator *iter = this->_iter_pool->free;
+            this->_iter_pool->free = iter->next_it;
+            free(iter);
+        }
+        pthread_mutex_destroy(&this->_iter_pool->lock);
+        free(this->_iter_pool);
+        this->_iter_pool = NULL;
+    }
+    if (this->_index)
+    {
+        Bcachefs_index_close(this->_index);
+        free(this->_index);
+        this->_index = NULL;
+    }
+    if (this->_inode_cache)
+    {
+        Bcachefs_inode_cache_fini(this->_inode_cache);
+        free(this->_inode_cache);
+        this->_inode_cache = NULL;
+    }
+    if (this->_dentry_cache)
+    {
+        Bcachefs_dentry_cache_fini(this->_dentry_cache);
+        free(this->_dentry_cache);
+        this->_dentry_cache = NULL;
+    }
+    if (this->_node_cache)
     {
-        free(this->_iter);
-        this->_iter = NULL;
+        Bcachefs_node_cache_fini(this->_node_cache);
+        free(this->_node_cache);
+        this->_node_cache = NULL;
+    }
+    if (this->map && !munmap((void*)this->map, (size_t)this->size))
+    {
+        // the superblock lives inside the mapping
+        this->map = NULL;
+        this->sb = NULL;
     }
     if (this->fp && !fclose(this->fp))
     {
         this->fp = NULL;
         this->size = 0;
     }
-    free(this->sb);
-    this->sb = NULL;
-    return ret && this->fp == NULL && this->sb == NULL && this->_iter == NULL;
+    if (this->map == NULL)
+    {
+        free(this->sb);
+        this->sb = NULL;
+    }
+    return ret && this->fp == NULL && this->map == NULL && this->sb == NULL &&
+        this->_node_cache == NULL && this->_inode_cache == NULL &&
+        this->_dentry_cache == NULL && this->_iter_pool == NULL;
 }
 
-Bcachefs_iterator* Bcachefs_iter(const Bcachefs *this, enum btree_id type)
+int Bcachefs_set_node_cache_size(const Bcachefs *this, uint32_t max_nodes)
+{
+    return this->_node_cache && Bcachefs_node_cache_resize(this->_node_cache, max_nodes);
+}
+
+int Bcachefs_set_dentry_cache_size(const Bcachefs *this, uint32_t max_entries)
+{
+    return this->_dentry_cache && Bcachefs_dentry_cache_resize(this->_dentry_cache, max_entries);
+}
+
+int Bcachefs_set_inode_cache_size(const Bcachefs *this, uint32_t max_inodes)
+{
+    return this->_inode_cache && Bcachefs_inode_cache_resize(this->_inode_cache, max_inodes);
+}
+
+const Bcachefs_root *_Bcachefs_root(const Bcachefs *this, enum btree_id type)
 {
-    Bcachefs_iterator *iter = malloc(sizeof(Bcachefs_iterator));
-    *iter = BCACHEFS_ITERATOR_CLEAN;
-    const Bcachefs_iterator *iter_begin = NULL;
     switch ((int)type)
     {
     case BTREE_ID_extents:
-        iter_begin = &this->_extents_iter_begin;
-        break;
+        return &this->_extents_root;
     case BTREE_ID_inodes:
-        iter_begin = &this->_inodes_iter_begin;
-        break;
+        return &this->_inodes_root;
     case BTREE_ID_dirents:
-        iter_begin = &this->_dirents_iter_begin;
-        break;
+        return &this->_dirents_root;
     }
-    if (!iter_begin) {} // return clean iterator
-    else if (Bcachefs_iter_minimal_copy(this, iter, iter_begin)) {}
-    else
+    return NULL;
+}
+
+void _Bcachefs_iter_set_node(Bcachefs_iterator *iter, Bcachefs_node *node)
+{
+    iter->node = node;
+    iter->btree_node = node ? node->btree_node : NULL;
+    iter->keys = node ? node->keys : NULL;
+    iter->num_keys = node ? node->num_keys : 0;
+    iter->pos = 0;
+    iter->prefetch_pos = 0;
+}
+
+// Start a clean iterator at the root of a btree, sharing the root node
+void _Bcachefs_iter_root(const Bcachefs *this, Bcachefs_iterator *iter, enum btree_id type, const Bcachefs_root *root)
+{
+    *iter = (Bcachefs_iterator){
+        .type = type,
+        .jset_entry = root->jset_entry,
+        .btree_ptr = root->btree_ptr
+    };
+    _Bcachefs_iter_set_node(iter, root->node ?
+                            Bcachefs_node_cache_acquire(this->_node_cache, root->node) :
+                            NULL);
+}
+
+Bcachefs_iterator* Bcachefs_iter(const Bcachefs *this, enum btree_id type)
+{
+    Bcachefs_iterator *iter = malloc(sizeof(Bcachefs_iterator));
+    const Bcachefs_root *root = _Bcachefs_root(this, type);
+    if (iter == NULL) {}
+    else if (root) { _Bcachefs_iter_root(this, iter, type, root); }
+    else { *iter = BCACHEFS_ITERATOR_CLEAN; }   // return clean iterator
+    return iter;
+}
+
+// Get a clean iterator for a child node, recycled if possible
+Bcachefs_iterator *_Bcachefs_iter_alloc(const Bcachefs *this)
+{
+    Bcachefs_iterator *iter = NULL;
+    if (this->_iter_pool)
     {
-        free(iter);
-        iter = NULL;
+        pthread_mutex_lock(&this->_iter_pool->lock);
+        iter = this->_iter_pool->free;
+        if (iter)
+        {
+            this->_iter_pool->free = iter->next_it;
+            --this->_iter_pool->num_free;
+        }
+        pthread_mutex_unlock(&this->_iter_pool->lock);
     }
+    if (iter == NULL)
+    {
+        iter = malloc(sizeof(Bcachefs_iterator));
+    }
+    *iter = BCACHEFS_ITERATOR_CLEAN;
     return iter;
 }
 
+// Give back an iterator from `_Bcachefs_iter_alloc` once it is finalized
+void _Bcachefs_iter_recycle(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    if (this->_iter_pool)
+    {
+        pthread_mutex_lock(&this->_iter_pool->lock);
+        if (this->_iter_pool->num_free < BCACHEFS_ITER_POOL_SIZE)
+        {
+            iter->next_it = this->_iter_pool->free;
+            this->_iter_pool->free = iter;
+            ++this->_iter_pool->num_free;
+            iter = NULL;
+        }
+        pthread_mutex_unlock(&this->_iter_pool->lock);
+    }
+    free(iter);
+}
+
 int Bcachefs_next_iter(const Bcachefs *this, Bcachefs_iterator *iter, const struct bch_btree_ptr_v2 *btree_ptr)
 {
-    Bcachefs_iterator *next_it = malloc(sizeof(Bcachefs_iterator));
+    Bcachefs_iterator *next_it = _Bcachefs_iter_alloc(this);
     *next_it = (Bcachefs_iterator){
         .type = iter->type,
         .jset_entry = iter->jset_entry,
-        .btree_ptr = btree_ptr,
-        .btree_node = benz_bch_malloc_btree_node(this->sb)
+        .btree_ptr = btree_ptr
     };
 
     if (Bcachefs_iter_reinit(this, next_it, BTREE_ID_NR))
@@ -115,52 +308,62 @@ int Bcachefs_next_iter(const Bcachefs *this, Bcachefs_iterator *iter, const stru
     else
     {
         Bcachefs_iter_fini(this, next_it);
-        free(next_it);
+        _Bcachefs_iter_recycle(this, next_it);
         next_it = NULL;
         return 0;
     }
 }
 
-int _Bcachefs_comp_bkey_lesser_than(struct bkey_local_buffer *buffer, struct bkey_local_buffer *reference)
+int _Bcachefs_comp_bkey_lesseq_than(struct bkey_local_buffer *buffer, struct bkey_local_buffer *reference)
 {
     enum bch_bkey_fields field = 0;
     for (; field < BKEY_NR_FIELDS && buffer->buffer[field] == reference->buffer[field]; ++field) {}
-    return field < BKEY_NR_FIELDS && buffer->buffer[field] < reference->buffer[field];
+    return field == BKEY_NR_FIELDS || buffer->buffer[field] < reference->buffer[field];
 }
 
-int _Bcachefs_comp_bkey_lesseq_than(struct bkey_local_buffer *buffer, struct bkey_local_buffer *reference)
+// Position compared against the reference, extents are compared using their
+// start offset
+uint64_t _Bcachefs_node_search_offset(const Bcachefs_node *node, enum btree_id type, uint32_t pos)
 {
-    enum bch_bkey_fields field = 0;
-    for (; field < BKEY_NR_FIELDS && buffer->buffer[field] == reference->buffer[field]; ++field) {}
-    return field == BKEY_NR_FIELDS || buffer->buffer[field] < reference->buffer[field];
+    return type == BTREE_ID_extents ?
+        node->offsets[pos] - node->sizes[pos] :
+        node->offsets[pos];
 }
 
 const struct bkey* _Bcachefs_find_bkey(const Bcachefs *this, Bcachefs_iterator *iter, struct bkey_local_buffer *reference, int start_pos)
 {
     struct bkey_local_buffer bkey_value = {{0}};
     const struct bkey *bkey;
+    const Bcachefs_node *node = iter->node;
+    const uint64_t ref_inode = reference->buffer[BKEY_FIELD_INODE];
+    const uint64_t ref_offset = reference->buffer[BKEY_FIELD_OFFSET];
 
-    int pos = start_pos;
-    for (; pos < iter->num_keys; ++pos)
+    if (node == NULL || start_pos >= (int)iter->num_keys) return NULL;
+
+    // Binary search the first key which is not lesser than the reference
+    uint32_t pos = start_pos;
+    uint32_t end = iter->num_keys;
+    while (pos < end)
     {
-        bkey = iter->keys[pos];
-        switch ((int)iter->type)
+        uint32_t mid = pos + (end - pos) / 2;
+        if (node->inodes[mid] < ref_inode ||
+            (node->inodes[mid] == ref_inode &&
+             _Bcachefs_node_search_offset(node, iter->type, mid) < ref_offset))
         {
-        case BTREE_ID_inodes:
-        case BTREE_ID_dirents:
-            bkey_value = benz_bch_parse_bkey_buffer(bkey, &iter->btree_node->format, BKEY_FIELD_OFFSET + 1);
-            break;
-        case BTREE_ID_extents:
-            bkey_value = benz_bch_parse_bkey_buffer(bkey, &iter->btree_node->format, BKEY_FIELD_SIZE + 1);
-            bkey_value.buffer[BKEY_FIELD_OFFSET] -= bkey_value.buffer[BKEY_FIELD_SIZE];
-            memset(&bkey_value.buffer[BKEY_FIELD_OFFSET + 1], 0, (BKEY_FIELD_SIZE - BKEY_FIELD_OFFSET) * sizeof(*bkey_value.buffer));
-            break;
+            pos = mid + 1;
+        }
+        else
+        {
+            end = mid;
         }
-        if (!_Bcachefs_comp_bkey_lesser_than(&bkey_value, reference)) break;
     }
 
     if (pos == iter->num_keys) return NULL;
 
+    bkey = iter->keys[pos];
+    bkey_value.buffer[BKEY_FIELD_INODE] = node->inodes[pos];
+    bkey_value.buffer[BKEY_FIELD_OFFSET] = _Bcachefs_node_search_offset(node, iter->type, pos);
+
     uint8_t key_u64s = bkey->format == KEY_FORMAT_LOCAL_BTREE ?
       iter->btree_node->format.key_u64s : BKEY_U64s;
     iter->bch_val = benz_bch_first_bch_val(bkey, key_u64s);
@@ -171,6 +374,7 @@ const struct bkey* _Bcachefs_find_bkey(const Bcachefs *this, Bcachefs_iterator *
           iter->btree_node->format.key_u64s : BKEY_U64s;
         iter->bkey = bkey;
         iter->bch_val = benz_bch_first_bch_val(bkey, key_u64s);
+        iter->pos = pos + 1;
         const struct bch_btree_ptr_v2* btree_ptr = (const void*)iter->bch_val;
         bkey_value.buffer[BKEY_FIELD_INODE] = btree_ptr->min_key.inode;
         bkey_value.buffer[BKEY_FIELD_OFFSET] = btree_ptr->min_key.offset;
@@ -180,13 +384,15 @@ const struct bkey* _Bcachefs_find_bkey(const Bcachefs *this, Bcachefs_iterator *
             bkey_value.buffer[BKEY_FIELD_OFFSET] -= 1;
         }
         memset(&bkey_value.buffer[BKEY_FIELD_OFFSET + 1], 0, (BKEY_FIELD_SIZE - BKEY_FIELD_OFFSET) * sizeof(*bkey_value.buffer));
-        if (iter->next_it && Bcachefs_iter_fini(this, iter->next_it))
+        // The child of the previous lookup is reused if it is the same node
+        if (iter->next_it && iter->next_it->btree_ptr != btree_ptr &&
+            Bcachefs_iter_fini(this, iter->next_it))
         {
-            free(iter->next_it);
+            _Bcachefs_iter_recycle(this, iter->next_it);
             iter->next_it = NULL;
         }
-        if (_Bcachefs_comp_bkey_lesseq_than(&bkey_value, reference) && !iter->next_it &&
-            Bcachefs_next_iter(this, iter, btree_ptr))
+        if (_Bcachefs_comp_bkey_lesseq_than(&bkey_value, reference) &&
+            (iter->next_it || Bcachefs_next_iter(this, iter, btree_ptr)))
         {
             const struct bkey* bkey = _Bcachefs_find_bkey(this, iter->next_it, reference, 0);
             if (bkey)
@@ -208,27 +414,182 @@ const struct bkey* _Bcachefs_find_bkey(const Bcachefs *this, Bcachefs_iterator *
           iter->btree_node->format.key_u64s : BKEY_U64s;
         iter->bkey = bkey;
         iter->bch_val = benz_bch_first_bch_val(bkey, key_u64s);
+        iter->pos = pos + 1;
         return bkey;
     }
     return NULL;
 }
 
+// Restart a lookup from the root of a btree
+Bcachefs_iterator *_Bcachefs_lookup_reset(const Bcachefs *this, Bcachefs_lookup *lookup, enum btree_id type)
+{
+    const Bcachefs_root *root = _Bcachefs_root(this, type);
+    Bcachefs_iterator *iter = NULL;
+    switch ((int)type)
+    {
+    case BTREE_ID_extents:
+        iter = &lookup->_extents_iter;
+        break;
+    case BTREE_ID_inodes:
+        iter = &lookup->_inodes_iter;
+        break;
+    case BTREE_ID_dirents:
+        iter = &lookup->_dirents_iter;
+        break;
+    }
+    if (root == NULL || iter == NULL)
+    {
+        return NULL;
+    }
+    if (iter->node && iter->node == root->node)
+    {
+        // Keep the path of the previous lookup, its nodes are reused by
+        // `_Bcachefs_find_bkey` when the new key falls in them
+        iter->pos = 0;
+    }
+    else if (Bcachefs_iter_fini(this, iter))
+    {
+        _Bcachefs_iter_root(this, iter, type, root);
+    }
+    else
+    {
+        return NULL;
+    }
+    return iter;
+}
+
+int Bcachefs_lookup_fini(const Bcachefs *this, Bcachefs_lookup *lookup)
+{
+    int ret = Bcachefs_iter_fini(this, &lookup->_extents_iter);
+    ret = Bcachefs_iter_fini(this, &lookup->_inodes_iter) && ret;
+    ret = Bcachefs_iter_fini(this, &lookup->_dirents_iter) && ret;
+    return ret;
+}
+
+// Sort the positions of a batch of keys in the order of the keys
+struct _Bcachefs_batch_key {
+    uint64_t inode;
+    uint64_t offset;
+    uint32_t index;
+};
+
+int _Bcachefs_batch_key_comp(const void *a, const void *b)
+{
+    const struct _Bcachefs_batch_key *key_a = a;
+    const struct _Bcachefs_batch_key *key_b = b;
+    if (key_a->inode != key_b->inode)
+    {
+        return key_a->inode < key_b->inode ? -1 : 1;
+    }
+    if (key_a->offset != key_b->offset)
+    {
+        return key_a->offset < key_b->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+struct _Bcachefs_batch_key *_Bcachefs_batch_keys(const uint64_t *inodes, const uint64_t *offsets, uint32_t num_keys)
+{
+    struct _Bcachefs_batch_key *keys = malloc((num_keys ? num_keys : 1) * sizeof(struct _Bcachefs_batch_key));
+    if (keys == NULL)
+    {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < num_keys; ++i)
+    {
+        keys[i] = (struct _Bcachefs_batch_key){
+            .inode = inodes[i],
+            .offset = offsets ? offsets[i] : 0,
+            .index = i
+        };
+    }
+    qsort(keys, num_keys, sizeof(struct _Bcachefs_batch_key), _Bcachefs_batch_key_comp);
+    return keys;
+}
+
+uint32_t Bcachefs_find_inodes(Bcachefs *this, const uint64_t *inodes, uint32_t num_inodes, Bcachefs_inode *out)
+{
+    return Bcachefs_find_inodes_r(this, &this->_lookup, inodes, num_inodes, out);
+}
+
+uint32_t Bcachefs_find_extents_batch(Bcachefs *this, const uint64_t *inodes, const uint64_t *file_offsets, uint32_t num_extents, Bcachefs_extent *out)
+{
+    return Bcachefs_find_extents_batch_r(this, &this->_lookup, inodes, file_offsets, num_extents, out);
+}
+
+uint32_t Bcachefs_find_inodes_r(const Bcachefs *this, Bcachefs_lookup *lookup, const uint64_t *inodes, uint32_t num_inodes, Bcachefs_inode *out)
+{
+    struct _Bcachefs_batch_key *keys = _Bcachefs_batch_keys(inodes, NULL, num_inodes);
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < num_inodes; ++i)
+    {
+        uint32_t index = keys ? keys[i].index : i;
+        out[index] = Bcachefs_find_inode_r(this, lookup, inodes[index]);
+        found += out[index].inode != 0;
+    }
+    free(keys);
+    return found;
+}
+
+uint32_t Bcachefs_find_extents_batch_r(const Bcachefs *this, Bcachefs_lookup *lookup, const uint64_t *inodes, const uint64_t *file_offsets, uint32_t num_extents, Bcachefs_extent *out)
+{
+    struct _Bcachefs_batch_key *keys = _Bcachefs_batch_keys(inodes, file_offsets, num_extents);
+    uint32_t found = 0;
+    for (uint32_t i = 0; i < num_extents; ++i)
+    {
+        uint32_t index = keys ? keys[i].index : i;
+        out[index] = Bcachefs_find_extent_r(this, lookup, inodes[index], file_offsets[index]);
+        found += out[index].inode != 0;
+    }
+    free(keys);
+    return found;
+}
+
+int Bcachefs_read_batch(Bcachefs *this, Bcachefs_read_request *requests, uint32_t num_requests)
+{
+    return Bcachefs_read_batch_r(this, &this->_reader, requests, num_requests, NULL, NULL);
+}
+
+int Bcachefs_read_batch_r(const Bcachefs *this,
+                          Bcachefs_reader *reader,
+                          Bcachefs_read_request *requests,
+                          uint32_t num_requests,
+                          Bcachefs_read_callback callback,
+                          void *data)
+{
+    if (this->fp == NULL)
+    {
+        return 0;
+    }
+    return Bcachefs_reader_read(reader, fileno(this->fp), requests, num_requests, callback, data);
+}
+
 Bcachefs_extent Bcachefs_find_extent(Bcachefs *this, uint64_t inode, uint64_t file_offset)
+{
+    return Bcachefs_find_extent_r(this, &this->_lookup, inode, file_offset);
+}
+
+Bcachefs_inode Bcachefs_find_inode(Bcachefs *this, uint64_t inode)
+{
+    return Bcachefs_find_inode_r(this, &this->_lookup, inode);
+}
+
+Bcachefs_dirent Bcachefs_find_dirent(Bcachefs *this, uint64_t parent_inode, uint64_t hash_seed, const uint8_t *name, const uint8_t len)
+{
+    return Bcachefs_find_dirent_r(this, &this->_lookup, parent_inode, hash_seed, name, len);
+}
+
+Bcachefs_extent Bcachefs_find_extent_r(const Bcachefs *this, Bcachefs_lookup *lookup, uint64_t inode, uint64_t file_offset)
 {
     Bcachefs_extent extent = {0};
     struct bkey_local_buffer reference = {{0}};
     reference.buffer[BKEY_FIELD_INODE] = inode;
     reference.buffer[BKEY_FIELD_OFFSET] = file_offset / BCH_SECTOR_SIZE + file_offset % BCH_SECTOR_SIZE;
-    if (Bcachefs_iter_fini(this, this->_iter))
-    {
-        free(this->_iter);
-        this->_iter = Bcachefs_iter(this, BTREE_ID_extents);
-    }
-    else
+    Bcachefs_iterator *iter = _Bcachefs_lookup_reset(this, lookup, BTREE_ID_extents);
+    if (iter == NULL)
     {
         return extent;
     }
-    Bcachefs_iterator *iter = this->_iter;
     const struct bkey *bkey = _Bcachefs_find_bkey(this, iter, &reference, 0);
     if (bkey)
     {
@@ -243,25 +604,33 @@ Bcachefs_extent Bcachefs_find_extent(Bcachefs *this, uint64_t inode, uint64_t fi
     return extent;
 }
 
-Bcachefs_inode Bcachefs_find_inode(Bcachefs *this, uint64_t inode)
+Bcachefs_inode Bcachefs_find_inode_r(const Bcachefs *this, Bcachefs_lookup *lookup, uint64_t inode)
 {
     if (inode == this->_root_stats.inode)
     {
         return this->_root_stats;
     }
     Bcachefs_inode stats = {0};
-    struct bkey_local_buffer reference = {{0}};
-    reference.buffer[BKEY_FIELD_OFFSET] = inode;
-    if (Bcachefs_iter_fini(this, this->_iter))
+    if (this->_index)
     {
-        free(this->_iter);
-        this->_iter = Bcachefs_iter(this, BTREE_ID_inodes);
+        stats = Bcachefs_index_find_inode(this->_index, inode);
+        if (stats.inode)
+        {
+            return stats;
+        }
     }
-    else
+    Bcachefs_inode_slot slot;
+    if (this->_inode_cache && Bcachefs_inode_cache_get(this->_inode_cache, inode, &slot))
+    {
+        return (Bcachefs_inode){.inode = slot.inode, .size = slot.size, .hash_seed = slot.hash_seed};
+    }
+    struct bkey_local_buffer reference = {{0}};
+    reference.buffer[BKEY_FIELD_OFFSET] = inode;
+    Bcachefs_iterator *iter = _Bcachefs_lookup_reset(this, lookup, BTREE_ID_inodes);
+    if (iter == NULL)
     {
         return stats;
     }
-    Bcachefs_iterator *iter = this->_iter;
     const struct bkey *bkey = _Bcachefs_find_bkey(this, iter, &reference, 0);
     if (bkey)
     {
@@ -273,19 +642,52 @@ Bcachefs_inode Bcachefs_find_inode(Bcachefs *this, uint64_t inode)
             stats = Bcachefs_iter_make_inode(this, iter);
         }
     }
+    if (stats.inode == inode)
+    {
+        slot = (Bcachefs_inode_slot){.inode = stats.inode, .size = stats.size, .hash_seed = stats.hash_seed};
+        Bcachefs_inode_cache_put(this->_inode_cache, &slot, 1);
+    }
     return stats;
 }
 
-Bcachefs_dirent Bcachefs_find_dirent(Bcachefs *this, uint64_t parent_inode, uint64_t hash_seed, const uint8_t *name, const uint8_t len)
+Bcachefs_dirent Bcachefs_find_dirent_r(const Bcachefs *this, Bcachefs_lookup *lookup, uint64_t parent_inode, uint64_t hash_seed, const uint8_t *name, const uint8_t len)
 {
     if (!strcmp((const void*)name, (const void*)this->_root_dirent.name))
     {
         return this->_root_dirent;
     }
     Bcachefs_dirent dirent = {0};
-    if (!hash_seed)
+    if (this->_index)
     {
-        hash_seed = Bcachefs_find_inode(this, parent_inode).hash_seed;
+        dirent = Bcachefs_index_find_dirent(this->_index, parent_inode, name, len);
+        if (dirent.inode)
+        {
+            return dirent;
+        }
+    }
+    if (this->_dentry_cache == NULL)
+    {
+        return dirent;
+    }
+    if (Bcachefs_dentry_cache_get(this->_dentry_cache, parent_inode, name, len,
+                                  &dirent.inode, &dirent.type))
+    {
+        if (dirent.inode)
+        {
+            dirent.parent_inode = parent_inode;
+            dirent.name = name;
+            dirent.name_len = len;
+        }
+        return dirent;
+    }
+    if (!hash_seed &&
+        !Bcachefs_dentry_cache_get_hash_seed(this->_dentry_cache, parent_inode, &hash_seed))
+    {
+        hash_seed = Bcachefs_find_inode_r(this, lookup, parent_inode).hash_seed;
+        if (hash_seed)
+        {
+            Bcachefs_dentry_cache_put_hash_seed(this->_dentry_cache, parent_inode, hash_seed);
+        }
     }
     if (!hash_seed)
     {
@@ -295,16 +697,11 @@ Bcachefs_dirent Bcachefs_find_dirent(Bcachefs *this, uint64_t parent_inode, uint
     struct bkey_local_buffer reference = {{0}};
     reference.buffer[BKEY_FIELD_INODE] = parent_inode;
     reference.buffer[BKEY_FIELD_OFFSET] = offset;
-    if (Bcachefs_iter_fini(this, this->_iter))
-    {
-        free(this->_iter);
-        this->_iter = Bcachefs_iter(this, BTREE_ID_dirents);
-    }
-    else
+    Bcachefs_iterator *iter = _Bcachefs_lookup_reset(this, lookup, BTREE_ID_dirents);
+    if (iter == NULL)
     {
         return dirent;
     }
-    Bcachefs_iterator *iter = this->_iter;
     const struct bkey *bkey = _Bcachefs_find_bkey(this, iter, &reference, 0);
     if (bkey)
     {
@@ -318,65 +715,80 @@ Bcachefs_dirent Bcachefs_find_dirent(Bcachefs *this, uint64_t parent_inode, uint
             dirent = Bcachefs_iter_make_dirent(this, iter);
         }
     }
+    // Entries which don't exist are cached too
+    Bcachefs_dentry_cache_put(this->_dentry_cache, parent_inode, name, len,
+                              dirent.inode, dirent.type);
     return dirent;
 }
 
-// a < b
-int _bkey_packed_less(const struct bkey *a, const struct bkey *b, const struct bkey_format *fmt)
-{
-    if (a->format != b->format) abort();
+// Cursor over the keys of a bset holding the unpacked fields of its current key
+struct _Bcachefs_bset_cursor {
+    const struct bset *bset;
+    const struct bkey *bkey;
+    struct bkey_local_buffer value;
+    uint32_t age;                               // index of the bset in the node, higher for newer bsets
+};
 
-    switch (a->format)
+// Compare the fields of two keys in order, returns <0, 0 or >0 like memcmp
+int _Bcachefs_comp_bkey_values(const struct bkey_local_buffer *a, const struct bkey_local_buffer *b)
+{
+    for (enum bch_bkey_fields field = 0; field < BKEY_NR_FIELDS; ++field)
     {
-    case KEY_FORMAT_LOCAL_BTREE:
-        ; // WTF??? This needs to be here or the var decl won't parse WTF???
-        const uint8_t *bytes_a = (const void *)a;
-        const uint8_t *bytes_b = (const void *)b;
-        enum bch_bkey_fields i;
+        if (a->buffer[field] != b->buffer[field])
+        {
+            return a->buffer[field] < b->buffer[field] ? -1 : 1;
+        }
+    }
+    return 0;
+}
 
-        bytes_a += fmt->key_u64s * BCH_U64S_SIZE;
-        bytes_b += fmt->key_u64s * BCH_U64S_SIZE;
-        for (i = 0; i < BKEY_NR_FIELDS; ++i)
+// a < b, among equal keys the key of the newest bset comes first
+int _Bcachefs_bset_cursor_less(const struct _Bcachefs_bset_cursor *a, const struct _Bcachefs_bset_cursor *b)
+{
+    int comp = _Bcachefs_comp_bkey_values(&a->value, &b->value);
+    return comp ? comp < 0 : a->age > b->age;
+}
+
+void _Bcachefs_bset_heap_sift_down(struct _Bcachefs_bset_cursor *heap, uint32_t num, uint32_t pos)
+{
+    struct _Bcachefs_bset_cursor cursor = heap[pos];
+    for (uint32_t child = pos * 2 + 1; child < num; pos = child, child = pos * 2 + 1)
+    {
+        if (child + 1 < num && _Bcachefs_bset_cursor_less(&heap[child + 1], &heap[child]))
         {
-            bytes_a -= fmt->bits_per_field[i] / 8;
-            bytes_b -= fmt->bits_per_field[i] / 8;
-            if (benz_uintXX_as_uint64(bytes_a, fmt->bits_per_field[i]) !=
-                benz_uintXX_as_uint64(bytes_b, fmt->bits_per_field[i])) break;
+            ++child;
         }
-        int res = i < BKEY_NR_FIELDS &&
-          benz_uintXX_as_uint64(bytes_a, fmt->bits_per_field[i]) <
-          benz_uintXX_as_uint64(bytes_b, fmt->bits_per_field[i]);
+        if (!_Bcachefs_bset_cursor_less(&heap[child], &cursor))
+        {
+            break;
+        }
+        heap[pos] = heap[child];
+    }
+    heap[pos] = cursor;
+}
 
-        return res;
-    case KEY_FORMAT_CURRENT:
-        if (a->p.inode != b->p.inode)
-          return a->p.inode < b->p.inode;
-        if (a->p.offset != b->p.offset)
-          return a->p.offset < b->p.offset;
-        if (a->p.snapshot != b->p.snapshot)
-          return a->p.snapshot < b->p.snapshot;
-        if (a->size != b->size)
-          return a->size < b->size;
-        if (a->version.hi != b->version.hi)
-          return a->version.hi < b->version.hi;
-        return a->version.lo < b->version.lo;
+// Move a cursor to the next key of its bset, returns 0 at the end of the bset
+int _Bcachefs_bset_cursor_next(struct _Bcachefs_bset_cursor *cursor, const Bcachefs_node *node)
+{
+    cursor->bkey = benz_bch_next_bkey(cursor->bset, cursor->bkey, KEY_TYPE_MAX);
+    if (cursor->bkey)
+    {
+        node->decode(cursor->bkey, &node->btree_node->format, &cursor->value);
     }
-    // If the format is not what we expect
-    abort();
+    return cursor->bkey != NULL;
 }
 
-void _Bcachefs_iter_build_bsets_cache(const Bcachefs *this, Bcachefs_iterator *iter)
+void _Bcachefs_node_build_bsets_cache(const Bcachefs *this, Bcachefs_node *node)
 {
     // We first get all the bsets from the node
     uint32_t num = 8;  // Initial number of bsets for allocation
     const struct bset **bsets = malloc(sizeof(struct bset *) * num);
     const struct bset **cursor = bsets;
-    const struct bset **bsets_end = NULL;
     const struct bset *ptr = NULL;
 
-    const void *btree_node_end = (const uint8_t *)iter->btree_node + iter->btree_ptr->sectors_written * BCH_SECTOR_SIZE;
+    const void *btree_node_end = (const uint8_t *)node->btree_node + node->sectors_written * BCH_SECTOR_SIZE;
 
-    while ((ptr = benz_bch_next_bset(iter->btree_node, btree_node_end, ptr, this->sb)))
+    while ((ptr = benz_bch_next_bset(node->btree_node, btree_node_end, ptr, this->sb)))
     {
         *(cursor++) = ptr;
         if (cursor == (bsets + num))
@@ -390,85 +802,153 @@ void _Bcachefs_iter_build_bsets_cache(const Bcachefs *this, Bcachefs_iterator *i
     // Because those are properly typed it will count the number of items, not bytes
     num = cursor - bsets;
 
-    bsets_end = cursor - 1;
-
-    // Now we do a mergesort with all the bsets
-
-    // The initial sizes are guesswork, maybe we can do better
-    uint32_t knum = 1024;
-    uint32_t bpos;
-    // These will be the pointer to the current bkey for all the sets
-    iter->keys = calloc(knum, sizeof(struct bkey *)); // an array of 1024 pointers to start
-    const struct bkey **kcursors = calloc(num, sizeof (struct bkey *));
-    const struct bkey **kcursors_end = kcursors + (num - 1);
-    // helper for iteration
-    const struct bkey **kptr;
-    // This is the pointer to the next slot in iter->keys
-    const struct bkey **next = iter->keys;
-    // This is the pointer to the current canditate for next slot (lowest amongst all the bsets)
-    const struct bkey *best = NULL;
-    const struct bkey *last = NULL;
-
-    // Set up all key pointers to the first key in each bset
-    for (cursor = bsets_end, kptr = kcursors_end; cursor >= bsets; --cursor, --kptr)
-        *kptr = benz_bch_next_bkey(*cursor, NULL, KEY_TYPE_MAX);
-
-    for (;;)
-    {
-        for (kptr = kcursors_end; kptr >= kcursors; --kptr)
-        {
-            if (*kptr == NULL) continue;  // we are at the end of that btree
-            // skip over invalid keys (that are smaller than the last key we accepted)
-            uint32_t pos = kptr - kcursors;
-            if (last != NULL)
-            {
-                while (!_bkey_packed_less(last, *kptr, &iter->btree_node->format))
-                {
-                    *kptr = benz_bch_next_bkey(bsets[pos], *kptr, KEY_TYPE_MAX);
-                    if (*kptr == NULL) break;
-                }
-            }
-            // We've reached the end of the current bset
-            if (*kptr == NULL) continue;
+    // Now we do a k-way merge of all the bsets using a min heap of cursors
+    // ordered by their unpacked current key
 
-            // Look for the smallest key that is left. Since we look
-            // from the most recent bset, a duplicate will use the
-            // most recent key
-            if (best == NULL || _bkey_packed_less(*kptr, best, &iter->btree_node->format))
-            {
-                best = *kptr;
-                bpos = pos;
-            }
+    struct _Bcachefs_bset_cursor *heap = malloc(sizeof(struct _Bcachefs_bset_cursor) * (num ? num : 1));
+    uint32_t heap_num = 0;
+    for (uint32_t i = 0; i < num; ++i)
+    {
+        heap[heap_num] = (struct _Bcachefs_bset_cursor){.bset = bsets[i], .age = i};
+        if (_Bcachefs_bset_cursor_next(&heap[heap_num], node))
+        {
+            ++heap_num;
         }
-        // This is the exit condition for the loop normally
-        if (best == NULL) break;
+    }
+    for (uint32_t i = heap_num / 2; i-- > 0;)
+    {
+        _Bcachefs_bset_heap_sift_down(heap, heap_num, i);
+    }
 
-        last = best;
-        // Update the cursor for the best key
-        kcursors[bpos] = benz_bch_next_bkey(bsets[bpos], kcursors[bpos], KEY_TYPE_MAX);
-        // Record the key if it is valid
-        if (best->type != KEY_TYPE_deleted && best->type != KEY_TYPE_hash_whiteout)
+    // The initial sizes are guesswork, maybe we can do better. Recycled
+    // nodes come with the keys array of their previous load
+    uint32_t knum = node->capacity ? node->capacity : 1024;
+    if (node->keys == NULL)
+    {
+        node->keys = malloc(sizeof(struct bkey *) * (knum + 1));
+    }
+    // This is the pointer to the next slot in node->keys
+    const struct bkey **next = node->keys;
+    // The last key we accepted, keys lesser or equal to it are stale
+    struct bkey_local_buffer last = {{0}};
+    int has_last = 0;
+
+    while (heap_num)
+    {
+        struct _Bcachefs_bset_cursor *best = &heap[0];
+        // Since equal keys come out newest bset first, a duplicate will use
+        // the most recent key
+        if (!has_last || _Bcachefs_comp_bkey_values(&last, &best->value) < 0)
         {
-            *next++ = best;
-            // Grow the keys array if we reached the end
-            if (next == iter->keys + knum)
+            last = best->value;
+            has_last = 1;
+            // Record the key if it is valid
+            if (best->bkey->type != KEY_TYPE_deleted && best->bkey->type != KEY_TYPE_hash_whiteout)
             {
-                uint32_t cur_pos = next - iter->keys;
-                knum *= 2;
-                iter->keys = realloc(iter->keys, sizeof(struct bkey *) * knum);
-                next = iter->keys + cur_pos;
+                *next++ = best->bkey;
+                // Grow the keys array if we reached the end, keeping a slot
+                // for the end marker
+                if (next == node->keys + knum)
+                {
+                    uint32_t cur_pos = next - node->keys;
+                    knum *= 2;
+                    node->keys = realloc(node->keys, sizeof(struct bkey *) * (knum + 1));
+                    next = node->keys + cur_pos;
+                }
             }
         }
-        best = NULL;
+        // Update the cursor of the best key
+        if (!_Bcachefs_bset_cursor_next(best, node))
+        {
+            heap[0] = heap[--heap_num];
+        }
+        if (heap_num)
+        {
+            _Bcachefs_bset_heap_sift_down(heap, heap_num, 0);
+        }
     }
     // Mark the end of the array
-    *next++ = NULL;
-    iter->num_keys = knum = (next - iter->keys) - 1;
-    iter->pos = 0;
+    *next = NULL;
+    node->num_keys = next - node->keys;
     free(bsets);
+    free(heap);
 
-    // Trim the allocation to size to avoid wasting memory
-    iter->keys = realloc(iter->keys, sizeof(struct bkey *) * (knum + 1));
+    if (knum != node->capacity)
+    {
+        // The columns are sized after the keys array
+        free(node->inodes);
+        node->inodes = NULL;
+        node->capacity = knum;
+    }
+}
+
+// Unpack the position of every key of a node once so lookups can binary search
+// plain integers instead of unpacking keys
+void _Bcachefs_node_build_columns(Bcachefs_node *node)
+{
+    const uint32_t num_keys = node->num_keys;
+    if (node->inodes == NULL)
+    {
+        node->inodes = malloc(sizeof(uint64_t) * 3 * node->capacity);
+    }
+    node->offsets = node->inodes + node->capacity;
+    node->sizes = node->offsets + node->capacity;
+    uint64_t *columns[BKEY_FIELD_SIZE + 1] = {
+        [BKEY_FIELD_INODE] = node->inodes,
+        [BKEY_FIELD_OFFSET] = node->offsets,
+        [BKEY_FIELD_SIZE] = node->sizes
+    };
+    benz_bch_unpack_bkeys(node->keys, num_keys, &node->btree_node->format, BKEY_FIELD_SIZE + 1, columns);
+}
+
+Bcachefs_node *Bcachefs_load_node(const Bcachefs *this, const struct bch_btree_ptr_v2 *btree_ptr)
+{
+    Bcachefs_node *node = Bcachefs_node_cache_get(this->_node_cache, btree_ptr);
+    if (node)
+    {
+        return node;
+    }
+    node = Bcachefs_node_cache_alloc(this->_node_cache);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    node->offset = btree_ptr->start->offset;
+    node->sectors_written = btree_ptr->sectors_written;
+    if (this->map)
+    {
+        // Mapped nodes are used in place
+        node->btree_node = benz_bch_map_btree_node(this->map,
+                                                   (uint64_t)this->size,
+                                                   this->sb,
+                                                   btree_ptr);
+    }
+    else
+    {
+        // pread doesn't share the file position with other threads
+        if (node->buffer == NULL)
+        {
+            node->buffer = benz_bch_malloc_btree_node(this->sb);
+        }
+        if (node->buffer && benz_bch_pread_btree_node(node->buffer,
+                                                      this->sb,
+                                                      btree_ptr,
+                                                      fileno(this->fp)))
+        {
+            node->btree_node = node->buffer;
+        }
+    }
+    if (node->btree_node == NULL)
+    {
+        Bcachefs_node_cache_recycle(this->_node_cache, node);
+        return NULL;
+    }
+    // Pick the key decoder once for all the keys of the node
+    node->decode = benz_bch_get_bkey_decoder(&node->btree_node->format);
+    // Build a cache of the bsets in the btree to enable backward iteration
+    _Bcachefs_node_build_bsets_cache(this, node);
+    _Bcachefs_node_build_columns(node);
+    return Bcachefs_node_cache_put(this->_node_cache, node);
 }
 
 int Bcachefs_iter_reinit(const Bcachefs *this, Bcachefs_iterator *iter, enum btree_id type)
@@ -479,99 +959,53 @@ int Bcachefs_iter_reinit(const Bcachefs *this, Bcachefs_iterator *iter, enum btr
         iter->type = type;
         iter->jset_entry = Bcachefs_iter_next_jset_entry(this, iter);
         iter->btree_ptr = Bcachefs_iter_next_btree_ptr(this, iter);
-        iter->btree_node = benz_bch_malloc_btree_node(this->sb);
     }
     else
     {
         // Reinitialize the btree pointers using the existing btree
-        Bcachefs_iter_fini(this, iter->next_it);
-        iter->next_it = NULL;
-        if (iter->keys)
+        if (iter->next_it && Bcachefs_iter_fini(this, iter->next_it))
         {
-            free(iter->keys);
-            iter->keys = NULL;
+            _Bcachefs_iter_recycle(this, iter->next_it);
         }
         *iter = (Bcachefs_iterator){
             .type = iter->type,
             .jset_entry = iter->jset_entry,
             .btree_ptr = iter->btree_ptr,
-            .btree_node = iter->btree_node
+            .node = iter->node
         };
     }
-    if (iter->btree_ptr && !benz_bch_fread_btree_node(iter->btree_node,
-                                                      this->sb,
-                                                      iter->btree_ptr,
-                                                      this->fp))
-    {
-        iter->btree_ptr = NULL;
-    }
-    if (iter->btree_ptr)
+    if (iter->btree_ptr && iter->node == NULL)
     {
-        // Build a cache of the bsets in the btree to enable backward iteration
-        _Bcachefs_iter_build_bsets_cache(this, iter);
-    }
-    return iter->jset_entry && iter->btree_node && iter->btree_ptr;
-}
-
-int Bcachefs_iter_minimal_copy(const Bcachefs *this, Bcachefs_iterator *iter, const Bcachefs_iterator *other)
-{
-    if (memcmp(iter, &BCACHEFS_ITERATOR_CLEAN, sizeof(Bcachefs_iterator)))
-    {
-        return 0;
-    }
-    iter->type = other->type;
-    iter->jset_entry = other->jset_entry;
-    iter->btree_ptr = other->btree_ptr;
-    if (other->next_it)
-    {
-        iter->next_it = malloc(sizeof(Bcachefs_iterator));
-        Bcachefs_iter_minimal_copy(this, iter->next_it, other->next_it);
-    }
-
-    iter->btree_node = benz_bch_malloc_btree_node(this->sb);
-    memcpy(iter->btree_node, other->btree_node, benz_bch_get_btree_node_size(this->sb));
-
-    if (other->num_keys)
-    {
-        iter->keys = malloc(sizeof(struct bset *) * other->num_keys);
-        iter->num_keys = other->num_keys;
-        for (uint32_t i = 0; i < iter->num_keys; ++i)
+        iter->node = Bcachefs_load_node(this, iter->btree_ptr);
+        if (iter->node == NULL)
         {
-          const uint64_t offset = (const uint8_t *)other->keys[i] - (const uint8_t *)other->btree_node;
-          iter->keys[i] = (const void *)((const uint8_t *)iter->btree_node + offset);
+            iter->btree_ptr = NULL;
         }
     }
-    else
-    {
-        iter->keys = NULL;
-    }
-    return 1;
+    _Bcachefs_iter_set_node(iter, iter->node);
+    return iter->jset_entry && iter->btree_node && iter->btree_ptr;
 }
 
 int Bcachefs_iter_fini(const Bcachefs *this, Bcachefs_iterator *iter)
 {
-    (void)this;
     if (iter == NULL)
     {
         return 1;
     }
     if (iter->next_it && Bcachefs_iter_fini(this, iter->next_it))
     {
-        free(iter->next_it);
+        _Bcachefs_iter_recycle(this, iter->next_it);
         iter->next_it = NULL;
     }
-    free(iter->btree_node);
-    iter->btree_node = NULL;
-    free(iter->keys);
-    iter->keys = NULL;
+    if (iter->node)
+    {
+        Bcachefs_node_cache_release(this->_node_cache, iter->node);
+    }
     *iter = (Bcachefs_iterator){
         .type = BTREE_ID_NR,
-        .btree_node = iter->btree_node,
-        .next_it = iter->next_it,
-        .keys = iter->keys
+        .next_it = iter->next_it
     };
-    return iter->next_it == NULL && iter->btree_node == NULL &&
-        iter->keys == NULL;
+    return iter->next_it == NULL;
 }
 
 const struct bch_val *_Bcachefs_iter_next_bch_val(const struct bkey *bkey, const struct bkey_format *format)
@@ -592,6 +1026,32 @@ const struct bch_val *_Bcachefs_iter_next_bch_val(const struct bkey *bkey, const
     return benz_bch_first_bch_val(bkey, key_u64s);
 }
 
+// Read ahead the child nodes of the next keys so they are resident by the time
+// the iteration descends into them
+void _Bcachefs_iter_prefetch(const Bcachefs *this, Bcachefs_iterator *iter)
+{
+    uint32_t end = iter->pos + BCACHEFS_PREFETCH_SIZE;
+    if (end > iter->num_keys)
+    {
+        end = iter->num_keys;
+    }
+    for (uint32_t pos = iter->prefetch_pos > iter->pos ? iter->prefetch_pos : iter->pos;
+         pos < end; ++pos)
+    {
+        const struct bkey *bkey = iter->keys[pos];
+        if (bkey->type == KEY_TYPE_btree_ptr_v2)
+        {
+            benz_bch_prefetch_btree_node(this->map, (uint64_t)this->size,
+                                         (const void*)_Bcachefs_iter_next_bch_val(bkey, &iter->btree_node->format),
+                                         fileno(this->fp));
+        }
+    }
+    if (end > iter->prefetch_pos)
+    {
+        iter->prefetch_pos = end;
+    }
+}
+
 const struct bch_val *Bcachefs_iter_next(const Bcachefs *this, Bcachefs_iterator *iter)
 {
     const struct bch_val *bch_val = NULL;
@@ -607,7 +1067,7 @@ const struct bch_val *Bcachefs_iter_next(const Bcachefs *this, Bcachefs_iterator
         else
         {
             Bcachefs_iter_fini(this, iter->next_it);
-            free(iter->next_it);
+            _Bcachefs_iter_recycle(this, iter->next_it);
             iter->next_it = NULL;
         }
     }
@@ -626,6 +1086,10 @@ const struct bch_val *Bcachefs_iter_next(const Bcachefs *this, Bcachefs_iterator
     case BTREE_ID_inodes:
     case BTREE_ID_dirents:
         iter->bch_val = bch_val;
+        if (bch_val && iter->bkey->type == KEY_TYPE_btree_ptr_v2)
+        {
+            _Bcachefs_iter_prefetch(this, iter);
+        }
         if (bch_val && iter->bkey->type == KEY_TYPE_btree_ptr_v2 &&
                 Bcachefs_next_iter(this, iter, (const struct bch_btree_ptr_v2*)bch_val))
         {
@@ -642,6 +1106,277 @@ const struct bch_val *Bcachefs_iter_next(const Bcachefs *this, Bcachefs_iterator
     return Bcachefs_iter_next(this, iter);
 }
 
+// Position an iterator before the first key not lesser than a position. Keys
+// are compared using their start offset or, with `by_end`, the end offset they
+// are keyed with
+int _Bcachefs_iter_seek(const Bcachefs *this, Bcachefs_iterator *iter, uint64_t inode, uint64_t ref_offset, int by_end)
+{
+    if (iter->node == NULL)
+    {
+        return 0;
+    }
+    if (iter->next_it && Bcachefs_iter_fini(this, iter->next_it))
+    {
+        _Bcachefs_iter_recycle(this, iter->next_it);
+        iter->next_it = NULL;
+    }
+    // `_Bcachefs_node_search_offset` returns the key offset of other btrees
+    const enum btree_id type = by_end ? BTREE_ID_NR : iter->type;
+    for (Bcachefs_iterator *it = iter; it; it = it->next_it)
+    {
+        const Bcachefs_node *node = it->node;
+        // Binary search the first key which is not lesser than the position,
+        // for interior nodes it is the child holding the position
+        uint32_t pos = 0;
+        uint32_t end = it->num_keys;
+        while (pos < end)
+        {
+            uint32_t mid = pos + (end - pos) / 2;
+            if (node->inodes[mid] < inode ||
+                (node->inodes[mid] == inode &&
+                 _Bcachefs_node_search_offset(node, type, mid) < ref_offset))
+            {
+                pos = mid + 1;
+            }
+            else
+            {
+                end = mid;
+            }
+        }
+        it->pos = pos;
+        if (pos < it->num_keys && it->keys[pos]->type == KEY_TYPE_btree_ptr_v2)
+        {
+            // Continue from the child, the parent resumes after it
+            it->bkey = it->keys[it->pos++];
+            it->bch_val = _Bcachefs_iter_next_bch_val(it->bkey, &it->btree_node->format);
+            if (!Bcachefs_next_iter(this, it, (const struct bch_btree_ptr_v2*)it->bch_val))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int Bcachefs_iter_seek(const Bcachefs *this, Bcachefs_iterator *iter, uint64_t inode, uint64_t offset)
+{
+    // Extents are keyed in sectors, skip the extent starting before `offset`
+    const uint64_t ref_offset = iter->type == BTREE_ID_extents ?
+        (offset + BCH_SECTOR_SIZE - 1) / BCH_SECTOR_SIZE :
+        offset;
+    return _Bcachefs_iter_seek(this, iter, inode, ref_offset, 0);
+}
+
+Bcachefs_iterator *Bcachefs_iter_dir(const Bcachefs *this, uint64_t parent_inode)
+{
+    Bcachefs_iterator *iter = Bcachefs_iter(this, BTREE_ID_dirents);
+    if (iter && !Bcachefs_iter_seek(this, iter, parent_inode, 0))
+    {
+        Bcachefs_iter_fini(this, iter);
+        free(iter);
+        iter = NULL;
+    }
+    return iter;
+}
+
+Bcachefs_dirent Bcachefs_iter_next_dirent(const Bcachefs *this, Bcachefs_iterator *iter, uint64_t parent_inode)
+{
+    while (Bcachefs_iter_next(this, iter))
+    {
+        Bcachefs_dirent dirent = Bcachefs_iter_make_dirent(this, iter);
+        if (dirent.inode == 0)
+        {
+            // deleted entry
+            continue;
+        }
+        else if (dirent.parent_inode != parent_inode)
+        {
+            break;
+        }
+        return dirent;
+    }
+    return (Bcachefs_dirent){0};
+}
+
+Bcachefs_extent Bcachefs_find_extent_at(const Bcachefs *this, uint64_t inode, uint64_t file_offset)
+{
+    Bcachefs_extent extent = {0};
+    Bcachefs_iterator iter;
+    _Bcachefs_iter_root(this, &iter, BTREE_ID_extents, &this->_extents_root);
+    // Extents are keyed with their end offset, the first one ending after the
+    // sector of `file_offset` is the one covering it unless it's a hole
+    if (_Bcachefs_iter_seek(this, &iter, inode, file_offset / BCH_SECTOR_SIZE + 1, 1) &&
+        Bcachefs_iter_next(this, &iter))
+    {
+        extent = Bcachefs_iter_make_extent(this, &iter);
+        if (extent.inode != inode || extent.file_offset > file_offset ||
+            extent.file_offset + extent.size <= file_offset)
+        {
+            extent = (Bcachefs_extent){0};
+        }
+    }
+    Bcachefs_iter_fini(this, &iter);
+    return extent;
+}
+
+// Runs contiguous both in the file and in the disk image
+int _Bcachefs_extent_runs_contiguous(const Bcachefs_extent *run, const Bcachefs_extent *next)
+{
+    return run->file_offset + run->size == next->file_offset &&
+        run->offset + run->size == next->offset;
+}
+
+uint32_t Bcachefs_add_extent_run(Bcachefs_extent *runs, uint32_t num_runs, Bcachefs_extent extent)
+{
+    if (extent.size == 0)
+    {
+        return num_runs;
+    }
+    uint64_t end = extent.file_offset + extent.size;
+    // Runs [first, last) overlap the extent
+    uint32_t first = num_runs;
+    for (; first && runs[first - 1].file_offset + runs[first - 1].size > extent.file_offset; --first) {}
+    uint32_t last = first;
+    for (; last < num_runs && runs[last].file_offset < end; ++last) {}
+
+    // What is left of the overlapped runs before and after the extent
+    Bcachefs_extent pieces[3];
+    uint32_t num_pieces = 0;
+    if (first < last && runs[first].file_offset < extent.file_offset)
+    {
+        pieces[num_pieces] = runs[first];
+        pieces[num_pieces++].size = extent.file_offset - runs[first].file_offset;
+    }
+    pieces[num_pieces++] = extent;
+    if (first < last && runs[last - 1].file_offset + runs[last - 1].size > end)
+    {
+        const Bcachefs_extent *run = &runs[last - 1];
+        pieces[num_pieces++] = (Bcachefs_extent){.inode = run->inode,
+                                                 .file_offset = end,
+                                                 .offset = run->offset + (end - run->file_offset),
+                                                 .size = run->file_offset + run->size - end};
+    }
+    memmove(&runs[first + num_pieces], &runs[last], (num_runs - last) * sizeof(Bcachefs_extent));
+    memcpy(&runs[first], pieces, num_pieces * sizeof(Bcachefs_extent));
+    num_runs = first + num_pieces + (num_runs - last);
+
+    // Merge the pieces with their neighbours
+    uint32_t begin = first ? first - 1 : 0;
+    uint32_t stop = first + num_pieces + 1 < num_runs ? first + num_pieces + 1 : num_runs;
+    uint32_t kept = begin;
+    for (uint32_t i = begin + 1; i < stop; ++i)
+    {
+        if (_Bcachefs_extent_runs_contiguous(&runs[kept], &runs[i]))
+        {
+            runs[kept].size += runs[i].size;
+        }
+        else
+        {
+            runs[++kept] = runs[i];
+        }
+    }
+    memmove(&runs[kept + 1], &runs[stop], (num_runs - stop) * sizeof(Bcachefs_extent));
+    return num_runs - (stop - kept - 1);
+}
+
+uint32_t Bcachefs_find_extents(const Bcachefs *this, uint64_t inode, Bcachefs_extent *out, uint32_t max_extents)
+{
+    if (this->_index)
+    {
+        return Bcachefs_index_find_extents(this->_index, inode, out, max_extents);
+    }
+    // Later extents can replace runs already found, the runs are gathered in
+    // `out` until it is full then in a growing buffer
+    uint32_t num_extents = 0;
+    uint32_t capacity = max_extents;
+    Bcachefs_extent *runs = out;
+    Bcachefs_iterator iter;
+    _Bcachefs_iter_root(this, &iter, BTREE_ID_extents, &this->_extents_root);
+    int ret = Bcachefs_iter_seek(this, &iter, inode, 0);
+    while (ret && Bcachefs_iter_next(this, &iter))
+    {
+        Bcachefs_extent extent = Bcachefs_iter_make_extent(this, &iter);
+        if (extent.inode == 0)
+        {
+            continue;
+        }
+        else if (extent.inode != inode)
+        {
+            break;
+        }
+        if (num_extents + 2 > capacity)
+        {
+            uint32_t grown_capacity = capacity * 2 + 16;
+            Bcachefs_extent *grown = malloc(grown_capacity * sizeof(Bcachefs_extent));
+            ret = grown != NULL;
+            if (ret)
+            {
+                memcpy(grown, runs, num_extents * sizeof(Bcachefs_extent));
+                if (runs != out)
+                {
+                    free(runs);
+                }
+                runs = grown;
+                capacity = grown_capacity;
+            }
+        }
+        if (ret)
+        {
+            num_extents = Bcachefs_add_extent_run(runs, num_extents, extent);
+        }
+    }
+    Bcachefs_iter_fini(this, &iter);
+    if (runs != out)
+    {
+        uint32_t num_out = num_extents < max_extents ? num_extents : max_extents;
+        if (num_out)
+        {
+            memcpy(out, runs, num_out * sizeof(Bcachefs_extent));
+        }
+        free(runs);
+    }
+    return ret ? num_extents : 0;
+}
+
+uint32_t Bcachefs_preload_inodes(const Bcachefs *this)
+{
+    Bcachefs_inode_slot slots[256];
+    uint32_t num_slots = 0;
+    uint32_t num_loaded = 0;
+    if (this->_inode_cache == NULL)
+    {
+        return 0;
+    }
+    // Only fill the free slots to not replace inodes while scanning
+    uint32_t num_free = Bcachefs_inode_cache_put(this->_inode_cache, NULL, 0);
+    Bcachefs_iterator iter;
+    _Bcachefs_iter_root(this, &iter, BTREE_ID_inodes, &this->_inodes_root);
+    while (num_free && Bcachefs_iter_next(this, &iter))
+    {
+        Bcachefs_inode inode = Bcachefs_iter_make_inode(this, &iter);
+        if (inode.inode == 0)
+        {
+            continue;
+        }
+        slots[num_slots++] = (Bcachefs_inode_slot){.inode = inode.inode,
+                                                   .size = inode.size,
+                                                   .hash_seed = inode.hash_seed};
+        if (num_slots == sizeof(slots) / sizeof(*slots) || num_slots == num_free)
+        {
+            num_free = Bcachefs_inode_cache_put(this->_inode_cache, slots, num_slots);
+            num_loaded += num_slots;
+            num_slots = 0;
+        }
+    }
+    if (num_slots)
+    {
+        Bcachefs_inode_cache_put(this->_inode_cache, slots, num_slots);
+        num_loaded += num_slots;
+    }
+    Bcachefs_iter_fini(this, &iter);
+    return num_loaded;
+}
+
 const struct jset_entry *Bcachefs_iter_next_jset_entry(const Bcachefs *this, Bcachefs_iterator *iter)
 {
     const struct jset_entry *jset_entry = iter->jset_entry;
@@ -691,6 +1426,37 @@ const struct bch_btree_ptr_v2 *Bcachefs_iter_next_btree_ptr(const Bcachefs *this
     return btree_ptr;
 }
 
+// Header, position and size of the current key of an iterator, taken from the
+// unpacked columns of its node when possible
+struct bkey_local _Bcachefs_iter_bkey_local(const Bcachefs_iterator *iter)
+{
+    const struct bkey *bkey = iter->bkey;
+    if (iter->node && iter->pos && iter->pos <= iter->num_keys && iter->keys[iter->pos - 1] == bkey)
+    {
+        const uint32_t pos = iter->pos - 1;
+        struct bkey_local local = {.u64s = bkey->u64s,
+                                   .format = bkey->format,
+                                   .needs_whiteout = bkey->needs_whiteout,
+                                   .type = bkey->type,
+                                   .size = (uint32_t)iter->node->sizes[pos]};
+        local.p.inode = iter->node->inodes[pos];
+        local.p.offset = iter->node->offsets[pos];
+        local.key_u64s = bkey->format == KEY_FORMAT_LOCAL_BTREE ?
+            iter->btree_node->format.key_u64s : BKEY_U64s;
+        return local;
+    }
+    struct bkey_local_buffer buffer;
+    if (iter->node)
+    {
+        iter->node->decode(bkey, &iter->btree_node->format, &buffer);
+    }
+    else
+    {
+        buffer = benz_bch_parse_bkey_buffer(bkey, &iter->btree_node->format, BKEY_NR_FIELDS);
+    }
+    return benz_bch_parse_bkey(bkey, &buffer);
+}
+
 Bcachefs_extent Bcachefs_iter_make_extent(const Bcachefs *this, Bcachefs_iterator *iter)
 {
     (void)this;
@@ -700,8 +1466,7 @@ Bcachefs_extent Bcachefs_iter_make_extent(const Bcachefs *this, Bcachefs_iterato
         iter = iter->next_it;
     }
 
-    const struct bkey_local_buffer buffer = benz_bch_parse_bkey_buffer(iter->bkey, &iter->btree_node->format, BKEY_NR_FIELDS);
-    const struct bkey_local bkey_local = benz_bch_parse_bkey(iter->bkey, &buffer);
+    const struct bkey_local bkey_local = _Bcachefs_iter_bkey_local(iter);
     const struct bkey *bkey = (const void*)&bkey_local;
     switch (bkey->type)
     {
@@ -733,8 +1498,7 @@ Bcachefs_inode Bcachefs_iter_make_inode(const Bcachefs *this, Bcachefs_iterator
     }
 
     const struct bkey *bkey = iter->bkey;
-    const struct bkey_local_buffer buffer = benz_bch_parse_bkey_buffer(bkey, &iter->btree_node->format, BKEY_NR_FIELDS);
-    const struct bkey_local bkey_local = benz_bch_parse_bkey(bkey, &buffer);
+    const struct bkey_local bkey_local = _Bcachefs_iter_bkey_local(iter);
     const struct bch_inode *bch_inode = (const void*)iter->bch_val;
     switch (bkey->type)
     {
@@ -763,8 +1527,7 @@ Bcachefs_dirent Bcachefs_iter_make_dirent(const Bcachefs *this, Bcachefs_iterato
     }
 
     const struct bkey *bkey = iter->bkey;
-    const struct bkey_local_buffer buffer = benz_bch_parse_bkey_buffer(bkey, &iter->btree_node->format, BKEY_NR_FIELDS);
-    const struct bkey_local bkey_local = benz_bch_parse_bkey(bkey, &buffer);
+    const struct bkey_local bkey_local = _Bcachefs_iter_bkey_local(iter);
     const struct bch_dirent *bch_dirent = (const void*)iter->bch_val;
     switch (bkey->type)
     {
@@ -7,6 +7,8 @@
  */
 
 #include "bcachefs.h"
+#include "bcachefs_cache.h"
+#include "bcachefs_read.h"
 
 /* Extern "C" Guard */
 #ifdef __cplusplus
@@ -43,34 +45,89 @@ typedef struct Bcachefs_iterator {
     const struct bch_btree_ptr_v2 *btree_ptr;   //! current btree node location
     const struct bch_val *bch_val;              //! current value stored inside along side the key
     const struct bkey *bkey;
-    struct btree_node *btree_node;              //! current btree node
+    const struct btree_node *btree_node;        //! current btree node
     struct Bcachefs_iterator *next_it;          //! pointer to the children btree node if iterating over nested Btrees
+    Bcachefs_node *node;                        //! cached node holding `btree_node` and `keys`
     const struct bkey **keys;
     uint32_t num_keys;
     uint32_t pos;
+    uint32_t prefetch_pos;                      //! child nodes of the keys before this position were prefetched
 } Bcachefs_iterator;
 #define BCACHEFS_ITERATOR_CLEAN (Bcachefs_iterator){.type = BTREE_ID_NR}
 
+//! Root of a btree, its node is pinned in the cache for the lifetime of the
+//! disk image and shared by all the iterators starting from it
+typedef struct {
+    const struct jset_entry *jset_entry;        //! journal entry specifying the location of the btree root
+    const struct bch_btree_ptr_v2 *btree_ptr;   //! root node location
+    Bcachefs_node *node;                        //! root node
+} Bcachefs_root;
+
+//! Recycled iterators of child nodes, linked through `next_it`
+typedef struct {
+    pthread_mutex_t lock;
+    Bcachefs_iterator *free;
+    uint32_t num_free;
+} Bcachefs_iter_pool;
+#define BCACHEFS_ITER_POOL_SIZE 64
+//! Number of child nodes read ahead while iterating over an interior node
+#define BCACHEFS_PREFETCH_SIZE 8
+
+//! Lookup state of a thread, the disk image itself is not modified by lookups.
+//! The path of the last lookup in each btree is kept so the next lookup reuses
+//! the nodes it has in common
+typedef struct {
+    Bcachefs_iterator _extents_iter;
+    Bcachefs_iterator _inodes_iter;
+    Bcachefs_iterator _dirents_iter;
+} Bcachefs_lookup;
+#define BCACHEFS_LOOKUP_CLEAN (Bcachefs_lookup){ \
+    ._extents_iter = BCACHEFS_ITERATOR_CLEAN, \
+    ._inodes_iter = BCACHEFS_ITERATOR_CLEAN, \
+    ._dirents_iter = BCACHEFS_ITERATOR_CLEAN \
+}
+
+//! How the btree nodes and the superblock are accessed
+typedef enum {
+    BCACHEFS_BACKEND_FILE,                      //! read into private buffers with `fread`
+    BCACHEFS_BACKEND_MMAP,                      //! access in place through a read-only mapping
+} Bcachefs_backend;
+
+struct Bcachefs_index;
+
 typedef struct {
     FILE *fp;
     long size;
+    const uint8_t *map;                         //! read-only mapping of the image, `NULL` with `BCACHEFS_BACKEND_FILE`
     struct bch_sb *sb;
-    Bcachefs_iterator *_iter;
-    Bcachefs_iterator _extents_iter_begin;
-    Bcachefs_iterator _inodes_iter_begin;
-    Bcachefs_iterator _dirents_iter_begin;
+    Bcachefs_node_cache *_node_cache;           //! btree nodes shared by all lookups and iterators
+    Bcachefs_inode_cache *_inode_cache;         //! inodes found by `Bcachefs_find_inode_r` or preloaded
+    Bcachefs_dentry_cache *_dentry_cache;       //! directory entries and hash seeds found by `Bcachefs_find_dirent_r`
+    struct Bcachefs_index *_index;              //! sidecar index attached with `Bcachefs_open_index`
+    Bcachefs_iter_pool *_iter_pool;             //! iterators of child nodes shared by all lookups and iterators
+    Bcachefs_lookup _lookup;                    //! lookup state of the non reentrant `Bcachefs_find_*`
+    Bcachefs_reader _reader;                    //! reader of the non reentrant `Bcachefs_read_batch`
+    Bcachefs_root _extents_root;
+    Bcachefs_root _inodes_root;
+    Bcachefs_root _dirents_root;
     Bcachefs_inode _root_stats;
     Bcachefs_dirent _root_dirent;
 } Bcachefs;
 #define BCACHEFS_CLEAN (Bcachefs){ \
-    ._extents_iter_begin = BCACHEFS_ITERATOR_CLEAN, \
-    ._inodes_iter_begin = BCACHEFS_ITERATOR_CLEAN, \
-    ._dirents_iter_begin = BCACHEFS_ITERATOR_CLEAN, \
+    ._lookup = BCACHEFS_LOOKUP_CLEAN, \
+    ._reader = BCACHEFS_READER_CLEAN, \
+    ._extents_root = (Bcachefs_root){0}, \
+    ._inodes_root = (Bcachefs_root){0}, \
+    ._dirents_root = (Bcachefs_root){0}, \
     ._root_stats = (Bcachefs_inode){0}, \
     ._root_dirent = (Bcachefs_dirent){0} \
 }
 
 /*! @brief Open a Bcachefs disk image for reading
+ *
+ *         The image is memory mapped if possible, otherwise its metadata is
+ *         read with `fread`. An opened image can be shared by multiple threads
+ *         through iterators and the reentrant `Bcachefs_find_*_r` functions.
  *
  *  @param [out] this Bcachefs struct to initialize
  *  @param [in] path path to the image
@@ -79,6 +136,21 @@ typedef struct {
  */
 int Bcachefs_open(Bcachefs *this, const char *path);
 
+/*! @brief Open a Bcachefs disk image for reading using a specific backend
+ *
+ *         With `BCACHEFS_BACKEND_MMAP`, btree nodes, the superblock and
+ *         inline data are accessed in place through the mapping without
+ *         copies or per node allocations. Iterators must be finalized before
+ *         the image is closed.
+ *
+ *  @param [out] this Bcachefs struct to initialize
+ *  @param [in] path path to the image
+ *  @param [in] backend how to access the image metadata
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_open_backend(Bcachefs *this, const char *path, Bcachefs_backend backend);
+
 /*! @brief Close a Bcachefs disk image
  *
  *  @param [in] this disk image to close
@@ -87,6 +159,57 @@ int Bcachefs_open(Bcachefs *this, const char *path);
  */
 int Bcachefs_close(Bcachefs *this);
 
+/*! @brief Set the number of btree nodes kept in the node cache
+ *
+ *         Nodes in use by an iterator are never evicted. Other nodes are
+ *         evicted, least recently used first, once the cache holds more than
+ *         `max_nodes` nodes. Defaults to `BCACHEFS_NODE_CACHE_SIZE`.
+ *
+ *  @param [in] this disk image
+ *  @param [in] max_nodes number of nodes to keep in the cache
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_set_node_cache_size(const Bcachefs *this, uint32_t max_nodes);
+
+/*! @brief Set the number of entries kept in the directory entry cache
+ *
+ *         `Bcachefs_find_dirent_r` caches the entries it finds, the entries
+ *         it doesn't find and the hash seeds of the parent directories. The
+ *         least recently used entries are evicted once the cache holds more
+ *         than `max_entries` entries. Defaults to `BCACHEFS_DENTRY_CACHE_SIZE`.
+ *
+ *  @param [in] this disk image
+ *  @param [in] max_entries number of entries to keep in the cache, 0 to disable the cache
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_set_dentry_cache_size(const Bcachefs *this, uint32_t max_entries);
+
+/*! @brief Set the number of inodes kept in the inode cache
+ *
+ *         `Bcachefs_find_inode_r` caches the inodes it decodes in a hash
+ *         table. Once it holds `max_inodes` inodes, new inodes replace older
+ *         ones. Defaults to `BCACHEFS_INODE_CACHE_SIZE`.
+ *
+ *  @param [in] this disk image
+ *  @param [in] max_inodes number of inodes to keep in the cache, 0 to disable the cache
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_set_inode_cache_size(const Bcachefs *this, uint32_t max_inodes);
+
+/*! @brief Fill the inode cache with a single scan of the inodes btree
+ *
+ *         The scan stops once the cache is full, see
+ *         `Bcachefs_set_inode_cache_size`.
+ *
+ *  @param [in] this disk image
+ *
+ *  @return number of inodes loaded in the cache
+ */
+uint32_t Bcachefs_preload_inodes(const Bcachefs *this);
+
 /*! @brief Create a Bcachefs iterator to go through a Bcachefs btree
  *
  *  @param [in] this disk image
@@ -98,7 +221,9 @@ Bcachefs_iterator* Bcachefs_iter(const Bcachefs *this, enum btree_id type);
 
 /*! @brief Find and parse an extent descriptor of a file at a particular offset
  *
- *         The file offset needs to exist in the extents list
+ *         The file offset needs to exist in the extents list. Uses the lookup
+ *         state of the disk image, see `Bcachefs_find_extent_r` to search
+ *         from multiple threads.
  *
  *  @param [in] this disk image
  *  @param [in] inode inode of a file
@@ -109,6 +234,9 @@ Bcachefs_iterator* Bcachefs_iter(const Bcachefs *this, enum btree_id type);
 Bcachefs_extent Bcachefs_find_extent(Bcachefs *this, uint64_t inode, uint64_t file_offset);
 
 /*! @brief Find and parse the inode informations of a file
+ *
+ *         Uses the lookup state of the disk image, see `Bcachefs_find_inode_r`
+ *         to search from multiple threads.
  *
  *  @param [in] this disk image
  *  @param [in] inode inode of a file
@@ -118,6 +246,9 @@ Bcachefs_extent Bcachefs_find_extent(Bcachefs *this, uint64_t inode, uint64_t fi
 Bcachefs_inode Bcachefs_find_inode(Bcachefs *this, uint64_t inode);
 
 /*! @brief Find and parse the dirent informations of a file
+ *
+ *         Uses the lookup state of the disk image, see `Bcachefs_find_dirent_r`
+ *         to search from multiple threads.
  *
  *  @param [in] this disk image
  *  @param [in] parent_inode inode of the parent directory
@@ -129,6 +260,196 @@ Bcachefs_inode Bcachefs_find_inode(Bcachefs *this, uint64_t inode);
  */
 Bcachefs_dirent Bcachefs_find_dirent(Bcachefs *this, uint64_t parent_inode, uint64_t hash_seed, const uint8_t *name, const uint8_t len);
 
+/*! @brief Reentrant version of `Bcachefs_find_extent`
+ *
+ *         Any number of threads can search the same disk image at the same
+ *         time as long as each one uses its own lookup state. A lookup state
+ *         starts as `BCACHEFS_LOOKUP_CLEAN` and is freed with
+ *         `Bcachefs_lookup_fini`.
+ *
+ *  @param [in] this disk image
+ *  @param [in] lookup lookup state of the calling thread
+ *  @param [in] inode inode of a file
+ *  @param [in] file_offset offset of a file extent
+ *
+ *  @return parsed `Bcachefs_extent` or a zeroed struct on failure
+ */
+Bcachefs_extent Bcachefs_find_extent_r(const Bcachefs *this, Bcachefs_lookup *lookup, uint64_t inode, uint64_t file_offset);
+
+/*! @brief Reentrant version of `Bcachefs_find_inode`
+ *
+ *  @param [in] this disk image
+ *  @param [in] lookup lookup state of the calling thread
+ *  @param [in] inode inode of a file
+ *
+ *  @return parsed `Bcachefs_inode` or a zeroed struct on failure
+ */
+Bcachefs_inode Bcachefs_find_inode_r(const Bcachefs *this, Bcachefs_lookup *lookup, uint64_t inode);
+
+/*! @brief Reentrant version of `Bcachefs_find_dirent`
+ *
+ *         The name of the returned dirent stays valid until the next lookup
+ *         using the same lookup state
+ *
+ *  @param [in] this disk image
+ *  @param [in] lookup lookup state of the calling thread
+ *  @param [in] parent_inode inode of the parent directory
+ *  @param [in] hash_seed hash seed of the parent directory or 0
+ *  @param [in] name name of the dirent to find
+ *  @param [in] len length of the name string
+ *
+ *  @return parsed `Bcachefs_dirent` or a zeroed struct on failure
+ */
+Bcachefs_dirent Bcachefs_find_dirent_r(const Bcachefs *this, Bcachefs_lookup *lookup, uint64_t parent_inode, uint64_t hash_seed, const uint8_t *name, const uint8_t len);
+
+/*! @brief Find the extent of a file holding a byte
+ *
+ *         Unlike `Bcachefs_find_extent`, `file_offset` can be anywhere inside
+ *         the extent.
+ *
+ *  @param [in] this disk image
+ *  @param [in] inode inode of the file
+ *  @param [in] file_offset offset of the byte in the file
+ *
+ *  @return parsed `Bcachefs_extent` covering `file_offset` or a zeroed struct
+ *          if the offset is in a hole or past the end of the file
+ */
+Bcachefs_extent Bcachefs_find_extent_at(const Bcachefs *this, uint64_t inode, uint64_t file_offset);
+
+/*! @brief Add an extent to the runs of a file
+ *
+ *         The runs are sorted by file offset and don't overlap. Later extents
+ *         win, like with stale keys of older bsets: the parts of the runs
+ *         overlapped by `extent` are dropped, then fragments contiguous both
+ *         in the file and in the disk image are merged into a single run.
+ *
+ *  @param [in,out] runs runs of the file, with room for `num_runs + 2` runs
+ *  @param [in] num_runs number of runs
+ *  @param [in] extent extent of the file to add
+ *
+ *  @return new number of runs
+ */
+uint32_t Bcachefs_add_extent_run(Bcachefs_extent *runs, uint32_t num_runs, Bcachefs_extent extent);
+
+/*! @brief Find all the extents of a file in file order
+ *
+ *         The extents btree is descended once to the first extent of the file
+ *         and then scanned. The extents are resolved into runs with
+ *         `Bcachefs_add_extent_run`, the same ones an attached index holds.
+ *
+ *  @param [in] this disk image
+ *  @param [in] inode inode of the file
+ *  @param [out] out extents of the file, can be `NULL` if `max_extents` is 0
+ *  @param [in] max_extents number of extents `out` can hold
+ *
+ *  @return number of extents of the file, which could be more than
+ *          `max_extents`, only the first `max_extents` are written, or 0 if
+ *          memory runs out
+ */
+uint32_t Bcachefs_find_extents(const Bcachefs *this, uint64_t inode, Bcachefs_extent *out, uint32_t max_extents);
+
+/*! @brief Find the inodes of a batch of inode numbers
+ *
+ *         The inode numbers are looked up in order so each btree node is
+ *         searched for all the inodes it holds before moving to the next one.
+ *
+ *  @param [in] this disk image
+ *  @param [in] inodes inode numbers to find
+ *  @param [in] num_inodes number of inodes
+ *  @param [out] out parsed `Bcachefs_inode` for each inode number, in the same
+ *                   order, or a zeroed struct if it wasn't found
+ *
+ *  @return number of inodes found
+ */
+uint32_t Bcachefs_find_inodes(Bcachefs *this, const uint64_t *inodes, uint32_t num_inodes, Bcachefs_inode *out);
+
+/*! @brief Find the extents of a batch of files at some offsets
+ *
+ *         Same as `Bcachefs_find_inodes` for `Bcachefs_find_extent`.
+ *
+ *  @param [in] this disk image
+ *  @param [in] inodes inode number of each extent
+ *  @param [in] file_offsets offset of each extent in its file
+ *  @param [in] num_extents number of extents
+ *  @param [out] out parsed `Bcachefs_extent` for each extent, in the same
+ *                   order, or a zeroed struct if it wasn't found
+ *
+ *  @return number of extents found
+ */
+uint32_t Bcachefs_find_extents_batch(Bcachefs *this, const uint64_t *inodes, const uint64_t *file_offsets, uint32_t num_extents, Bcachefs_extent *out);
+
+/*! @brief Reentrant version of `Bcachefs_find_inodes`, see `Bcachefs_find_inode_r`
+ *
+ *  @param [in] this disk image
+ *  @param [in] lookup lookup state of the calling thread
+ *  @param [in] inodes inode numbers to find
+ *  @param [in] num_inodes number of inodes
+ *  @param [out] out parsed `Bcachefs_inode` for each inode number
+ *
+ *  @return number of inodes found
+ */
+uint32_t Bcachefs_find_inodes_r(const Bcachefs *this, Bcachefs_lookup *lookup, const uint64_t *inodes, uint32_t num_inodes, Bcachefs_inode *out);
+
+/*! @brief Reentrant version of `Bcachefs_find_extents_batch`, see `Bcachefs_find_extent_r`
+ *
+ *  @param [in] this disk image
+ *  @param [in] lookup lookup state of the calling thread
+ *  @param [in] inodes inode number of each extent
+ *  @param [in] file_offsets offset of each extent in its file
+ *  @param [in] num_extents number of extents
+ *  @param [out] out parsed `Bcachefs_extent` for each extent
+ *
+ *  @return number of extents found
+ */
+uint32_t Bcachefs_find_extents_batch_r(const Bcachefs *this, Bcachefs_lookup *lookup, const uint64_t *inodes, const uint64_t *file_offsets, uint32_t num_extents, Bcachefs_extent *out);
+
+/*! @brief Free the resources held by a lookup state
+ *
+ *  @param [in] this disk image
+ *  @param [in] lookup lookup state to finalize
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_lookup_fini(const Bcachefs *this, Bcachefs_lookup *lookup);
+
+/*! @brief Read a batch of ranges of the disk image, like the extents of many
+ *         files, at once
+ *
+ *         Uses io_uring when available with a queue depth of
+ *         `BCACHEFS_READ_QUEUE_DEPTH` by default, or worker threads calling
+ *         `pread` otherwise. The result of each request is set in
+ *         `requests[i].result`.
+ *
+ *  @param [in] this disk image
+ *  @param [in,out] requests reads to execute
+ *  @param [in] num_requests number of requests
+ *
+ *  @return 1 if all the requests were read entirely, 0 otherwise
+ */
+int Bcachefs_read_batch(Bcachefs *this, Bcachefs_read_request *requests, uint32_t num_requests);
+
+/*! @brief Reentrant version of `Bcachefs_read_batch`
+ *
+ *         Any number of threads can read from the same disk image at the same
+ *         time as long as each one uses its own reader, initialized with
+ *         `Bcachefs_reader_init` and freed with `Bcachefs_reader_fini`.
+ *
+ *  @param [in] this disk image
+ *  @param [in] reader reader of the calling thread
+ *  @param [in,out] requests reads to execute
+ *  @param [in] num_requests number of requests
+ *  @param [in] callback function called as each request completes, can be `NULL`
+ *  @param [in] data user data passed to `callback`
+ *
+ *  @return 1 if all the requests were read entirely, 0 otherwise
+ */
+int Bcachefs_read_batch_r(const Bcachefs *this,
+                          Bcachefs_reader *reader,
+                          Bcachefs_read_request *requests,
+                          uint32_t num_requests,
+                          Bcachefs_read_callback callback,
+                          void *data);
+
 /*! @brief Fetch next value from an iterator
  *
  *  @param [in] this disk image
@@ -140,6 +461,48 @@ Bcachefs_dirent Bcachefs_find_dirent(Bcachefs *this, uint64_t parent_inode, uint
  */
 const struct bch_val *Bcachefs_iter_next(const Bcachefs *this, Bcachefs_iterator *iter);
 
+/*! @brief Create an iterator over the entries of a directory
+ *
+ *         The dirents btree is only scanned from the first entry of the
+ *         directory, see `Bcachefs_iter_next_dirent`.
+ *
+ *  @param [in] this disk image
+ *  @param [in] parent_inode inode of the directory
+ *
+ *  @return iterator to free with `Bcachefs_iter_fini` and `free`, or `NULL` on
+ *          failure
+ */
+Bcachefs_iterator *Bcachefs_iter_dir(const Bcachefs *this, uint64_t parent_inode);
+
+/*! @brief Fetch the next entry of a directory
+ *
+ *         Deleted entries are skipped.
+ *
+ *  @param [in] this disk image
+ *  @param [in] iter iterator from `Bcachefs_iter_dir`
+ *  @param [in] parent_inode inode of the directory given to `Bcachefs_iter_dir`
+ *
+ *  @return parsed `Bcachefs_dirent`, its name pointing inside the current node
+ *          of the iterator, or a zeroed struct once all the entries are read
+ */
+Bcachefs_dirent Bcachefs_iter_next_dirent(const Bcachefs *this, Bcachefs_iterator *iter, uint64_t parent_inode);
+
+/*! @brief Position an iterator so the next call to `Bcachefs_iter_next`
+ *         returns the first key at or after a position
+ *
+ *         Extents are positioned using their start offset. Seeking descends
+ *         the btree once so scanning a range of `k` keys costs O(log n + k).
+ *
+ *  @param [in] this disk image
+ *  @param [in] iter iterator from `Bcachefs_iter`
+ *  @param [in] inode inode of the position
+ *  @param [in] offset offset of the position, the start offset in bytes for
+ *                     extents
+ *
+ *  @return 1 on success, 0 on failure
+ */
+int Bcachefs_iter_seek(const Bcachefs *this, Bcachefs_iterator *iter, uint64_t inode, uint64_t offset);
+
 /*! @brief Free the resources allocated by the iterator
  *
  *  @param [in] this disk image
@@ -176,9 +539,9 @@ Bcachefs_inode Bcachefs_iter_make_inode(const Bcachefs *this, Bcachefs_iterator
  */
 Bcachefs_dirent Bcachefs_iter_make_dirent(const Bcachefs *this, Bcachefs_iterator *iter);
 
+Bcachefs_node *Bcachefs_load_node(const Bcachefs *this, const struct bch_btree_ptr_v2 *btree_ptr);
 int Bcachefs_next_iter(const Bcachefs *this, Bcachefs_iterator *iter, const struct bch_btree_ptr_v2 *btree_ptr);
 int Bcachefs_iter_reinit(const Bcachefs *this, Bcachefs_iterator *iter, enum btree_id type);
-int Bcachefs_iter_minimal_copy(const Bcachefs *this, Bcachefs_iterator *iter, const Bcachefs_iterator *other);
 const struct jset_entry *Bcachefs_iter_next_jset_entry(const Bcachefs *this, Bcachefs_iterator *iter);
 const struct bch_btree_ptr_v2 *Bcachefs_iter_next_btree_ptr(const Bcachefs *this, Bcachefs_iterator *iter);
 const struct bset *Bcachefs_iter_next_bset(const Bcachefs *this, Bcachefs_iterator *iter);
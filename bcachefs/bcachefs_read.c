@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bcachefs_read.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// IORING_OP_READ came along with IORING_FEAT_RW_CUR_POS
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define BCACHEFS_IO_URING 1
+#else
+#define BCACHEFS_IO_URING 0
+#endif
+
+
+// Read a request entirely unless the end of the file or an error is reached
+void _Bcachefs_pread_request(int fd, Bcachefs_read_request *request)
+{
+    request->result = 0;
+    while ((uint64_t)request->result < request->size)
+    {
+        ssize_t ret = pread(fd,
+                            request->buffer + request->result,
+                            request->size - (uint64_t)request->result,
+                            (off_t)(request->offset + (uint64_t)request->result));
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            request->result = -errno;
+        }
+        if (ret <= 0)
+        {
+            break;
+        }
+        request->result += ret;
+    }
+}
+
+int _Bcachefs_read_requests_done(const Bcachefs_read_request *requests, uint32_t num_requests)
+{
+    uint32_t i = 0;
+    for (; i < num_requests && requests[i].result == (int64_t)requests[i].size; ++i) {}
+    return i == num_requests;
+}
+
+struct _Bcachefs_read_work {
+    int fd;
+    Bcachefs_read_request *requests;
+    uint32_t num_requests;
+    uint32_t next;                              //! next request to read, shared by the workers
+    Bcachefs_read_callback callback;
+    void *data;
+};
+
+void *_Bcachefs_read_worker(void *arg)
+{
+    struct _Bcachefs_read_work *work = arg;
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->num_requests)
+    {
+        _Bcachefs_pread_request(work->fd, &work->requests[i]);
+        if (work->callback)
+        {
+            work->callback(&work->requests[i], work->data);
+        }
+    }
+    return NULL;
+}
+
+// Read the requests from worker threads along with the calling thread
+int _Bcachefs_threads_read(uint32_t queue_depth,
+                           int fd,
+                           Bcachefs_read_request *requests,
+                           uint32_t num_requests,
+                           Bcachefs_read_callback callback,
+                           void *data)
+{
+    struct _Bcachefs_read_work work = {
+        .fd = fd,
+        .requests = requests,
+        .num_requests = num_requests,
+        .callback = callback,
+        .data = data
+    };
+    pthread_t threads[BCACHEFS_READ_THREADS];
+    uint32_t max_threads = queue_depth < BCACHEFS_READ_THREADS ? queue_depth : BCACHEFS_READ_THREADS;
+    if (max_threads > num_requests)
+    {
+        max_threads = num_requests;
+    }
+    uint32_t num_threads = 0;
+    // The calling thread is one of the workers
+    for (; num_threads + 1 < max_threads &&
+         !pthread_create(&threads[num_threads], NULL, _Bcachefs_read_worker, &work);
+         ++num_threads) {}
+    _Bcachefs_read_worker(&work);
+    for (uint32_t i = 0; i < num_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    return _Bcachefs_read_requests_done(requests, num_requests);
+}
+
+#if BCACHEFS_IO_URING
+
+struct _Bcachefs_ring {
+    int fd;
+    int broken;                                 //! an error stopped a batch, the ring is not to be used anymore
+    uint32_t entries;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+void _Bcachefs_ring_free(struct _Bcachefs_ring *ring)
+{
+    if (ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+    {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != MAP_FAILED)
+    {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+struct _Bcachefs_ring *_Bcachefs_ring_setup(uint32_t entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct _Bcachefs_ring *ring = malloc(sizeof(struct _Bcachefs_ring));
+    if (ring == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    *ring = (struct _Bcachefs_ring){
+        .fd = fd,
+        .entries = params.sq_entries,
+        .sq_map = MAP_FAILED,
+        .sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+        .cq_map = MAP_FAILED,
+        .cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe),
+        .sqes = MAP_FAILED,
+        .sqes_size = params.sq_entries * sizeof(struct io_uring_sqe)
+    };
+    int single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map && ring->cq_map_size > ring->sq_map_size)
+    {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single_map ? ring->sq_map :
+        mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        _Bcachefs_ring_free(ring);
+        return NULL;
+    }
+    uint8_t *sq = ring->sq_map;
+    uint8_t *cq = ring->cq_map;
+    ring->sq_tail = (void*)(sq + params.sq_off.tail);
+    ring->sq_mask = (void*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (void*)(sq + params.sq_off.array);
+    ring->cq_head = (void*)(cq + params.cq_off.head);
+    ring->cq_tail = (void*)(cq + params.cq_off.tail);
+    ring->cq_mask = (void*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (void*)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+// Queue the read of what is left of a request, `index` identifies the
+// request on completion
+void _Bcachefs_ring_prep_read(struct _Bcachefs_ring *ring, int fd, const Bcachefs_read_request *request, uint32_t index)
+{
+    // Only this thread produces submissions
+    uint32_t tail = *ring->sq_tail;
+    uint32_t slot = tail & *ring->sq_mask;
+    uint64_t size = request->size - (uint64_t)request->result;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = request->offset + (uint64_t)request->result;
+    sqe->addr = (uint64_t)(uintptr_t)(request->buffer + request->result);
+    sqe->len = size > (1u << 30) ? (1u << 30) : (uint32_t)size;
+    sqe->user_data = index;
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Wait for `pending` reads submitted to the kernel to complete, dropping their
+// completions, so that it is done with the buffers of the requests
+void _Bcachefs_ring_drain(struct _Bcachefs_ring *ring, uint32_t pending)
+{
+    while (pending)
+    {
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && pending; ++head, --pending) {}
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (pending &&
+            syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            // The completions can't be waited for anymore
+            break;
+        }
+    }
+}
+
+int _Bcachefs_ring_read(struct _Bcachefs_ring *ring,
+                        uint32_t queue_depth,
+                        int fd,
+                        Bcachefs_read_request *requests,
+                        uint32_t num_requests,
+                        Bcachefs_read_callback callback,
+                        void *data)
+{
+    uint32_t max_in_flight = queue_depth < ring->entries ? queue_depth : ring->entries;
+    uint32_t next = 0;
+    uint32_t in_flight = 0;
+    uint32_t to_submit = 0;
+    uint32_t done = 0;
+    while (done < num_requests)
+    {
+        for (; next < num_requests && in_flight < max_in_flight; ++next, ++in_flight, ++to_submit)
+        {
+            requests[next].result = 0;
+            _Bcachefs_ring_prep_read(ring, fd, &requests[next], next);
+        }
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno == EBUSY)
+        {
+            // The completion queue is full, only wait for completions and
+            // reap them before submitting again
+            ret = (int)syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        }
+        if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+        {
+            continue;
+        }
+        else if (ret < 0 && done == 0 && in_flight == to_submit)
+        {
+            // Nothing reached the kernel, the batch can be read another way
+            return -1;
+        }
+        else if (ret < 0)
+        {
+            // The caller gets its buffers back once the kernel is done with
+            // the reads already submitted
+            _Bcachefs_ring_drain(ring, in_flight - to_submit);
+            ring->broken = 1;
+            return 0;
+        }
+        to_submit -= (uint32_t)ret;
+
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            Bcachefs_read_request *request = &requests[cqe->user_data];
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+            {
+                _Bcachefs_ring_prep_read(ring, fd, request, (uint32_t)cqe->user_data);
+                ++to_submit;
+                continue;
+            }
+            else if (cqe->res == -EINVAL)
+            {
+                // The kernel doesn't know IORING_OP_READ
+                _Bcachefs_pread_request(fd, request);
+            }
+            else if (cqe->res < 0)
+            {
+                request->result = cqe->res;
+            }
+            else
+            {
+                request->result += cqe->res;
+                if (cqe->res > 0 && (uint64_t)request->result < request->size)
+                {
+                    // Short read, resume where it stopped
+                    _Bcachefs_ring_prep_read(ring, fd, request, (uint32_t)cqe->user_data);
+                    ++to_submit;
+                    continue;
+                }
+            }
+            --in_flight;
+            ++done;
+            if (callback)
+            {
+                callback(request, data);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return _Bcachefs_read_requests_done(requests, num_requests);
+}
+
+#else
+
+struct _Bcachefs_ring {
+    int fd;
+    int broken;
+};
+
+void _Bcachefs_ring_free(struct _Bcachefs_ring *ring)
+{
+    free(ring);
+}
+
+struct _Bcachefs_ring *_Bcachefs_ring_setup(uint32_t entries)
+{
+    (void)entries;
+    return NULL;
+}
+
+int _Bcachefs_ring_read(struct _Bcachefs_ring *ring,
+                        uint32_t queue_depth,
+                        int fd,
+                        Bcachefs_read_request *requests,
+                        uint32_t num_requests,
+                        Bcachefs_read_callback callback,
+                        void *data)
+{
+    (void)ring, (void)queue_depth, (void)fd, (void)requests, (void)num_requests, (void)callback, (void)data;
+    return -1;
+}
+
+#endif
+
+void Bcachefs_reader_init(Bcachefs_reader *reader, uint32_t queue_depth, Bcachefs_read_engine engine)
+{
+    *reader = BCACHEFS_READER_CLEAN;
+    if (queue_depth)
+    {
+        reader->queue_depth = queue_depth;
+    }
+    reader->engine = engine;
+}
+
+void Bcachefs_reader_fini(Bcachefs_reader *reader)
+{
+    if (reader->_ring)
+    {
+        _Bcachefs_ring_free(reader->_ring);
+    }
+    reader->_ring = NULL;
+    reader->_pid = 0;
+}
+
+int Bcachefs_reader_read(Bcachefs_reader *reader,
+                         int fd,
+                         Bcachefs_read_request *requests,
+                         uint32_t num_requests,
+                         Bcachefs_read_callback callback,
+                         void *data)
+{
+    if (num_requests == 0)
+    {
+        return 1;
+    }
+    uint32_t queue_depth = reader->queue_depth ? reader->queue_depth : BCACHEFS_READ_QUEUE_DEPTH;
+    if (reader->_ring && reader->_pid != getpid())
+    {
+        // The ring of the parent process can't be used after a fork
+        Bcachefs_reader_fini(reader);
+    }
+    if (reader->engine == BCACHEFS_READ_ENGINE_AUTO && reader->_ring == NULL && !reader->_no_ring)
+    {
+        reader->_ring = _Bcachefs_ring_setup(queue_depth);
+        reader->_pid = getpid();
+        reader->_no_ring = reader->_ring == NULL;
+    }
+    int ret = -1;
+    if (reader->engine == BCACHEFS_READ_ENGINE_AUTO && reader->_ring)
+    {
+        ret = _Bcachefs_ring_read(reader->_ring, queue_depth, fd, requests, num_requests,
+                                  callback, data);
+    }
+    if (reader->_ring && (ret < 0 || reader->_ring->broken))
+    {
+        // Don't use io_uring anymore in this process
+        Bcachefs_reader_fini(reader);
+        reader->_no_ring = 1;
+    }
+    if (ret < 0)
+    {
+        ret = _Bcachefs_threads_read(queue_depth, fd, requests, num_requests, callback, data);
+    }
+    return ret;
+}
@@ -0,0 +1,97 @@
+/* Include Guard */
+#ifndef INCLUDE_BCACHEFS_READ_H
+#define INCLUDE_BCACHEFS_READ_H
+
+/**
+ * Includes
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Extern "C" Guard */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Defines */
+
+#define BCACHEFS_READ_QUEUE_DEPTH   64
+#define BCACHEFS_READ_THREADS       8
+
+//! Read of a contiguous range of the disk image
+typedef struct {
+    uint64_t offset;                            //! position inside the disk image, in bytes
+    uint64_t size;                              //! number of bytes to read
+    uint8_t *buffer;                            //! destination of at least `size` bytes
+    int64_t result;                             //! number of bytes read or `-errno` once completed
+} Bcachefs_read_request;
+
+/*! @brief Called once per request when its read completes
+ *
+ *  @param [in] request completed request, `request->result` is set
+ *  @param [in] data user data given along with the batch
+ */
+typedef void (*Bcachefs_read_callback)(Bcachefs_read_request *request, void *data);
+
+//! How the reads of a batch are issued
+typedef enum {
+    BCACHEFS_READ_ENGINE_AUTO,                  //! io_uring if the kernel supports it, threads otherwise
+    BCACHEFS_READ_ENGINE_THREADS,               //! `pread` from a few worker threads
+} Bcachefs_read_engine;
+
+struct _Bcachefs_ring;
+
+//! Reusable state to read batches, not to be shared by concurrent batches
+typedef struct {
+    uint32_t queue_depth;                       //! maximum number of reads in flight
+    Bcachefs_read_engine engine;
+    struct _Bcachefs_ring *_ring;               //! io_uring set up on the first batch
+    pid_t _pid;                                 //! process owning `_ring`, forked children set up their own
+    int _no_ring;                               //! io_uring is not available
+} Bcachefs_reader;
+#define BCACHEFS_READER_CLEAN (Bcachefs_reader){.queue_depth = BCACHEFS_READ_QUEUE_DEPTH}
+
+/*! @brief Initialize a batch reader
+ *
+ *  @param [out] reader reader to initialize
+ *  @param [in] queue_depth maximum number of reads in flight, 0 for the default
+ *  @param [in] engine how the reads are issued
+ */
+void Bcachefs_reader_init(Bcachefs_reader *reader, uint32_t queue_depth, Bcachefs_read_engine engine);
+
+/*! @brief Release the io_uring of a batch reader
+ *
+ *  @param [in] reader reader to finalize
+ */
+void Bcachefs_reader_fini(Bcachefs_reader *reader);
+
+/*! @brief Read a batch of ranges from a file
+ *
+ *         With io_uring, all the reads are submitted at once, up to the queue
+ *         depth, and completed from the calling thread. Otherwise they are
+ *         spread over worker threads and `callback` could be called from any
+ *         of them concurrently. Short reads are resumed until the end of the
+ *         file.
+ *
+ *  @param [in] reader batch reader
+ *  @param [in] fd file to read from
+ *  @param [in,out] requests reads to execute
+ *  @param [in] num_requests number of requests
+ *  @param [in] callback function called on each completion, can be `NULL`
+ *  @param [in] data user data passed to `callback`
+ *
+ *  @return 1 if all the requests were read entirely, 0 otherwise
+ */
+int Bcachefs_reader_read(Bcachefs_reader *reader,
+                         int fd,
+                         Bcachefs_read_request *requests,
+                         uint32_t num_requests,
+                         Bcachefs_read_callback callback,
+                         void *data);
+
+/* End Extern "C" and Include Guard */
+#ifdef __cplusplus
+}
+#endif
+#endif
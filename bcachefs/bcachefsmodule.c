@@ -5,15 +5,1715 @@
 #include "bcachefsmodule.h"
 
 
+/* Helpers */
+
+/**
+ * @brief Close the image once the threads reading from it are done
+ */
+
+static int _PyBcachefs_close(PyBcachefs *self)
+{
+    int closed;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_wrlock(&self->_lock);
+    closed = Bcachefs_close(&self->_fs);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    return closed;
+}
+
+/**
+ * @brief Release an image used by an iterator or a file view, closing it if
+ *        `close` was deferred until then
+ */
+
+static void _PyBcachefs_release(PyBcachefs *self)
+{
+    if (!--self->_iterators && self->_closing)
+    {
+        self->_closing = 0;
+        _PyBcachefs_close(self);
+    }
+}
+
+/**
+ * @brief Free the reader of a thread when it exits
+ */
+
+static void _PyBcachefs_reader_free(void *reader)
+{
+    Bcachefs_reader_fini(reader);
+    free(reader);
+}
+
+/**
+ * @brief Get the reader of the calling thread, kept between batches so its
+ *        ring is only set up once
+ */
+
+static Bcachefs_reader *_PyBcachefs_reader(Bcachefs_read_engine engine)
+{
+    Bcachefs_reader *reader = pthread_getspecific(_PyBcachefs_reader_key);
+    if (reader == NULL)
+    {
+        reader = malloc(sizeof(Bcachefs_reader));
+        if (reader == NULL)
+        {
+            return NULL;
+        }
+        Bcachefs_reader_init(reader, 0, engine);
+        if (pthread_setspecific(_PyBcachefs_reader_key, reader))
+        {
+            free(reader);
+            return NULL;
+        }
+    }
+    reader->engine = engine;
+    return reader;
+}
+
+/**
+ * @brief Copy the name of a dirent before the node holding it is released
+ */
+
+static void _PyBcachefs_copy_dirent_name(Bcachefs_dirent *dirent, uint8_t *name)
+{
+    if (dirent->name)
+    {
+        memcpy(name, dirent->name, dirent->name_len);
+        dirent->name = name;
+    }
+}
+
 /* Python API Function Definitions */
 
 /**
  * @brief Slot tp_dealloc
  */
 
-static void PyBcachefs_dealloc(PyBcachefs* self)
+static void PyBcachefs_dealloc(PyBcachefs* self)
+{
+    Bcachefs_close(&self->_fs);
+    pthread_rwlock_destroy(&self->_lock);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/**
+ * @brief Slot tp_new
+ */
+
+static PyObject* PyBcachefs_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    (void)args;
+    (void)kwargs;
+    PyBcachefs *self = (void*)type->tp_alloc(type, 0);
+    if (self)
+    {
+        self->_fs = BCACHEFS_CLEAN;
+        pthread_rwlock_init(&self->_lock, NULL);
+    }
+    return (PyObject*)self;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_open(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs < 1 || nargs > 2)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 or 2 arguments");
+        return NULL;
+    }
+    const char *path = (void*)PyUnicode_1BYTE_DATA(args[0]);
+    long backend = nargs == 1 ? BCACHEFS_BACKEND_MMAP : PyLong_AsLong(args[1]);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    if (backend != BCACHEFS_BACKEND_FILE && backend != BCACHEFS_BACKEND_MMAP)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Unknown Bcachefs backend");
+        return NULL;
+    }
+    if (self->_iterators)
+    {
+        // The image can't be replaced under the iterators or file views
+        // reading from it
+        PyErr_SetString(PyExc_RuntimeError, "Bcachefs image is still used by iterators or file views");
+        return NULL;
+    }
+    if (!_PyBcachefs_close(self))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error closing Bcachefs image file");
+        return NULL;
+    }
+    self->_closing = 0;
+    int opened;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_wrlock(&self->_lock);
+    self->_fs = BCACHEFS_CLEAN;
+    opened = nargs == 1 ?
+        Bcachefs_open(&self->_fs, path) :
+        Bcachefs_open_backend(&self->_fs, path, (Bcachefs_backend)backend);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (!opened)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error opening Bcachefs image file");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_close(PyBcachefs *self)
+{
+    if (self->_iterators)
+    {
+        // Iterators or file views could still be reading from the image's
+        // mapping, the image will be closed once the last one is deallocated
+        self->_closing = 1;
+    }
+    else if (!_PyBcachefs_close(self))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error closing Bcachefs image file");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_iter(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    PyBcachefs_iterator *iter = (void*)PyObject_CallObject((PyObject*)&PyBcachefs_iteratorType, NULL);
+    if (iter)
+    {
+        Py_INCREF(self);
+        iter->_pyfs = self;
+        ++self->_iterators;
+    }
+    if (iter == NULL || nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error initializing Bcachefs iterator");
+        Py_XDECREF(iter);
+        return NULL;
+    }
+    enum btree_id type = (enum btree_id)(int)PyLong_AsLong(args[0]);
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    iter->_iter = Bcachefs_iter(&iter->_pyfs->_fs, type);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (iter->_iter == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error initializing Bcachefs iterator");
+        Py_DECREF(iter);
+        return NULL;
+    }
+    return (PyObject*)iter;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_find_extent(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 2)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 2 arguments");
+        return NULL;
+    }
+    uint64_t inode = (uint64_t)PyLong_AsLong(args[0]);
+    uint64_t file_offset = (uint64_t)PyLong_AsLong(args[1]);
+    Bcachefs_extent extent;
+    Py_BEGIN_ALLOW_THREADS
+    Bcachefs_lookup lookup = BCACHEFS_LOOKUP_CLEAN;
+    pthread_rwlock_rdlock(&self->_lock);
+    extent = Bcachefs_find_extent_r(&self->_fs, &lookup, inode, file_offset);
+    Bcachefs_lookup_fini(&self->_fs, &lookup);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (extent.inode)
+    {
+        return Py_BuildValue("KKKK", extent.inode, extent.file_offset, extent.offset, extent.size);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_find_inode(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    uint64_t inode_num = (uint64_t)PyLong_AsLong(args[0]);
+    Bcachefs_inode inode;
+    Py_BEGIN_ALLOW_THREADS
+    Bcachefs_lookup lookup = BCACHEFS_LOOKUP_CLEAN;
+    pthread_rwlock_rdlock(&self->_lock);
+    inode = Bcachefs_find_inode_r(&self->_fs, &lookup, inode_num);
+    Bcachefs_lookup_fini(&self->_fs, &lookup);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (inode.inode)
+    {
+        return Py_BuildValue("KKK", inode.inode, inode.size, inode.hash_seed);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief
+ */
+
+static PyObject *PyBcachefs_find_dirent(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 3)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 3 arguments");
+        return NULL;
+    }
+
+    uint64_t parent_inode = (uint64_t)PyLong_AsLong(args[0]);
+    uint64_t hash_seed = (uint64_t)PyLong_AsLong(args[1]);
+    const uint8_t *name = (const void*)PyBytes_AsString(args[2]);
+    const uint8_t len = PyBytes_Size(args[2]);
+    uint8_t name_copy[UINT8_MAX];
+    Bcachefs_dirent dirent;
+    Py_BEGIN_ALLOW_THREADS
+    Bcachefs_lookup lookup = BCACHEFS_LOOKUP_CLEAN;
+    pthread_rwlock_rdlock(&self->_lock);
+    dirent = Bcachefs_find_dirent_r(&self->_fs, &lookup, parent_inode, hash_seed, name, len);
+    _PyBcachefs_copy_dirent_name(&dirent, name_copy);
+    Bcachefs_lookup_fini(&self->_fs, &lookup);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (dirent.inode)
+    {
+        return Py_BuildValue("KKIU#", dirent.parent_inode, dirent.inode, (uint32_t)dirent.type, dirent.name, dirent.name_len);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Write the sidecar index of the image
+ */
+
+static PyObject *PyBcachefs_write_index(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    const char *path = PyUnicode_AsUTF8(args[0]);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    int written;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    written = Bcachefs_index_write(&self->_fs, path);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (!written)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error writing Bcachefs index file");
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Attach a sidecar index to the image, returns False if it is missing
+ *        or stale
+ */
+
+static PyObject *PyBcachefs_open_index(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    const char *path = PyUnicode_AsUTF8(args[0]);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    int opened;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_wrlock(&self->_lock);
+    opened = Bcachefs_open_index(&self->_fs, path);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(opened);
+}
+
+/**
+ * @brief Map the sidecar index at `path` if it is valid for the image, build
+ *        the catalog in memory otherwise
+ */
+
+static PyObject *PyBcachefs_build_catalog(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs > 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 0 or 1 argument");
+        return NULL;
+    }
+    const char *path = nargs == 1 && args[0] != Py_None ? PyUnicode_AsUTF8(args[0]) : NULL;
+    if (path == NULL && PyErr_Occurred())
+    {
+        return NULL;
+    }
+    PyBcachefs_catalog *catalog = (void*)PyObject_CallObject((PyObject*)&PyBcachefs_catalogType, NULL);
+    if (catalog == NULL)
+    {
+        return NULL;
+    }
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    ret = (path && self->_fs.sb && Bcachefs_index_open(&catalog->_index, path, self->_fs.sb)) ||
+        Bcachefs_index_build(&self->_fs, &catalog->_index);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (!ret)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error building Bcachefs catalog");
+        Py_DECREF(catalog);
+        return NULL;
+    }
+    return (PyObject*)catalog;
+}
+
+/**
+ * @brief Set the number of entries kept in the directory entry cache
+ */
+
+static PyObject *PyBcachefs_set_dentry_cache_size(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    uint32_t max_entries = (uint32_t)PyLong_AsUnsignedLong(args[0]);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    ret = Bcachefs_set_dentry_cache_size(&self->_fs, max_entries);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (!ret)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Could not resize the dentry cache");
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Set the number of inodes kept in the inode cache
+ */
+
+static PyObject *PyBcachefs_set_inode_cache_size(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    uint32_t max_inodes = (uint32_t)PyLong_AsUnsignedLong(args[0]);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    ret = Bcachefs_set_inode_cache_size(&self->_fs, max_inodes);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (!ret)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Could not resize the inode cache");
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Fill the inode cache with a single scan of the inodes btree
+ */
+
+static PyObject *PyBcachefs_preload_inodes(PyBcachefs *self)
+{
+    uint32_t num_loaded;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    num_loaded = Bcachefs_preload_inodes(&self->_fs);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    return PyLong_FromUnsignedLong(num_loaded);
+}
+
+/**
+ * @brief List the entries of a directory
+ */
+
+static PyObject *PyBcachefs_scandir(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    uint64_t parent_inode = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    // Names are copied as the nodes holding them are released along the way
+    struct {
+        Bcachefs_dirent dirent;
+        uint8_t name[UINT8_MAX];
+    } *entries = NULL;
+    size_t num_entries = 0;
+    int ok = 1;
+    Py_BEGIN_ALLOW_THREADS
+    size_t capacity = 0;
+    pthread_rwlock_rdlock(&self->_lock);
+    Bcachefs_iterator *iter = Bcachefs_iter_dir(&self->_fs, parent_inode);
+    ok = iter != NULL;
+    for (Bcachefs_dirent dirent; ok && (dirent = Bcachefs_iter_next_dirent(&self->_fs, iter, parent_inode)).inode; ++num_entries)
+    {
+        if (num_entries == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            void *grown = PyMem_RawRealloc(entries, capacity * sizeof(*entries));
+            ok = grown != NULL;
+            if (!ok)
+            {
+                break;
+            }
+            entries = grown;
+        }
+        entries[num_entries].dirent = dirent;
+        _PyBcachefs_copy_dirent_name(&entries[num_entries].dirent, entries[num_entries].name);
+    }
+    Bcachefs_iter_fini(&self->_fs, iter);
+    free(iter);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    PyObject *results = NULL;
+    if (!ok)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error listing Bcachefs directory");
+    }
+    else
+    {
+        results = PyList_New(num_entries);
+    }
+    for (size_t i = 0; results && i < num_entries; ++i)
+    {
+        const Bcachefs_dirent *dirent = &entries[i].dirent;
+        // `dirent->name` could point to where `entries` was before growing
+        PyObject *item = Py_BuildValue("KKIU#", dirent->parent_inode, dirent->inode, (uint32_t)dirent->type, entries[i].name, dirent->name_len);
+        if (item == NULL)
+        {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, item);
+    }
+    PyMem_RawFree(entries);
+    return results;
+}
+
+/**
+ * @brief Find the extent holding a byte of a file
+ */
+
+static PyObject *PyBcachefs_find_extent_at(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 2)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 2 arguments");
+        return NULL;
+    }
+    uint64_t inode = (uint64_t)PyLong_AsLong(args[0]);
+    uint64_t file_offset = (uint64_t)PyLong_AsLong(args[1]);
+    Bcachefs_extent extent;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    extent = Bcachefs_find_extent_at(&self->_fs, inode, file_offset);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (extent.inode)
+    {
+        return Py_BuildValue("KKKK", extent.inode, extent.file_offset, extent.offset, extent.size);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Find all the extents of a file, contiguous fragments being merged
+ */
+
+static PyObject *PyBcachefs_find_extents(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    uint64_t inode = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    Bcachefs_extent small[16];
+    Bcachefs_extent *extents = small;
+    uint32_t max_extents = sizeof(small) / sizeof(*small);
+    uint32_t num_extents;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    num_extents = Bcachefs_find_extents(&self->_fs, inode, extents, max_extents);
+    if (num_extents > max_extents)
+    {
+        // Large files, look again with enough room for all the extents
+        extents = PyMem_RawMalloc(num_extents * sizeof(Bcachefs_extent));
+        max_extents = extents ? num_extents : 0;
+        num_extents = Bcachefs_find_extents(&self->_fs, inode, extents, max_extents);
+    }
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    PyObject *results = NULL;
+    if (num_extents > max_extents)
+    {
+        PyErr_NoMemory();
+    }
+    else
+    {
+        results = PyList_New(num_extents);
+    }
+    for (uint32_t i = 0; results && i < num_extents; ++i)
+    {
+        PyObject *extent = Py_BuildValue("KKKK", extents[i].inode, extents[i].file_offset, extents[i].offset, extents[i].size);
+        if (extent == NULL)
+        {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, extent);
+    }
+    if (extents != small)
+    {
+        PyMem_RawFree(extents);
+    }
+    return results;
+}
+
+/**
+ * @brief Find a batch of inodes, `None` for the ones which are not found
+ */
+
+static PyObject *PyBcachefs_find_inodes(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(args[0], "Inodes must be a sequence");
+    if (seq == NULL)
+    {
+        return NULL;
+    }
+    Py_ssize_t num_inodes = PySequence_Fast_GET_SIZE(seq);
+    uint64_t *inodes = PyMem_Calloc(num_inodes ? num_inodes : 1, sizeof(uint64_t));
+    Bcachefs_inode *found = PyMem_Calloc(num_inodes ? num_inodes : 1, sizeof(Bcachefs_inode));
+    PyObject *results = NULL;
+    if (inodes == NULL || found == NULL)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (Py_ssize_t i = 0; i < num_inodes; ++i)
+    {
+        inodes[i] = (uint64_t)PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+    }
+    if (PyErr_Occurred())
+    {
+        goto cleanup;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    Bcachefs_lookup lookup = BCACHEFS_LOOKUP_CLEAN;
+    pthread_rwlock_rdlock(&self->_lock);
+    Bcachefs_find_inodes_r(&self->_fs, &lookup, inodes, (uint32_t)num_inodes, found);
+    Bcachefs_lookup_fini(&self->_fs, &lookup);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    results = PyList_New(num_inodes);
+    for (Py_ssize_t i = 0; results && i < num_inodes; ++i)
+    {
+        PyObject *inode = Py_None;
+        if (found[i].inode)
+        {
+            inode = Py_BuildValue("KKK", found[i].inode, found[i].size, found[i].hash_seed);
+        }
+        else
+        {
+            Py_INCREF(Py_None);
+        }
+        if (inode == NULL)
+        {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, inode);
+    }
+
+cleanup:
+    PyMem_Free(found);
+    PyMem_Free(inodes);
+    Py_DECREF(seq);
+    return results;
+}
+
+/**
+ * @brief Find a batch of `(inode, file_offset)` extents, `None` for the ones
+ *        which are not found
+ */
+
+static PyObject *PyBcachefs_find_extents_batch(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    PyObject *seq = PySequence_Fast(args[0], "Extents must be a sequence");
+    if (seq == NULL)
+    {
+        return NULL;
+    }
+    Py_ssize_t num_extents = PySequence_Fast_GET_SIZE(seq);
+    uint64_t *inodes = PyMem_Calloc(num_extents ? num_extents : 1, sizeof(uint64_t));
+    uint64_t *file_offsets = PyMem_Calloc(num_extents ? num_extents : 1, sizeof(uint64_t));
+    Bcachefs_extent *found = PyMem_Calloc(num_extents ? num_extents : 1, sizeof(Bcachefs_extent));
+    PyObject *results = NULL;
+    if (inodes == NULL || file_offsets == NULL || found == NULL)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (Py_ssize_t i = 0; i < num_extents; ++i)
+    {
+        unsigned long long inode, file_offset;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "KK", &inode, &file_offset))
+        {
+            goto cleanup;
+        }
+        inodes[i] = inode;
+        file_offsets[i] = file_offset;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    Bcachefs_lookup lookup = BCACHEFS_LOOKUP_CLEAN;
+    pthread_rwlock_rdlock(&self->_lock);
+    Bcachefs_find_extents_batch_r(&self->_fs, &lookup, inodes, file_offsets, (uint32_t)num_extents, found);
+    Bcachefs_lookup_fini(&self->_fs, &lookup);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    results = PyList_New(num_extents);
+    for (Py_ssize_t i = 0; results && i < num_extents; ++i)
+    {
+        PyObject *extent = Py_None;
+        if (found[i].inode)
+        {
+            extent = Py_BuildValue("KKKK", found[i].inode, found[i].file_offset, found[i].offset, found[i].size);
+        }
+        else
+        {
+            Py_INCREF(Py_None);
+        }
+        if (extent == NULL)
+        {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, extent);
+    }
+
+cleanup:
+    PyMem_Free(found);
+    PyMem_Free(file_offsets);
+    PyMem_Free(inodes);
+    Py_DECREF(seq);
+    return results;
+}
+
+/**
+ * @brief Read a batch of `(offset, buffer)` ranges of the image, each buffer
+ *        being filled entirely
+ */
+
+static PyObject *PyBcachefs_read_batch(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs < 1 || nargs > 2)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 or 2 arguments");
+        return NULL;
+    }
+    long engine = nargs == 1 ? BCACHEFS_READ_ENGINE_AUTO : PyLong_AsLong(args[1]);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    if (engine != BCACHEFS_READ_ENGINE_AUTO && engine != BCACHEFS_READ_ENGINE_THREADS)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Unknown Bcachefs read engine");
+        return NULL;
+    }
+    Bcachefs_reader *reader = _PyBcachefs_reader((Bcachefs_read_engine)engine);
+    if (reader == NULL)
+    {
+        return PyErr_NoMemory();
+    }
+    PyObject *seq = PySequence_Fast(args[0], "Requests must be a sequence");
+    if (seq == NULL)
+    {
+        return NULL;
+    }
+    Py_ssize_t num_requests = PySequence_Fast_GET_SIZE(seq);
+    Bcachefs_read_request *requests = PyMem_Calloc(num_requests ? num_requests : 1, sizeof(Bcachefs_read_request));
+    Py_buffer *views = PyMem_Calloc(num_requests ? num_requests : 1, sizeof(Py_buffer));
+    PyObject *results = NULL;
+    Py_ssize_t num_views = 0;
+    if (requests == NULL || views == NULL)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (; num_views < num_requests; ++num_views)
+    {
+        unsigned long long offset;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, num_views), "Kw*", &offset, &views[num_views]))
+        {
+            goto cleanup;
+        }
+        requests[num_views] = (Bcachefs_read_request){
+            .offset = offset,
+            .size = (uint64_t)views[num_views].len,
+            .buffer = views[num_views].buf
+        };
+    }
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_rdlock(&self->_lock);
+    Bcachefs_read_batch_r(&self->_fs, reader, requests, (uint32_t)num_requests, NULL, NULL);
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    results = PyList_New(num_requests);
+    for (Py_ssize_t i = 0; results && i < num_requests; ++i)
+    {
+        if (requests[i].result < 0)
+        {
+            errno = (int)-requests[i].result;
+            PyErr_SetFromErrno(PyExc_OSError);
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, PyLong_FromLongLong(requests[i].result));
+    }
+
+cleanup:
+    for (Py_ssize_t i = 0; i < num_views; ++i)
+    {
+        PyBuffer_Release(&views[i]);
+    }
+    PyMem_Free(views);
+    PyMem_Free(requests);
+    Py_DECREF(seq);
+    return results;
+}
+
+/**
+ * @brief Read a whole file, as a view into the mapping of the image when the
+ *        file is stored in a single extent or as `bytes` otherwise, `None` if
+ *        the file is not found
+ */
+
+static PyObject *PyBcachefs_read_file(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
+    }
+    uint64_t inode_num = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    // Keep the image open until the content of the file is read or viewed
+    ++self->_iterators;
+    Bcachefs_inode inode;
+    Bcachefs_extent small[16];
+    Bcachefs_extent *extents = small;
+    uint32_t max_extents = sizeof(small) / sizeof(*small);
+    uint32_t num_extents = 0;
+    const uint8_t *map;
+    uint64_t map_size;
+    Py_BEGIN_ALLOW_THREADS
+    Bcachefs_lookup lookup = BCACHEFS_LOOKUP_CLEAN;
+    pthread_rwlock_rdlock(&self->_lock);
+    inode = Bcachefs_find_inode_r(&self->_fs, &lookup, inode_num);
+    Bcachefs_lookup_fini(&self->_fs, &lookup);
+    if (inode.inode)
+    {
+        num_extents = Bcachefs_find_extents(&self->_fs, inode.inode, extents, max_extents);
+    }
+    if (num_extents > max_extents)
+    {
+        extents = PyMem_RawMalloc(num_extents * sizeof(Bcachefs_extent));
+        max_extents = extents ? num_extents : 0;
+        num_extents = Bcachefs_find_extents(&self->_fs, inode.inode, extents, max_extents);
+    }
+    map = self->_fs.map;
+    map_size = self->_fs.size;
+    pthread_rwlock_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    PyObject *result = NULL;
+    if (num_extents > max_extents)
+    {
+        PyErr_NoMemory();
+    }
+    else if (inode.inode == 0)
+    {
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+    else if (map && inode.size && num_extents == 1 && extents[0].file_offset == 0 &&
+             extents[0].size >= inode.size && extents[0].offset + inode.size <= map_size)
+    {
+        PyBcachefs_file *file = (void*)PyObject_CallObject((PyObject*)&PyBcachefs_fileType, NULL);
+        if (file)
+        {
+            // The view holds the image open in place of this call
+            Py_INCREF(self);
+            file->_pyfs = self;
+            file->_buf = map + extents[0].offset;
+            file->_len = (Py_ssize_t)inode.size;
+            ++self->_iterators;
+        }
+        result = (PyObject*)file;
+    }
+    else
+    {
+        // Fragmented file or unmapped image, read the extents right into the
+        // bytes object and zero the holes
+        result = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)inode.size);
+        Bcachefs_read_request *requests = result ? PyMem_RawCalloc(num_extents ? num_extents : 1, sizeof(Bcachefs_read_request)) : NULL;
+        if (result && requests == NULL)
+        {
+            PyErr_NoMemory();
+            Py_CLEAR(result);
+        }
+        uint8_t *buf = result ? (uint8_t*)PyBytes_AS_STRING(result) : NULL;
+        uint32_t num_requests = 0;
+        int done = 1;
+        Py_BEGIN_ALLOW_THREADS
+        uint64_t end = 0;
+        for (uint32_t i = 0; buf && i < num_extents && extents[i].file_offset < inode.size; ++i)
+        {
+            uint64_t file_offset = extents[i].file_offset;
+            uint64_t size = extents[i].size < inode.size - file_offset ? extents[i].size : inode.size - file_offset;
+            if (file_offset > end)
+            {
+                memset(buf + end, 0, file_offset - end);
+            }
+            requests[num_requests++] = (Bcachefs_read_request){
+                .offset = extents[i].offset,
+                .size = size,
+                .buffer = buf + file_offset
+            };
+            end = file_offset + size > end ? file_offset + size : end;
+        }
+        if (buf)
+        {
+            memset(buf + end, 0, inode.size - end);
+            // The calling thread reads the extents one after the other, files
+            // are too small to be worth a ring or worker threads
+            Bcachefs_reader reader;
+            Bcachefs_reader_init(&reader, 1, BCACHEFS_READ_ENGINE_THREADS);
+            pthread_rwlock_rdlock(&self->_lock);
+            done = Bcachefs_read_batch_r(&self->_fs, &reader, requests, num_requests, NULL, NULL);
+            pthread_rwlock_unlock(&self->_lock);
+            Bcachefs_reader_fini(&reader);
+        }
+        Py_END_ALLOW_THREADS
+        for (uint32_t i = 0; result && !done && i < num_requests; ++i)
+        {
+            if (requests[i].result < 0)
+            {
+                errno = (int)-requests[i].result;
+                PyErr_SetFromErrno(PyExc_OSError);
+                Py_CLEAR(result);
+            }
+        }
+        if (result && !done)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "Error reading Bcachefs file");
+            Py_CLEAR(result);
+        }
+        PyMem_RawFree(requests);
+    }
+    if (extents != small)
+    {
+        PyMem_RawFree(extents);
+    }
+    _PyBcachefs_release(self);
+    return result;
+}
+
+/**
+ * @brief Getter for length.
+ */
+
+static PyObject* PyBcachefs_getsize(PyBcachefs* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromLong(self->_fs.size);
+}
+
+/**
+ * Table of methods.
+ */
+
+static PyMethodDef PyBcachefs_methods[] = {
+    {"open", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_open,
+     METH_FASTCALL | METH_KEYWORDS, "Open bcachefs file to read"},
+    {"close", (PyCFunction)PyBcachefs_close, METH_NOARGS, "Close bcachefs file"},
+    {"find_extent", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_extent,
+     METH_FASTCALL | METH_KEYWORDS, "Find extent"},
+    {"find_inode", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_inode,
+     METH_FASTCALL | METH_KEYWORDS, "Find inode"},
+    {"find_dirent", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_dirent,
+     METH_FASTCALL | METH_KEYWORDS, "Find dirent"},
+    {"write_index", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_write_index,
+     METH_FASTCALL | METH_KEYWORDS, "Write the sidecar index of the image"},
+    {"open_index", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_open_index,
+     METH_FASTCALL | METH_KEYWORDS, "Attach a sidecar index to the image"},
+    {"catalog", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_build_catalog,
+     METH_FASTCALL | METH_KEYWORDS, "Build the catalog of the image or map its index"},
+    {"set_dentry_cache_size", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_set_dentry_cache_size,
+     METH_FASTCALL | METH_KEYWORDS, "Set the number of entries kept in the dentry cache"},
+    {"set_inode_cache_size", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_set_inode_cache_size,
+     METH_FASTCALL | METH_KEYWORDS, "Set the number of inodes kept in the inode cache"},
+    {"preload_inodes", (PyCFunction)PyBcachefs_preload_inodes, METH_NOARGS,
+     "Fill the inode cache with a single scan of the inodes btree"},
+    {"scandir", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_scandir,
+     METH_FASTCALL | METH_KEYWORDS, "List the entries of a directory"},
+    {"find_extent_at", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_extent_at,
+     METH_FASTCALL | METH_KEYWORDS, "Find the extent holding a byte of a file"},
+    {"find_extents", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_extents,
+     METH_FASTCALL | METH_KEYWORDS, "Find all the extents of a file"},
+    {"find_inodes", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_inodes,
+     METH_FASTCALL | METH_KEYWORDS, "Find a batch of inodes"},
+    {"find_extents_batch", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_extents_batch,
+     METH_FASTCALL | METH_KEYWORDS, "Find a batch of (inode, file_offset) extents"},
+    {"read_batch", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_read_batch,
+     METH_FASTCALL | METH_KEYWORDS, "Read a batch of (offset, buffer) ranges of the image"},
+    {"read_file", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_read_file,
+     METH_FASTCALL | METH_KEYWORDS, "Read a whole file without copying it if possible"},
+    {"iter", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_iter,
+     METH_FASTCALL | METH_KEYWORDS, "Iterate over entries of specified type"},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+/**
+ * Table of getter-setters.
+ */
+
+static PyGetSetDef PyBcachefs_getsetters[] = {
+    {"size", (getter)PyBcachefs_getsize, 0, "Size of the image file", NULL},
+    {NULL, NULL, 0, NULL, NULL}  /* Sentinel */
+};
+
+static PyTypeObject PyBcachefsType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "benzina.c_bcachefs.Bcachefs",   /* tp_name */
+    sizeof(PyBcachefs),              /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    (destructor)PyBcachefs_dealloc,  /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_reserved */
+    0,                               /* tp_repr */
+    0,                               /* tp_as_number */
+    0,                               /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash  */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    0,                               /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Bcachefs object",               /* tp_doc */
+    0,                               /* tp_traverse */
+    0,                               /* tp_clear */
+    0,                               /* tp_richcompare */
+    0,                               /* tp_weaklistoffset */
+    0,                               /* tp_iter */
+    0,                               /* tp_iternext */
+    PyBcachefs_methods,              /* tp_methods */
+    0,                               /* tp_members */
+    PyBcachefs_getsetters,           /* tp_getset */
+    0,                               /* tp_base */
+    0,                               /* tp_dict */
+    0,                               /* tp_descr_get */
+    0,                               /* tp_descr_set */
+    0,                               /* tp_dictoffset */
+    0,                               /* tp_init */
+    0,                               /* tp_alloc */
+    PyBcachefs_new,                  /* tp_new */
+};
+
+/**
+ * @brief Slot tp_dealloc
+ */
+
+static void PyBcachefs_iterator_dealloc(PyBcachefs_iterator* self)
+{
+    if (self->_iter)
+    {
+        Bcachefs_iter_fini(&self->_pyfs->_fs, self->_iter);
+        free(self->_iter);
+        self->_iter = NULL;
+    }
+    if (self->_pyfs)
+    {
+        _PyBcachefs_release(self->_pyfs);
+    }
+    Py_XDECREF((PyObject*)self->_pyfs);
+    pthread_mutex_destroy(&self->_lock);
+    free(self->_deleted);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/**
+ * @brief Slot tp_new
+ */
+
+static PyObject* PyBcachefs_iterator_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    (void)args;
+    (void)kwargs;
+    PyBcachefs_iterator *self = (void*)type->tp_alloc(type, 0);
+    if (self)
+    {
+        pthread_mutex_init(&self->_lock, NULL);
+    }
+    return (PyObject*)self;
+}
+
+/**
+ * @brief Check if an inode was found deleted earlier in the iteration, after
+ *        recording it if it is deleted now
+ */
+
+static int _PyBcachefs_iterator_deleted(PyBcachefs_iterator *self, uint64_t inode, int deleted)
+{
+    size_t pos = 0;
+    size_t end = self->_num_deleted;
+    while (pos < end)
+    {
+        size_t mid = pos + (end - pos) / 2;
+        if (self->_deleted[mid] < inode)
+        {
+            pos = mid + 1;
+        }
+        else
+        {
+            end = mid;
+        }
+    }
+    if (pos < self->_num_deleted && self->_deleted[pos] == inode)
+    {
+        return 1;
+    }
+    if (deleted && self->_num_deleted == self->_deleted_capacity)
+    {
+        size_t capacity = self->_deleted_capacity ? self->_deleted_capacity * 2 : 16;
+        uint64_t *array = realloc(self->_deleted, capacity * sizeof(uint64_t));
+        if (array == NULL)
+        {
+            // Still skipped, only not remembered
+            return 1;
+        }
+        self->_deleted = array;
+        self->_deleted_capacity = capacity;
+    }
+    if (deleted)
+    {
+        memmove(self->_deleted + pos + 1, self->_deleted + pos,
+                (self->_num_deleted - pos) * sizeof(uint64_t));
+        self->_deleted[pos] = inode;
+        ++self->_num_deleted;
+    }
+    return deleted;
+}
+
+/**
+ * @brief Advance an iterator to its next live item, with the locks held
+ *
+ *        Inodes without a hash seed and the later versions of them are
+ *        skipped. Deleted dirents are decoded without an inode nor a parent so
+ *        they can't shadow a live dirent and are simply skipped.
+ *
+ * @return 1 if an item was found, 0 at the end of the iteration
+ */
+
+static int _PyBcachefs_iterator_step(PyBcachefs_iterator *self, Bcachefs_extent *extent, Bcachefs_inode *inode, Bcachefs_dirent *dirent)
+{
+    const Bcachefs *fs = &self->_pyfs->_fs;
+    Bcachefs_iterator *iter = self->_iter;
+    while (Bcachefs_iter_next(fs, iter))
+    {
+        switch ((int)iter->type)
+        {
+        case BTREE_ID_extents:
+            *extent = Bcachefs_iter_make_extent(fs, iter);
+            return 1;
+        case BTREE_ID_inodes:
+            *inode = Bcachefs_iter_make_inode(fs, iter);
+            if (!_PyBcachefs_iterator_deleted(self, inode->inode, inode->hash_seed == 0))
+            {
+                return 1;
+            }
+            break;
+        case BTREE_ID_dirents:
+            *dirent = Bcachefs_iter_make_dirent(fs, iter);
+            if (dirent->inode)
+            {
+                return 1;
+            }
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Build the struct sequences of the items of the iterators
+ */
+
+static PyObject *_PyBcachefs_struct_sequence(PyTypeObject *type, PyObject **items, Py_ssize_t num_items)
+{
+    PyObject *sequence = PyStructSequence_New(type);
+    int ok = sequence != NULL;
+    for (Py_ssize_t i = 0; i < num_items; ++i)
+    {
+        ok = ok && items[i];
+        if (sequence)
+        {
+            PyStructSequence_SET_ITEM(sequence, i, items[i]);
+        }
+        else
+        {
+            Py_XDECREF(items[i]);
+        }
+    }
+    if (!ok)
+    {
+        Py_XDECREF(sequence);
+        return NULL;
+    }
+    return sequence;
+}
+
+static PyObject *_PyBcachefs_new_extent(const Bcachefs_extent *extent)
+{
+    PyObject *items[] = {PyLong_FromUnsignedLongLong(extent->inode),
+                         PyLong_FromUnsignedLongLong(extent->file_offset),
+                         PyLong_FromUnsignedLongLong(extent->offset),
+                         PyLong_FromUnsignedLongLong(extent->size)};
+    return _PyBcachefs_struct_sequence(PyBcachefs_ExtentType, items, 4);
+}
+
+static PyObject *_PyBcachefs_new_inode(const Bcachefs_inode *inode)
+{
+    PyObject *items[] = {PyLong_FromUnsignedLongLong(inode->inode),
+                         PyLong_FromUnsignedLongLong(inode->size),
+                         PyLong_FromUnsignedLongLong(inode->hash_seed)};
+    return _PyBcachefs_struct_sequence(PyBcachefs_InodeType, items, 3);
+}
+
+static PyObject *_PyBcachefs_new_dirent(const Bcachefs_dirent *dirent)
+{
+    PyObject *items[] = {PyLong_FromUnsignedLongLong(dirent->parent_inode),
+                         PyLong_FromUnsignedLongLong(dirent->inode),
+                         PyLong_FromUnsignedLong(dirent->type),
+                         PyUnicode_FromStringAndSize((const char*)dirent->name, dirent->name_len),
+                         PyBool_FromLong(dirent->type == DT_DIR),
+                         PyBool_FromLong(dirent->type == DT_REG)};
+    return _PyBcachefs_struct_sequence(PyBcachefs_DirEntType, items, 6);
+}
+
+/**
+ * @brief Slot tp_iternext, skipping the deleted inodes and dirents
+ */
+
+static PyObject *PyBcachefs_iterator_iternext(PyBcachefs_iterator *self)
+{
+    if (self->_pyfs->_closing)
+    {
+        return NULL;
+    }
+    const enum btree_id type = self->_iter->type;
+    Bcachefs_extent extent = {0};
+    Bcachefs_inode inode = {0};
+    Bcachefs_dirent dirent = {0};
+    uint8_t name[UINT8_MAX];
+    int found;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->_lock);
+    pthread_rwlock_rdlock(&self->_pyfs->_lock);
+    found = _PyBcachefs_iterator_step(self, &extent, &inode, &dirent);
+    _PyBcachefs_copy_dirent_name(&dirent, name);
+    pthread_rwlock_unlock(&self->_pyfs->_lock);
+    pthread_mutex_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (!found)
+    {
+        return NULL;
+    }
+    switch ((int)type)
+    {
+    case BTREE_ID_extents:
+        return _PyBcachefs_new_extent(&extent);
+    case BTREE_ID_inodes:
+        return _PyBcachefs_new_inode(&inode);
+    default:
+        return _PyBcachefs_new_dirent(&dirent);
+    }
+}
+
+/**
+ * @brief Next item, deleted or not, as a tuple or `None` at the end
+ */
+
+static PyObject *PyBcachefs_iterator_next(PyBcachefs_iterator *self)
+{
+    const Bcachefs *fs = &self->_pyfs->_fs;
+    Bcachefs_iterator *iter = self->_iter;
+    if (self->_pyfs->_closing)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    const enum btree_id type = iter->type;
+    const struct bch_val *bch_val = NULL;
+    Bcachefs_extent extent = {0};
+    Bcachefs_inode inode = {0};
+    Bcachefs_dirent dirent = {0};
+    uint8_t name[UINT8_MAX];
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->_lock);
+    pthread_rwlock_rdlock(&self->_pyfs->_lock);
+    bch_val = Bcachefs_iter_next(fs, iter);
+    if (bch_val && type == BTREE_ID_extents)
+    {
+        extent = Bcachefs_iter_make_extent(fs, iter);
+    }
+    else if (bch_val && type == BTREE_ID_inodes)
+    {
+        inode = Bcachefs_iter_make_inode(fs, iter);
+    }
+    else if (bch_val && type == BTREE_ID_dirents)
+    {
+        dirent = Bcachefs_iter_make_dirent(fs, iter);
+        _PyBcachefs_copy_dirent_name(&dirent, name);
+    }
+    pthread_rwlock_unlock(&self->_pyfs->_lock);
+    pthread_mutex_unlock(&self->_lock);
+    Py_END_ALLOW_THREADS
+    if (bch_val && type == BTREE_ID_extents)
+    {
+        return Py_BuildValue("KKKK", extent.inode, extent.file_offset, extent.offset, extent.size);
+    }
+    else if (bch_val && type == BTREE_ID_inodes)
+    {
+        return Py_BuildValue("KKK", inode.inode, inode.size, inode.hash_seed);
+    }
+    else if (bch_val && type == BTREE_ID_dirents)
+    {
+        return Py_BuildValue("KKIU#", dirent.parent_inode, dirent.inode, (uint32_t)dirent.type, dirent.name, dirent.name_len);
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Continue the iteration from the first item at or after a position
+ */
+
+static PyObject *PyBcachefs_iterator_seek(PyBcachefs_iterator *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    if (nargs != 2)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 2 arguments");
+        return NULL;
+    }
+    uint64_t inode = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    uint64_t offset = (uint64_t)PyLong_AsUnsignedLongLong(args[1]);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    int seeked = 0;
+    if (!self->_pyfs->_closing)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->_lock);
+        pthread_rwlock_rdlock(&self->_pyfs->_lock);
+        seeked = Bcachefs_iter_seek(&self->_pyfs->_fs, self->_iter, inode, offset);
+        pthread_rwlock_unlock(&self->_pyfs->_lock);
+        pthread_mutex_unlock(&self->_lock);
+        Py_END_ALLOW_THREADS
+    }
+    if (!seeked)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error seeking Bcachefs iterator");
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/**
+ * @brief Fill a buffer of records with the next items, `Bcachefs_extent`,
+ *        `Bcachefs_inode` or `PyBcachefs_dirent_record`, and for dirents a
+ *        buffer with their names, skipping the deleted inodes and dirents
+ */
+
+static PyObject *PyBcachefs_iterator_next_batch(PyBcachefs_iterator *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    (void)kwnames;
+    const enum btree_id type = self->_iter->type;
+    const Py_ssize_t expected = type == BTREE_ID_dirents ? 2 : 1;
+    if (nargs != expected)
+    {
+        PyErr_Format(PyExc_RuntimeError, "Function takes %d argument%s",
+                     (int)expected, expected == 1 ? "" : "s");
+        return NULL;
+    }
+    size_t record_size = type == BTREE_ID_extents ? sizeof(Bcachefs_extent) :
+        type == BTREE_ID_inodes ? sizeof(Bcachefs_inode) : sizeof(PyBcachefs_dirent_record);
+    Py_buffer records = {0};
+    Py_buffer names = {0};
+    if (PyObject_GetBuffer(args[0], &records, PyBUF_WRITABLE) < 0)
+    {
+        return NULL;
+    }
+    if (expected == 2 && PyObject_GetBuffer(args[1], &names, PyBUF_WRITABLE) < 0)
+    {
+        PyBuffer_Release(&records);
+        return NULL;
+    }
+    PyObject *result = NULL;
+    if (!PyBuffer_IsContiguous(&records, 'C') || records.len % record_size)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Records buffer must be contiguous and "
+                                            "hold a whole number of records");
+        goto cleanup;
+    }
+    if (expected == 2 && (!PyBuffer_IsContiguous(&names, 'C') || names.len < UINT8_MAX))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Names buffer must be contiguous and "
+                                            "hold at least 255 bytes");
+        goto cleanup;
+    }
+    size_t max_records = (size_t)records.len / record_size;
+    size_t num_records = 0;
+    if (!self->_pyfs->_closing)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->_lock);
+        pthread_rwlock_rdlock(&self->_pyfs->_lock);
+        uint64_t names_size = 0;
+        Bcachefs_extent extent;
+        Bcachefs_inode inode;
+        Bcachefs_dirent dirent;
+        // Stop early rather than leaving a name without room in the buffer
+        while (num_records < max_records &&
+               (type != BTREE_ID_dirents || (uint64_t)names.len - names_size >= UINT8_MAX) &&
+               _PyBcachefs_iterator_step(self, &extent, &inode, &dirent))
+        {
+            if (type == BTREE_ID_extents)
+            {
+                ((Bcachefs_extent*)records.buf)[num_records++] = extent;
+            }
+            else if (type == BTREE_ID_inodes)
+            {
+                ((Bcachefs_inode*)records.buf)[num_records++] = inode;
+            }
+            else
+            {
+                memcpy((uint8_t*)names.buf + names_size, dirent.name, dirent.name_len);
+                ((PyBcachefs_dirent_record*)records.buf)[num_records++] = (PyBcachefs_dirent_record){
+                    .parent_inode = dirent.parent_inode,
+                    .inode = dirent.inode,
+                    .name_offset = names_size,
+                    .name_len = dirent.name_len,
+                    .type = dirent.type
+                };
+                names_size += dirent.name_len;
+            }
+        }
+        pthread_rwlock_unlock(&self->_pyfs->_lock);
+        pthread_mutex_unlock(&self->_lock);
+        Py_END_ALLOW_THREADS
+    }
+    result = PyLong_FromSize_t(num_records);
+
+cleanup:
+    if (expected == 2)
+    {
+        PyBuffer_Release(&names);
+    }
+    PyBuffer_Release(&records);
+    return result;
+}
+
+/**
+ * Table of methods.
+ */
+
+static PyMethodDef PyBcachefs_iterator_methods[] = {
+    {"next", (PyCFunction)PyBcachefs_iterator_next, METH_NOARGS, "Iterate to next item"},
+    {"seek", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_iterator_seek,
+     METH_FASTCALL | METH_KEYWORDS, "Continue from the first item at or after (inode, offset)"},
+    {"next_batch", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_iterator_next_batch,
+     METH_FASTCALL | METH_KEYWORDS, "Fill a records buffer, and a names buffer for dirents, "
+     "with the next live items and return their number"},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyTypeObject PyBcachefs_iteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "benzina.c_bcachefs.Bcachefs_iterator",   /* tp_name */
+    sizeof(PyBcachefs_iterator),     /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    (destructor)PyBcachefs_iterator_dealloc,  /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_reserved */
+    0,                               /* tp_repr */
+    0,                               /* tp_as_number */
+    0,                               /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash  */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    0,                               /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Bcachefs_iterator object",      /* tp_doc */
+    0,                               /* tp_traverse */
+    0,                               /* tp_clear */
+    0,                               /* tp_richcompare */
+    0,                               /* tp_weaklistoffset */
+    PyObject_SelfIter,               /* tp_iter */
+    (iternextfunc)PyBcachefs_iterator_iternext, /* tp_iternext */
+    PyBcachefs_iterator_methods,     /* tp_methods */
+    0,                               /* tp_members */
+    0,                               /* tp_getset */
+    0,                               /* tp_base */
+    0,                               /* tp_dict */
+    0,                               /* tp_descr_get */
+    0,                               /* tp_descr_set */
+    0,                               /* tp_dictoffset */
+    0,                               /* tp_init */
+    0,                               /* tp_alloc */
+    PyBcachefs_iterator_new,         /* tp_new */
+};
+
+/**
+ * @brief Slot tp_dealloc
+ */
+
+static void PyBcachefs_file_dealloc(PyBcachefs_file *self)
+{
+    if (self->_pyfs)
+    {
+        _PyBcachefs_release(self->_pyfs);
+    }
+    Py_XDECREF((PyObject*)self->_pyfs);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/**
+ * @brief Slot tp_new
+ */
+
+static PyObject* PyBcachefs_file_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    (void)args;
+    (void)kwargs;
+    PyBcachefs_file *self = (void*)type->tp_alloc(type, 0);
+    if (self)
+    {
+        self->_pyfs = NULL;
+        self->_buf = NULL;
+        self->_len = 0;
+    }
+    return (PyObject*)self;
+}
+
+/**
+ * @brief Slot bf_getbuffer, exporting the content of the file read-only
+ */
+
+static int PyBcachefs_file_getbuffer(PyBcachefs_file *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject*)self, (void*)self->_buf, self->_len, 1, flags);
+}
+
+/**
+ * @brief Getter for nbytes.
+ */
+
+static PyObject* PyBcachefs_file_getnbytes(PyBcachefs_file* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromSsize_t(self->_len);
+}
+
+/**
+ * Table of getter-setters.
+ */
+
+static PyGetSetDef PyBcachefs_file_getsetters[] = {
+    {"nbytes", (getter)PyBcachefs_file_getnbytes, 0, "Size of the file", NULL},
+    {NULL, NULL, 0, NULL, NULL}  /* Sentinel */
+};
+
+static PyBufferProcs PyBcachefs_file_as_buffer = {
+    (getbufferproc)PyBcachefs_file_getbuffer,  /* bf_getbuffer */
+    0,                               /* bf_releasebuffer */
+};
+
+static PyTypeObject PyBcachefs_fileType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "benzina.c_bcachefs.Bcachefs_file",       /* tp_name */
+    sizeof(PyBcachefs_file),         /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    (destructor)PyBcachefs_file_dealloc,      /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_reserved */
+    0,                               /* tp_repr */
+    0,                               /* tp_as_number */
+    0,                               /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash  */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    &PyBcachefs_file_as_buffer,      /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Read-only view of a file in the mapping of an image, keeping the image open",  /* tp_doc */
+    0,                               /* tp_traverse */
+    0,                               /* tp_clear */
+    0,                               /* tp_richcompare */
+    0,                               /* tp_weaklistoffset */
+    0,                               /* tp_iter */
+    0,                               /* tp_iternext */
+    0,                               /* tp_methods */
+    0,                               /* tp_members */
+    PyBcachefs_file_getsetters,      /* tp_getset */
+    0,                               /* tp_base */
+    0,                               /* tp_dict */
+    0,                               /* tp_descr_get */
+    0,                               /* tp_descr_set */
+    0,                               /* tp_dictoffset */
+    0,                               /* tp_init */
+    0,                               /* tp_alloc */
+    PyBcachefs_file_new,             /* tp_new */
+};
+
+/**
+ * @brief Slot tp_dealloc
+ */
+
+static void PyBcachefs_catalog_dealloc(PyBcachefs_catalog *self)
 {
-    Bcachefs_close(&self->_fs);
+    Bcachefs_index_close(&self->_index);
     Py_TYPE(self)->tp_free(self);
 }
 
@@ -21,91 +1721,125 @@ static void PyBcachefs_dealloc(PyBcachefs* self)
  * @brief Slot tp_new
  */
 
-static PyObject* PyBcachefs_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+static PyObject* PyBcachefs_catalog_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
 {
     (void)args;
     (void)kwargs;
-    return type->tp_alloc(type, 0);
+    PyBcachefs_catalog *self = (void*)type->tp_alloc(type, 0);
+    if (self)
+    {
+        self->_index = (Bcachefs_index){0};
+    }
+    return (PyObject*)self;
 }
 
 /**
- * @brief
+ * @brief Check that a catalog was built before querying it
  */
 
-static PyObject *PyBcachefs_open(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+static int _PyBcachefs_catalog_check(PyBcachefs_catalog *self, Py_ssize_t nargs, Py_ssize_t expected)
 {
-    (void)kwnames;
-    self->_fs = BCACHEFS_CLEAN;
-    if (nargs != 1 || !Bcachefs_open(&self->_fs, (void*)PyUnicode_1BYTE_DATA(args[0])))
+    if (self->_index.header == NULL)
     {
-        PyErr_SetString(PyExc_RuntimeError, "Error opening Bcachefs image file");
-        return NULL;
+        PyErr_SetString(PyExc_RuntimeError, "Catalog was not built");
+        return 0;
     }
-    Py_INCREF(Py_None);
-    return Py_None;
+    if (nargs != expected)
+    {
+        PyErr_Format(PyExc_RuntimeError, "Function takes %d argument%s",
+                     (int)expected, expected == 1 ? "" : "s");
+        return 0;
+    }
+    return 1;
 }
 
 /**
- * @brief
+ * @brief Find the entry of a directory by name
  */
 
-static PyObject *PyBcachefs_close(PyBcachefs *self)
+static PyObject *PyBcachefs_catalog_find_dirent(PyBcachefs_catalog *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    if (!Bcachefs_close(&self->_fs))
+    (void)kwnames;
+    if (!_PyBcachefs_catalog_check(self, nargs, 2))
     {
-        PyErr_SetString(PyExc_RuntimeError, "Error closing Bcachefs image file");
         return NULL;
     }
+    uint64_t parent_inode = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    char *name;
+    Py_ssize_t len;
+    if (PyErr_Occurred() || PyBytes_AsStringAndSize(args[1], &name, &len) < 0)
+    {
+        return NULL;
+    }
+    Bcachefs_dirent dirent = {0};
+    if (len <= UINT8_MAX)
+    {
+        dirent = Bcachefs_index_find_dirent(&self->_index, parent_inode, (const void*)name, (uint8_t)len);
+    }
+    if (dirent.inode)
+    {
+        return Py_BuildValue("KKIU#", dirent.parent_inode, dirent.inode, (uint32_t)dirent.type, dirent.name, (Py_ssize_t)dirent.name_len);
+    }
+
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 /**
- * @brief
+ * @brief List the entries of a directory, sorted by name
  */
 
-static PyObject *PyBcachefs_iter(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+static PyObject *PyBcachefs_catalog_scandir(PyBcachefs_catalog *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
     (void)kwnames;
-    PyBcachefs_iterator *iter = (void*)PyObject_CallObject((PyObject*)&PyBcachefs_iteratorType, NULL);
-    if (iter)
+    if (!_PyBcachefs_catalog_check(self, nargs, 1))
     {
-        Py_INCREF(self);
-        iter->_pyfs = self;
+        return NULL;
     }
-    if (iter == NULL || nargs != 1)
+    uint64_t parent_inode = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    if (PyErr_Occurred())
     {
-        PyErr_SetString(PyExc_RuntimeError, "Error initializing Bcachefs iterator");
-        Py_XDECREF(iter);
         return NULL;
     }
-    iter->_iter = Bcachefs_iter(&iter->_pyfs->_fs, (enum btree_id)(int)PyLong_AsLong(args[0]));
-    if (iter->_iter == NULL)
+    uint64_t num_dirents;
+    uint64_t first = Bcachefs_index_dirents(&self->_index, parent_inode, &num_dirents);
+    PyObject *list = PyList_New((Py_ssize_t)num_dirents);
+    uint8_t name[BCACHEFS_INDEX_NAME_SIZE];
+    for (uint64_t i = 0; list && i < num_dirents; ++i)
     {
-        PyErr_SetString(PyExc_RuntimeError, "Error initializing Bcachefs iterator");
-        Py_DECREF(iter);
-        return NULL;
+        Bcachefs_dirent dirent = Bcachefs_index_get_dirent(&self->_index, first + i, name);
+        PyObject *item = Py_BuildValue("KKIU#", dirent.parent_inode, dirent.inode, (uint32_t)dirent.type,
+                                       dirent.name, (Py_ssize_t)dirent.name_len);
+        if (item == NULL)
+        {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t)i, item);
     }
-    Py_INCREF(iter);
-    return (PyObject*)iter;
+    return list;
 }
 
 /**
- * @brief
+ * @brief Find the size and hash seed of an inode
  */
 
-static PyObject *PyBcachefs_find_extent(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+static PyObject *PyBcachefs_catalog_find_inode(PyBcachefs_catalog *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
     (void)kwnames;
-    if (nargs != 2)
+    if (!_PyBcachefs_catalog_check(self, nargs, 1))
     {
-        PyErr_SetString(PyExc_RuntimeError, "Function takes 2 arguments");
         return NULL;
     }
-    Bcachefs_extent extent = Bcachefs_find_extent(&self->_fs, (uint64_t)PyLong_AsLong(args[0]), (uint64_t)PyLong_AsLong(args[1]));
-    if (extent.inode)
+    uint64_t inode_num = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    if (PyErr_Occurred())
     {
-        return Py_BuildValue("KKKK", extent.inode, extent.file_offset, extent.offset, extent.size);
+        return NULL;
+    }
+    Bcachefs_inode inode = Bcachefs_index_find_inode(&self->_index, inode_num);
+    if (inode.inode)
+    {
+        return Py_BuildValue("KKK", inode.inode, inode.size, inode.hash_seed);
     }
 
     Py_INCREF(Py_None);
@@ -113,76 +1847,129 @@ static PyObject *PyBcachefs_find_extent(PyBcachefs *self, PyObject *const *args,
 }
 
 /**
- * @brief
+ * @brief Find the merged extent runs of a file, sorted by file offset
  */
 
-static PyObject *PyBcachefs_find_inode(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+static PyObject *PyBcachefs_catalog_find_extents(PyBcachefs_catalog *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
     (void)kwnames;
-    if (nargs != 1)
+    if (!_PyBcachefs_catalog_check(self, nargs, 1))
     {
-        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
         return NULL;
     }
-    Bcachefs_inode inode = Bcachefs_find_inode(&self->_fs, (uint64_t)PyLong_AsLong(args[0]));
-    if (inode.inode)
+    uint64_t inode = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    if (PyErr_Occurred())
     {
-        return Py_BuildValue("KKK", inode.inode, inode.size, inode.hash_seed);
+        return NULL;
     }
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    uint32_t num_extents = Bcachefs_index_find_extents(&self->_index, inode, NULL, 0);
+    Bcachefs_extent *extents = malloc((num_extents ? num_extents : 1) * sizeof(Bcachefs_extent));
+    if (extents == NULL)
+    {
+        return PyErr_NoMemory();
+    }
+    Bcachefs_index_find_extents(&self->_index, inode, extents, num_extents);
+    PyObject *list = PyList_New((Py_ssize_t)num_extents);
+    for (uint32_t i = 0; list && i < num_extents; ++i)
+    {
+        PyObject *item = Py_BuildValue("KKKK", extents[i].inode, extents[i].file_offset,
+                                       extents[i].offset, extents[i].size);
+        if (item == NULL)
+        {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t)i, item);
+    }
+    free(extents);
+    return list;
 }
 
 /**
- * @brief
+ * @brief Full path of an inode relative to the root directory
  */
 
-static PyObject *PyBcachefs_find_dirent(PyBcachefs *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+static PyObject *PyBcachefs_catalog_path(PyBcachefs_catalog *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
     (void)kwnames;
-    if (nargs != 3)
+    if (!_PyBcachefs_catalog_check(self, nargs, 1))
     {
-        PyErr_SetString(PyExc_RuntimeError, "Function takes 3 arguments");
         return NULL;
     }
-
-    Bcachefs_dirent dirent = Bcachefs_find_dirent(&self->_fs, (uint64_t)PyLong_AsLong(args[0]), (uint64_t)PyLong_AsLong(args[1]), (const void*)PyBytes_AsString(args[2]), PyBytes_Size(args[2]));
-    if (dirent.inode)
+    uint64_t inode = (uint64_t)PyLong_AsUnsignedLongLong(args[0]);
+    if (PyErr_Occurred())
     {
-        return Py_BuildValue("KKIU#", dirent.parent_inode, dirent.inode, (uint32_t)dirent.type, dirent.name, dirent.name_len);
+        return NULL;
     }
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    char buffer[256];
+    char *path = buffer;
+    int64_t len = Bcachefs_index_path(&self->_index, inode, path, sizeof(buffer));
+    if (len < 0)
+    {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if ((uint64_t)len >= sizeof(buffer))
+    {
+        path = malloc((size_t)len + 1);
+        if (path == NULL)
+        {
+            return PyErr_NoMemory();
+        }
+        Bcachefs_index_path(&self->_index, inode, path, (uint64_t)len + 1);
+    }
+    PyObject *str = PyUnicode_FromStringAndSize(path, (Py_ssize_t)len);
+    if (path != buffer)
+    {
+        free(path);
+    }
+    return str;
 }
 
 /**
- * @brief Getter for length.
+ * @brief Getters of the number of items in the sections of the catalog and of
+ * its size
  */
 
-static PyObject* PyBcachefs_getsize(PyBcachefs* self, void* closure)
+static PyObject* PyBcachefs_catalog_getnum_dirents(PyBcachefs_catalog* self, void* closure)
 {
     (void)closure;
-    return PyLong_FromLong(self->_fs.size);
+    return PyLong_FromUnsignedLongLong(self->_index.header ? self->_index.header->num_dirents : 0);
+}
+
+static PyObject* PyBcachefs_catalog_getnum_inodes(PyBcachefs_catalog* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromUnsignedLongLong(self->_index.header ? self->_index.header->num_inodes : 0);
+}
+
+static PyObject* PyBcachefs_catalog_getnum_extents(PyBcachefs_catalog* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromUnsignedLongLong(self->_index.header ? self->_index.header->num_extents : 0);
+}
+
+static PyObject* PyBcachefs_catalog_getnbytes(PyBcachefs_catalog* self, void* closure)
+{
+    (void)closure;
+    return PyLong_FromUnsignedLongLong(self->_index.size);
 }
 
 /**
  * Table of methods.
  */
 
-static PyMethodDef PyBcachefs_methods[] = {
-    {"open", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_open,
-     METH_FASTCALL | METH_KEYWORDS, "Open bcachefs file to read"},
-    {"close", (PyCFunction)PyBcachefs_close, METH_NOARGS, "Close bcachefs file"},
-    {"find_extent", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_extent,
-     METH_FASTCALL | METH_KEYWORDS, "Find extent"},
-    {"find_inode", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_inode,
+static PyMethodDef PyBcachefs_catalog_methods[] = {
+    {"find_dirent", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_catalog_find_dirent,
+     METH_FASTCALL | METH_KEYWORDS, "Find the entry of a directory by name"},
+    {"scandir", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_catalog_scandir,
+     METH_FASTCALL | METH_KEYWORDS, "List the entries of a directory"},
+    {"find_inode", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_catalog_find_inode,
      METH_FASTCALL | METH_KEYWORDS, "Find inode"},
-    {"find_dirent", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_find_dirent,
-     METH_FASTCALL | METH_KEYWORDS, "Find dirent"},
-    {"iter", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_iter,
-     METH_FASTCALL | METH_KEYWORDS, "Iterate over entries of specified type"},
+    {"find_extents", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_catalog_find_extents,
+     METH_FASTCALL | METH_KEYWORDS, "Find the merged extent runs of a file"},
+    {"path", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_catalog_path,
+     METH_FASTCALL | METH_KEYWORDS, "Full path of an inode"},
     {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
@@ -190,17 +1977,20 @@ static PyMethodDef PyBcachefs_methods[] = {
  * Table of getter-setters.
  */
 
-static PyGetSetDef PyBcachefs_getsetters[] = {
-    {"size", (getter)PyBcachefs_getsize, 0, "Size of the image file", NULL},
+static PyGetSetDef PyBcachefs_catalog_getsetters[] = {
+    {"num_dirents", (getter)PyBcachefs_catalog_getnum_dirents, 0, "Number of directory entries", NULL},
+    {"num_inodes", (getter)PyBcachefs_catalog_getnum_inodes, 0, "Number of inodes", NULL},
+    {"num_extents", (getter)PyBcachefs_catalog_getnum_extents, 0, "Number of extent runs and holes", NULL},
+    {"nbytes", (getter)PyBcachefs_catalog_getnbytes, 0, "Size of the catalog in bytes", NULL},
     {NULL, NULL, 0, NULL, NULL}  /* Sentinel */
 };
 
-static PyTypeObject PyBcachefsType = {
+static PyTypeObject PyBcachefs_catalogType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "benzina.c_bcachefs.Bcachefs",   /* tp_name */
-    sizeof(PyBcachefs),              /* tp_basicsize */
+    "benzina.c_bcachefs.Bcachefs_catalog",    /* tp_name */
+    sizeof(PyBcachefs_catalog),      /* tp_basicsize */
     0,                               /* tp_itemsize */
-    (destructor)PyBcachefs_dealloc,  /* tp_dealloc */
+    (destructor)PyBcachefs_catalog_dealloc,   /* tp_dealloc */
     0,                               /* tp_print */
     0,                               /* tp_getattr */
     0,                               /* tp_setattr */
@@ -216,16 +2006,16 @@ static PyTypeObject PyBcachefsType = {
     0,                               /* tp_setattro */
     0,                               /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT,              /* tp_flags */
-    "Bcachefs object",               /* tp_doc */
+    "Read-only catalog of the paths, inodes and extent runs of an image",  /* tp_doc */
     0,                               /* tp_traverse */
     0,                               /* tp_clear */
     0,                               /* tp_richcompare */
     0,                               /* tp_weaklistoffset */
     0,                               /* tp_iter */
     0,                               /* tp_iternext */
-    PyBcachefs_methods,              /* tp_methods */
+    PyBcachefs_catalog_methods,      /* tp_methods */
     0,                               /* tp_members */
-    PyBcachefs_getsetters,           /* tp_getset */
+    PyBcachefs_catalog_getsetters,   /* tp_getset */
     0,                               /* tp_base */
     0,                               /* tp_dict */
     0,                               /* tp_descr_get */
@@ -233,121 +2023,163 @@ static PyTypeObject PyBcachefsType = {
     0,                               /* tp_dictoffset */
     0,                               /* tp_init */
     0,                               /* tp_alloc */
-    PyBcachefs_new,                  /* tp_new */
+    PyBcachefs_catalog_new,          /* tp_new */
 };
 
 /**
- * @brief Slot tp_dealloc
+ * Struct sequences of the items of the iterators.
  */
 
-static void PyBcachefs_iterator_dealloc(PyBcachefs_iterator* self)
+static PyStructSequence_Field PyBcachefs_Extent_fields[] = {
+    {"inode", "inode of the file"},
+    {"file_offset", "position of the extent in the file"},
+    {"offset", "position of the extent in the disk image"},
+    {"size", "size of the extent"},
+    {NULL, NULL}  /* Sentinel */
+};
+
+static PyStructSequence_Desc PyBcachefs_Extent_desc = {
+    "bcachefs.c_bcachefs.Extent",
+    "Location of an extent of a file inside the disk image",
+    PyBcachefs_Extent_fields,
+    4
+};
+
+static PyStructSequence_Field PyBcachefs_Inode_fields[] = {
+    {"inode", "inode number"},
+    {"size", "size of the file"},
+    {"hash_seed", "seed of the hashes of the names of a directory"},
+    {NULL, NULL}  /* Sentinel */
+};
+
+static PyStructSequence_Desc PyBcachefs_Inode_desc = {
+    "bcachefs.c_bcachefs.Inode",
+    "Attributes of an inode",
+    PyBcachefs_Inode_fields,
+    3
+};
+
+static PyStructSequence_Field PyBcachefs_DirEnt_fields[] = {
+    {"parent_inode", "inode of the parent directory"},
+    {"inode", "inode of the entry"},
+    {"type", "file (8) or directory (4)"},
+    {"name", "name of the entry"},
+    {"is_dir", "the entry is a directory"},
+    {"is_file", "the entry is a regular file"},
+    {NULL, NULL}  /* Sentinel */
+};
+
+static PyStructSequence_Desc PyBcachefs_DirEnt_desc = {
+    "bcachefs.c_bcachefs.DirEnt",
+    "Directory entry, `is_dir` and `is_file` are not part of the sequence",
+    PyBcachefs_DirEnt_fields,
+    4
+};
+
+/**
+ * @brief Slot tp_str of DirEnt, the name of the entry
+ */
+
+static PyObject *PyBcachefs_DirEnt_str(PyObject *self)
 {
-    if (self->_iter)
-    {
-        Bcachefs_iter_fini(&self->_pyfs->_fs, self->_iter);
-        free(self->_iter);
-        self->_iter = NULL;
-    }
-    Py_XDECREF((PyObject*)self->_pyfs);
-    Py_TYPE(self)->tp_free(self);
+    PyObject *name = PyStructSequence_GET_ITEM(self, 3);
+    Py_INCREF(name);
+    return name;
 }
 
 /**
- * @brief Slot tp_new
+ * @brief Create a struct sequence type and add it to the module
  */
 
-static PyObject* PyBcachefs_iterator_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+static PyTypeObject *_PyBcachefs_add_struct_sequence(PyObject *module, const char *name, PyStructSequence_Desc *desc)
 {
-    (void)args;
-    (void)kwargs;
-    return type->tp_alloc(type, 0);
+    PyTypeObject *type = PyStructSequence_NewType(desc);
+    if (type == NULL)
+    {
+        return NULL;
+    }
+    Py_INCREF(type);
+    if (PyModule_AddObject(module, name, (PyObject*)type) < 0)
+    {
+        Py_DECREF(type);
+        Py_DECREF(type);
+        return NULL;
+    }
+    return type;
 }
 
 /**
- * @brief
+ * @brief Resolve the `(inode, file_offset, offset, size)` extents of a file,
+ *        in the order of the extents btree, into the runs an index holds
  */
 
-static PyObject *PyBcachefs_iterator_next(PyBcachefs_iterator *self)
+static PyObject *PyBcachefs_extent_runs(PyObject *module, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    const Bcachefs *fs = &self->_pyfs->_fs;
-    Bcachefs_iterator *iter = self->_iter;
-    const struct bch_val *bch_val = Bcachefs_iter_next(fs, iter);
-    if (bch_val && iter->type == BTREE_ID_extents)
+    (void)module;
+    (void)kwnames;
+    if (nargs != 1)
     {
-        Bcachefs_extent extent = Bcachefs_iter_make_extent(fs, iter);
-        return Py_BuildValue("KKKK", extent.inode, extent.file_offset, extent.offset, extent.size);
+        PyErr_SetString(PyExc_RuntimeError, "Function takes 1 argument");
+        return NULL;
     }
-    else if (bch_val && iter->type == BTREE_ID_inodes)
+    PyObject *seq = PySequence_Fast(args[0], "Extents must be a sequence");
+    if (seq == NULL)
     {
-        Bcachefs_inode inode = Bcachefs_iter_make_inode(fs, iter);
-        return Py_BuildValue("KKK", inode.inode, inode.size, inode.hash_seed);
+        return NULL;
     }
-    else if (bch_val && iter->type == BTREE_ID_dirents)
+    Py_ssize_t num_extents = PySequence_Fast_GET_SIZE(seq);
+    Bcachefs_extent *runs = PyMem_Calloc(num_extents + 2, sizeof(Bcachefs_extent));
+    PyObject *results = NULL;
+    uint32_t num_runs = 0;
+    if (runs == NULL || num_extents > UINT32_MAX - 2)
     {
-        Bcachefs_dirent dirent = Bcachefs_iter_make_dirent(fs, iter);
-        return Py_BuildValue("KKIU#", dirent.parent_inode, dirent.inode, (uint32_t)dirent.type, dirent.name, dirent.name_len);
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (Py_ssize_t i = 0; i < num_extents; ++i)
+    {
+        unsigned long long inode, file_offset, offset, size;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "KKKK", &inode, &file_offset, &offset, &size))
+        {
+            goto cleanup;
+        }
+        Bcachefs_extent extent = {.inode = inode, .file_offset = file_offset, .offset = offset, .size = size};
+        num_runs = Bcachefs_add_extent_run(runs, num_runs, extent);
+    }
+    results = PyList_New(num_runs);
+    for (uint32_t i = 0; results && i < num_runs; ++i)
+    {
+        PyObject *run = Py_BuildValue("KKKK", runs[i].inode, runs[i].file_offset, runs[i].offset, runs[i].size);
+        if (run == NULL)
+        {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, run);
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+cleanup:
+    PyMem_Free(runs);
+    Py_DECREF(seq);
+    return results;
 }
 
 /**
- * Table of methods.
+ * Table of module functions.
  */
 
-static PyMethodDef PyBcachefs_iterator_methods[] = {
-    {"next", (PyCFunction)PyBcachefs_iterator_next, METH_NOARGS, "Iterate to next item"},
+static PyMethodDef c_bcachefs_methods[] = {
+    {"extent_runs", (PyCFunction)(_PyCFunctionFastWithKeywords)PyBcachefs_extent_runs,
+     METH_FASTCALL | METH_KEYWORDS, "Resolve the extents of a file into runs, later extents winning"},
     {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
-static PyTypeObject PyBcachefs_iteratorType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "benzina.c_bcachefs.Bcachefs_iterator",   /* tp_name */
-    sizeof(PyBcachefs_iterator),     /* tp_basicsize */
-    0,                               /* tp_itemsize */
-    (destructor)PyBcachefs_iterator_dealloc,  /* tp_dealloc */
-    0,                               /* tp_print */
-    0,                               /* tp_getattr */
-    0,                               /* tp_setattr */
-    0,                               /* tp_reserved */
-    0,                               /* tp_repr */
-    0,                               /* tp_as_number */
-    0,                               /* tp_as_sequence */
-    0,                               /* tp_as_mapping */
-    0,                               /* tp_hash  */
-    0,                               /* tp_call */
-    0,                               /* tp_str */
-    0,                               /* tp_getattro */
-    0,                               /* tp_setattro */
-    0,                               /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,              /* tp_flags */
-    "Bcachefs_iterator object",      /* tp_doc */
-    0,                               /* tp_traverse */
-    0,                               /* tp_clear */
-    0,                               /* tp_richcompare */
-    0,                               /* tp_weaklistoffset */
-    0,                               /* tp_iter */
-    0,                               /* tp_iternext */
-    PyBcachefs_iterator_methods,     /* tp_methods */
-    0,                               /* tp_members */
-    0,                               /* tp_getset */
-    0,                               /* tp_base */
-    0,                               /* tp_dict */
-    0,                               /* tp_descr_get */
-    0,                               /* tp_descr_set */
-    0,                               /* tp_dictoffset */
-    0,                               /* tp_init */
-    0,                               /* tp_alloc */
-    PyBcachefs_iterator_new,         /* tp_new */
-};
-
 static PyModuleDef c_bcachefs_module_def = {
     PyModuleDef_HEAD_INIT,
     "c_bcachefs",          /* m_name */
     "bcachefs C module",   /* m_doc */
     -1,                    /* m_size */
-    NULL,                  /* m_methods */
+    c_bcachefs_methods,    /* m_methods */
     NULL,                  /* m_reload */
     NULL,                  /* m_traverse */
     NULL,                  /* m_clear */
@@ -364,6 +2196,12 @@ PyMODINIT_FUNC PyInit_c_bcachefs(void)
         return NULL;
     }
 
+    if (pthread_key_create(&_PyBcachefs_reader_key, _PyBcachefs_reader_free))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Error creating the key of the readers");
+        return NULL;
+    }
+
     #define ADDTYPE(T)                                              \
         do{                                                         \
             if(PyType_Ready(&T##Type) < 0){return NULL;}            \
@@ -372,7 +2210,24 @@ PyMODINIT_FUNC PyInit_c_bcachefs(void)
         }while(0)
     ADDTYPE(PyBcachefs);
     ADDTYPE(PyBcachefs_iterator);
+    ADDTYPE(PyBcachefs_file);
+    ADDTYPE(PyBcachefs_catalog);
     #undef ADDTYPE
 
+    PyBcachefs_ExtentType = _PyBcachefs_add_struct_sequence(module, "Extent", &PyBcachefs_Extent_desc);
+    PyBcachefs_InodeType = _PyBcachefs_add_struct_sequence(module, "Inode", &PyBcachefs_Inode_desc);
+    PyBcachefs_DirEntType = _PyBcachefs_add_struct_sequence(module, "DirEnt", &PyBcachefs_DirEnt_desc);
+    if (!PyBcachefs_ExtentType || !PyBcachefs_InodeType || !PyBcachefs_DirEntType)
+    {
+        return NULL;
+    }
+    PyBcachefs_DirEntType->tp_str = PyBcachefs_DirEnt_str;
+
+    PyModule_AddIntConstant(module, "BACKEND_FILE", BCACHEFS_BACKEND_FILE);
+    PyModule_AddIntConstant(module, "BACKEND_MMAP", BCACHEFS_BACKEND_MMAP);
+    PyModule_AddIntConstant(module, "READ_ENGINE_AUTO", BCACHEFS_READ_ENGINE_AUTO);
+    PyModule_AddIntConstant(module, "READ_ENGINE_THREADS", BCACHEFS_READ_ENGINE_THREADS);
+    PyModule_AddStringConstant(module, "INDEX_SUFFIX", BCACHEFS_INDEX_SUFFIX);
+
     return module;
 }
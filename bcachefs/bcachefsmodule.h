@@ -8,12 +8,18 @@
 
 #define  PY_SSIZE_T_CLEAN     /* So we get Py_ssize_t args. */
 #include <Python.h>           /* Because of "reasons", the Python header must be first. */
+#include <dirent.h>
+#include <pthread.h>
+#include "bcachefs_index.h"
 #include "bcachefs_iterator.h"
 
 /* Type Definitions and Forward Declarations */
 typedef struct {
     PyObject_HEAD
     Bcachefs _fs;
+    pthread_rwlock_t _lock; //! held for reading while the GIL is released, for writing to open or close `_fs`
+    Py_ssize_t _iterators;  //! number of live iterators and file views reading from `_fs`
+    int _closing;           //! `close` was requested while iterators or file views were alive
 } PyBcachefs;
 static PyTypeObject PyBcachefsType;
 
@@ -21,7 +27,43 @@ typedef struct {
     PyObject_HEAD
     PyBcachefs *_pyfs;
     Bcachefs_iterator *_iter;
+    pthread_mutex_t _lock;  //! serializes the threads advancing `_iter`
+    uint64_t *_deleted;     //! sorted inodes found deleted while iterating, guarded by `_lock`
+    size_t _num_deleted;
+    size_t _deleted_capacity;
 } PyBcachefs_iterator;
 static PyTypeObject PyBcachefs_iteratorType;
 
+//! Reader of each thread calling `read_batch`
+static pthread_key_t _PyBcachefs_reader_key;
+
+//! Struct sequences of the items of the iterators
+static PyTypeObject *PyBcachefs_ExtentType;
+static PyTypeObject *PyBcachefs_InodeType;
+static PyTypeObject *PyBcachefs_DirEntType;
+
+//! Dirent of a batch, its name lies in the names buffer of the batch
+typedef struct {
+    uint64_t parent_inode;
+    uint64_t inode;
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t type;
+} PyBcachefs_dirent_record;
+
+//! Read-only view of a file stored in a single extent of a mapped image
+typedef struct {
+    PyObject_HEAD
+    PyBcachefs *_pyfs;      //! image whose mapping holds the content of the file
+    const uint8_t *_buf;
+    Py_ssize_t _len;
+} PyBcachefs_file;
+static PyTypeObject PyBcachefs_fileType;
+
+typedef struct {
+    PyObject_HEAD
+    Bcachefs_index _index;  //! read-only after creation, queried without locks
+} PyBcachefs_catalog;
+static PyTypeObject PyBcachefs_catalogType;
+
 #endif // BCACHEFSMODULE_H
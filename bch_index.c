@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcachefs/bcachefs_index.h"
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: %s IMAGE [INDEX]\n", argv[0]);
+        fprintf(stderr, "Write the sidecar index of a Bcachefs disk image, "
+                        "IMAGE" BCACHEFS_INDEX_SUFFIX " by default\n");
+        return 2;
+    }
+    const char *image = argv[1];
+    char *path = NULL;
+    if (argc == 3)
+    {
+        path = strdup(argv[2]);
+    }
+    else if ((path = malloc(strlen(image) + sizeof(BCACHEFS_INDEX_SUFFIX))))
+    {
+        strcpy(path, image);
+        strcat(path, BCACHEFS_INDEX_SUFFIX);
+    }
+
+    Bcachefs bchfs = BCACHEFS_CLEAN;
+    Bcachefs_index index = {0};
+    int ret = path != NULL;
+    if (ret && !Bcachefs_open(&bchfs, image))
+    {
+        fprintf(stderr, "could not open %s\n", image);
+        ret = 0;
+    }
+    else if (ret && !Bcachefs_index_write(&bchfs, path))
+    {
+        fprintf(stderr, "could not write %s\n", path);
+        ret = 0;
+    }
+    else if (ret && !Bcachefs_index_open(&index, path, bchfs.sb))
+    {
+        fprintf(stderr, "could not read back %s\n", path);
+        ret = 0;
+    }
+    if (ret)
+    {
+        printf("%s: %llu bytes, %llu directories, %llu dirents, %llu inodes, %llu extent runs\n", path,
+               (unsigned long long)index.size,
+               (unsigned long long)index.header->num_dirs,
+               (unsigned long long)index.header->num_dirents,
+               (unsigned long long)index.header->num_inodes,
+               (unsigned long long)index.header->num_extents);
+    }
+    Bcachefs_index_close(&index);
+    Bcachefs_close(&bchfs);
+    free(path);
+    return ret ? 0 : 1;
+}
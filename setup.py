@@ -3,7 +3,7 @@ from setuptools import Extension, find_packages, setup
 import sys
 
 extra_compile_args = []
-libraries = []
+libraries = ["pthread"]
 
 # call python setup.py -coverage install to install with coverage enabled.
 # and debug symbols; coverage info will be generated in
@@ -13,7 +13,7 @@ if "-coverage" in sys.argv:
     sys.argv.remove("-coverage")
 
     extra_compile_args = ["-coverage", "-g3", "-O0"]
-    libraries = ["gcov"]
+    libraries += ["gcov"]
 elif "-debug" in sys.argv:
     print("Compiling with debug flags")
     sys.argv.remove("-debug")
@@ -26,7 +26,10 @@ bcachefs_module = Extension(
     name="bcachefs.c_bcachefs",
     sources=[
         "bcachefs/bcachefs.c",
+        "bcachefs/bcachefs_cache.c",
+        "bcachefs/bcachefs_index.c",
         "bcachefs/bcachefs_iterator.c",
+        "bcachefs/bcachefs_read.c",
         "bcachefs/bcachefsmodule.c",
         "bcachefs/utils.c",
         "libbenzina/bcachefs.c",
@@ -1,10 +1,13 @@
+import io
 import os
 import multiprocessing as mp
+from concurrent.futures import ThreadPoolExecutor
 
 import numpy as np
 import pytest
 
 import bcachefs as bch
+from bcachefs import c_bcachefs
 from testing import filepath
 
 
@@ -67,6 +70,417 @@ def test_mount(image):
         assert list(bchfs)
 
 
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_backends(image):
+    def _items(backend, t):
+        fs = c_bcachefs.PyBcachefs()
+        fs.open(image, backend)
+        it = fs.iter(t)
+        items = list(iter(it.next, None))
+        del it
+        fs.close()
+        return items
+
+    for t in (
+        bch.bcachefs.EXTENT_TYPE,
+        bch.bcachefs.INODE_TYPE,
+        bch.bcachefs.DIRENT_TYPE,
+    ):
+        assert _items(c_bcachefs.BACKEND_FILE, t) == _items(
+            c_bcachefs.BACKEND_MMAP, t
+        )
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_close(image):
+    def _mappings():
+        if not os.path.exists("/proc/self/maps"):
+            return 0
+        with open("/proc/self/maps") as maps:
+            return maps.read().count(os.path.realpath(image))
+
+    mappings = _mappings()
+    fs = c_bcachefs.PyBcachefs()
+    for _ in range(3):
+        fs.open(image)
+        assert list(iter(fs.iter(bch.bcachefs.DIRENT_TYPE).next, None))
+        fs.close()
+        assert fs.size == 0
+        assert _mappings() == mappings
+
+    fs.open(image)
+    it = fs.iter(bch.bcachefs.DIRENT_TYPE)
+    with pytest.raises(RuntimeError):
+        fs.open(image)
+    fs.close()
+    # The iterator stops but the close is deferred until it is released
+    assert it.next() is None
+    assert fs.size
+    del it
+    assert fs.size == 0
+    assert _mappings() == mappings
+
+    with pytest.raises(RuntimeError):
+        fs.open(image, 42)
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_threads(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    extents = list(iter(fs.iter(bch.bcachefs.EXTENT_TYPE).next, None))
+    dirents = list(iter(fs.iter(bch.bcachefs.DIRENT_TYPE).next, None))
+
+    def _lookups(_):
+        found_extents = [fs.find_extent(ext[0], ext[1]) for ext in extents]
+        found_inodes = [fs.find_inode(ext[0])[0] for ext in extents]
+        found_dirents = [
+            fs.find_dirent(ent[0], 0, ent[3].encode()) for ent in dirents
+        ]
+        items = list(iter(fs.iter(bch.bcachefs.DIRENT_TYPE).next, None))
+        return found_extents, found_inodes, found_dirents, items
+
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        for results in executor.map(_lookups, range(8)):
+            assert results == (
+                extents,
+                [ext[0] for ext in extents],
+                dirents,
+                dirents,
+            )
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_find_batch(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    extents = list(iter(fs.iter(bch.bcachefs.EXTENT_TYPE).next, None))
+    extents.reverse()
+    inodes = [ext[0] for ext in extents] + [2**40]
+
+    assert fs.find_inodes(inodes) == [fs.find_inode(i) for i in inodes]
+    assert fs.find_extents_batch(
+        [ext[:2] for ext in extents] + [(2**40, 0)]
+    ) == extents + [None]
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_iter_seek(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    extents = list(iter(fs.iter(bch.bcachefs.EXTENT_TYPE).next, None))
+    inodes = list(iter(fs.iter(bch.bcachefs.INODE_TYPE).next, None))
+
+    for i in range(0, len(extents), max(1, len(extents) // 50)):
+        it = fs.iter(bch.bcachefs.EXTENT_TYPE)
+        it.seek(extents[i][0], extents[i][1])
+        assert list(iter(it.next, None)) == extents[i:]
+        it.seek(extents[i][0], extents[i][1] + 1)
+        assert list(iter(it.next, None)) == extents[i + 1 :]
+
+    it = fs.iter(bch.bcachefs.INODE_TYPE)
+    it.seek(0, inodes[-1][0])
+    assert list(iter(it.next, None)) == inodes[-1:]
+    it.seek(0, inodes[-1][0] + 1)
+    assert it.next() is None
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_iter_native(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+
+    extents = list(iter(fs.iter(bch.bcachefs.EXTENT_TYPE).next, None))
+    assert list(fs.iter(bch.bcachefs.EXTENT_TYPE)) == extents
+    inodes = list(iter(fs.iter(bch.bcachefs.INODE_TYPE).next, None))
+    assert list(fs.iter(bch.bcachefs.INODE_TYPE)) == [
+        inode for inode in inodes if inode[2]
+    ]
+    dirents = list(iter(fs.iter(bch.bcachefs.DIRENT_TYPE).next, None))
+    native = list(fs.iter(bch.bcachefs.DIRENT_TYPE))
+    assert native == [ent for ent in dirents if ent[1]]
+
+    for ent in native:
+        assert isinstance(ent, c_bcachefs.DirEnt)
+        assert str(ent) == ent.name
+        assert ent.is_dir == (ent.type == bch.bcachefs.DIR_TYPE)
+        assert ent.is_file == (ent.type == bch.bcachefs.FILE_TYPE)
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_iter_next_batch(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+
+    for cls, record in (
+        (bch.bcachefs.BcachefsIterExtent, bch.bcachefs.Extent),
+        (bch.bcachefs.BcachefsIterInode, bch.bcachefs.Inode),
+    ):
+        batches = []
+        it = cls(fs)
+        while True:
+            batch = it.next_batch(7)
+            if not len(batch):
+                break
+            assert len(batch) <= 7
+            batches.extend(record(*item) for item in batch.tolist())
+        assert batches == list(cls(fs))
+
+    dirents = []
+    it = bch.bcachefs.BcachefsIterDirEnt(fs)
+    while True:
+        batch, names = it.next_batch(7)
+        if not len(batch):
+            break
+        for parent_inode, inode, name_offset, name_len, type in batch.tolist():
+            name = bytes(names[name_offset : name_offset + name_len])
+            dirents.append(
+                bch.bcachefs.DirEnt(parent_inode, inode, type, name.decode())
+            )
+    assert dirents == list(bch.bcachefs.BcachefsIterDirEnt(fs))
+
+    with pytest.raises(RuntimeError):
+        fs.iter(bch.bcachefs.EXTENT_TYPE).next_batch(bytearray(31))
+    with pytest.raises(RuntimeError):
+        fs.iter(bch.bcachefs.DIRENT_TYPE).next_batch(
+            bytearray(32), bytearray(16)
+        )
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_find_extents(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    merged = {}
+    for ext in iter(fs.iter(bch.bcachefs.EXTENT_TYPE).next, None):
+        extents = merged.setdefault(ext[0], [])
+        if (
+            extents
+            and extents[-1][1] + extents[-1][3] == ext[1]
+            and extents[-1][2] + extents[-1][3] == ext[2]
+        ):
+            last = extents.pop()
+            ext = (*last[:3], last[3] + ext[3])
+        extents.append(ext)
+
+    for inode, extents in merged.items():
+        assert fs.find_extents(inode) == extents
+    assert fs.find_extents(2**40) == []
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_find_extent_at(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    extents = list(iter(fs.iter(bch.bcachefs.EXTENT_TYPE).next, None))
+
+    for ext in extents:
+        inode, file_offset, _, size = ext
+        assert fs.find_extent_at(inode, file_offset) == ext
+        assert fs.find_extent_at(inode, file_offset + size // 2) == ext
+        assert fs.find_extent_at(inode, file_offset + size - 1) == ext
+    assert fs.find_extent_at(2**40, 0) is None
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_native_scandir(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    dirents = list(iter(fs.iter(bch.bcachefs.DIRENT_TYPE).next, None))
+
+    for parent in {ent[0] for ent in dirents} | {1}:
+        assert fs.scandir(parent) == [
+            ent for ent in dirents if ent[0] == parent and ent[1]
+        ]
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_dentry_cache(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    dirents = [
+        ent
+        for ent in iter(fs.iter(bch.bcachefs.DIRENT_TYPE).next, None)
+        if ent[1]
+    ]
+
+    for size in (4096, 2, 0):
+        fs.set_dentry_cache_size(size)
+        for _ in range(2):
+            assert [
+                fs.find_dirent(ent[0], 0, ent[3].encode()) for ent in dirents
+            ] == dirents
+            assert fs.find_dirent(1, 0, b"missing") is None
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_inode_cache(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    inodes = [
+        inode
+        for inode in iter(fs.iter(bch.bcachefs.INODE_TYPE).next, None)
+        if inode[0]
+    ]
+
+    for size in (0, 2, 16384):
+        fs.set_inode_cache_size(size)
+        assert fs.preload_inodes() == min(size, len(inodes))
+        for _ in range(2):
+            assert [fs.find_inode(inode[0]) for inode in inodes] == inodes
+
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_index(image, tmp_path):
+    index = str(tmp_path / "image.idx")
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    dirents = [
+        ent
+        for ent in iter(fs.iter(bch.bcachefs.DIRENT_TYPE).next, None)
+        if ent[1]
+    ]
+    inodes = [fs.find_inode(ent[1]) for ent in dirents]
+    extents = [fs.find_extents(ent[1]) for ent in dirents]
+    fs.write_index(index)
+    fs.close()
+
+    fs.open(image)
+    assert not fs.open_index(str(tmp_path / "missing.idx"))
+    assert fs.open_index(index)
+    assert [
+        fs.find_dirent(ent[0], 0, ent[3].encode()) for ent in dirents
+    ] == dirents
+    assert [fs.find_inode(ent[1]) for ent in dirents] == inodes
+    assert [fs.find_extents(ent[1]) for ent in dirents] == extents
+    assert fs.find_dirent(1, 0, b"missing") is None
+    fs.close()
+
+    # An index of another version of the image is stale
+    with open(index, "r+b") as f:
+        f.seek(32)
+        seq = int.from_bytes(f.read(8), "little")
+        f.seek(32)
+        f.write((seq + 1).to_bytes(8, "little"))
+    fs.open(image)
+    assert not fs.open_index(index)
+    fs.close()
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_catalog(image, tmp_path):
+    index = str(tmp_path / "image.idx")
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    dirents = [
+        ent
+        for ent in iter(fs.iter(bch.bcachefs.DIRENT_TYPE).next, None)
+        if ent[1]
+    ]
+    fs.write_index(index)
+    names_size = sum(len(ent[3].encode()) for ent in dirents)
+
+    for catalog in (fs.catalog(), fs.catalog(index)):
+        assert catalog.num_dirents == len(dirents)
+        # 12 bytes per dirent and 16 per directory, 32 per inode, 16 per
+        # extent run and front coded names
+        assert catalog.nbytes <= (
+            256
+            + 28 * (len(dirents) + 1)
+            + 32 * catalog.num_inodes
+            + 16 * catalog.num_extents
+            + names_size
+        )
+        for ent in dirents:
+            assert catalog.find_dirent(ent[0], ent[3].encode()) == ent
+            assert catalog.find_inode(ent[1]) == fs.find_inode(ent[1])
+            assert catalog.find_extents(ent[1]) == fs.find_extents(ent[1])
+            parent = 4096
+            for name in catalog.path(ent[1]).split("/"):
+                parent = catalog.find_dirent(parent, name.encode())[1]
+            assert parent == ent[1]
+        for parent in {ent[0] for ent in dirents}:
+            assert catalog.scandir(parent) == sorted(
+                fs.scandir(parent), key=lambda ent: ent[3].encode()
+            )
+        assert catalog.find_dirent(4096, b"missing") is None
+        assert catalog.path(0) is None
+
+    fs.close()
+
+
+def test_extent_runs():
+    # Stale keys of older bsets overlap the later ones, which win
+    extents = [
+        (1, 0, 100, 8),
+        (1, 8, 108, 8),
+        (1, 4, 500, 8),
+        (1, 16, 116, 16),
+        (1, 20, 300, 4),
+        (1, 24, 124, 8),
+    ]
+    assert c_bcachefs.extent_runs(extents) == [
+        (1, 0, 100, 4),
+        (1, 4, 500, 8),
+        (1, 12, 112, 8),
+        (1, 20, 300, 4),
+        (1, 24, 124, 8),
+    ]
+    # Duplicates collapse into a single run
+    assert c_bcachefs.extent_runs([(1, 0, 100, 8)] * 3) == [(1, 0, 100, 8)]
+    assert c_bcachefs.extent_runs([]) == []
+
+
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_read_batch(image):
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image)
+    extents = list(iter(fs.iter(bch.bcachefs.EXTENT_TYPE).next, None))
+    with open(image, "rb") as f:
+        expected = []
+        for _, _, offset, size in extents:
+            f.seek(offset)
+            expected.append(f.read(size))
+
+    for engine in (c_bcachefs.READ_ENGINE_AUTO, c_bcachefs.READ_ENGINE_THREADS):
+        buffers = [bytearray(ext[3]) for ext in extents]
+        sizes = fs.read_batch(
+            [(ext[2], buf) for ext, buf in zip(extents, buffers)], engine
+        )
+        assert sizes == [ext[3] for ext in extents]
+        assert buffers == expected
+
+    # Small batches reuse the reader of the thread
+    for ext, data in zip(extents[:10], expected):
+        buffer = bytearray(ext[3])
+        assert fs.read_batch([(ext[2], buffer)]) == [ext[3]]
+        assert buffer == data
+    with pytest.raises(RuntimeError):
+        fs.read_batch([], 42)
+
+    fs.close()
+
+
 def test___iter__(bchfs: bch.Bcachefs):
     if bchfs.filename.endswith(MINI):
         assert sorted([str(ent) for ent in bchfs]) == [
@@ -129,6 +543,50 @@ def test_read(bchfs: bch.Bcachefs):
             assert bchfs.read(ent) == f0
 
 
+@pytest.mark.parametrize("image", _TEST_IMAGES)
+def test_read_buffer(image):
+    with bch.mount(image) as bchfs:
+        files = [ent for ent in bchfs if not ent.is_dir][:100]
+        views = []
+        for ent in files:
+            with bchfs.open(ent) as f:
+                views.append(f.getbuffer())
+                assert isinstance(bchfs.read(ent), bytes)
+
+    # The views keep the image mapped after it was unmounted
+    fs = c_bcachefs.PyBcachefs()
+    fs.open(image, c_bcachefs.BACKEND_FILE)
+    assert fs.read_file(0) is None
+    for ent, view in zip(files, views):
+        data = fs.read_file(ent.inode)
+        assert isinstance(data, bytes)
+        assert view.readonly
+        assert view == data
+        assert io.BytesIO(view).read() == data
+        assert np.frombuffer(view, dtype="<u1").tobytes() == data
+    fs.close()
+
+
+def test_dirents(filesystem: bch.Bcachefs):
+    dirents = list(filesystem.dirents())
+    assert sorted(map(str, dirents)) == sorted(map(str, filesystem))
+    files = [ent for ent in dirents if ent.is_file][:100]
+    for ent in files:
+        assert filesystem.read(ent) == filesystem.read(
+            bch.bcachefs.DirEnt(*ent)
+        )
+
+
+@pytest.mark.images_only([MINI])
+def test_seek(bchfs: bch.Bcachefs):
+    with bchfs.open("file1", "rb") as f:
+        f.seek(5)
+        assert f.tell() == 5
+        assert f.read(10) == b"File content 1\n"[5:]
+        f.seek(-2, io.SEEK_END)
+        assert f.read(2) == b"1\n"
+
+
 def test_readinto(bchfs: bch.Bcachefs):
     buffer = np.empty(20, dtype="<u1")
     buffer = memoryview(buffer)